@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "byte_io.h"
+#include "random.h"
+#include "options.h"
+#include "pipeline.h"
+#include "lzw_encode.h"
+#include "lzw_decode.h"
+#include "huffman.h"
+#include "hamming.h"
+#include "channel.h"
+#include "bench.h"
+
+/* The benchmark runs every subcommand in subcommands.h (as a
+ * whole pipeline, just as main would run it, with whatever
+ * options were given) over a few kinds of generated data at a
+ * range of sizes, and prints a line of JSON about each run:
+ *
+ *     {"bench": "compress", "corpus": "text", "size": 1048576,
+ *      "in_bytes": 1048576, "out_bytes": 442146, "ratio": 0.4217,
+ *      "seconds": 0.0421, "mb_per_s": 24.9, "ns_per_byte": 40.1,
+ *      "peak_rss_kb": 3172, "threads": 0, "jobs": 1,
+ *      "block_size": 0}
+ *
+ * (all on one line). size is how big the generated data was,
+ * and the speeds are in terms of that, so that the numbers for
+ * different pipelines over the same data can be compared
+ * directly. in_bytes is what the pipeline was actually fed,
+ * which is only different for ones that start by decoding (see
+ * prepare()), and ratio is out_bytes / in_bytes. peak_rss_kb is
+ * the most memory any one of the pipeline's processes had at
+ * once. Everything is deterministic except the timing, so two
+ * runs' output can be compared line by line.
+ */
+
+/* The data comes in sizes starting from this, going up 16
+ * times at a time to opts.bench_size (which can't be more
+ * than BENCH_MAX_SIZE, since it all has to fit in memory). */
+#define BENCH_MIN_SIZE ((size_t)4 << 10)
+#define BENCH_MAX_SIZE ((word)4 << 30)
+
+/* Runs of data up to this size are timed this many times,
+ * keeping the best, since they're quick and noisy. Anything
+ * bigger is just timed once. */
+#define BENCH_REPEAT_SIZE ((size_t)1 << 20)
+#define BENCH_REPEATS 3
+
+/* The subcommands to run: each one's name and stages. */
+typedef struct bench_case {
+    const char *name;
+    stage *steps;
+    const char *stage_names;
+} bench_case;
+
+#define SUB(c, ...) {#c, (stage[]){__VA_ARGS__, NULL}, #__VA_ARGS__},
+#define TOOL(c, fn, description)
+static const bench_case cases[] = {
+#include "subcommands.h"
+};
+#define CASES (sizeof(cases) / sizeof(cases[0]))
+
+/* Text-ish data: words from a made-up vocabulary, chosen with
+ * a Zipf distribution (the kth most common word turns up about
+ * 1/k as often as the most common one), as in real text, with
+ * spaces, the odd comma and full stop, and lines of about 70
+ * characters.
+ */
+#define TEXT_WORDS 8192
+static void make_text(rng *r, byte *data, size_t length) {
+    static char words[TEXT_WORDS][16];
+    static double cumulative[TEXT_WORDS];
+    double total = 0;
+    for (size_t i = 0; i < TEXT_WORDS; i++) {
+        /* shorter words are more common too, roughly */
+        size_t n = 1 + rng_below(r, 3 + i * 10 / TEXT_WORDS)
+            + rng_below(r, 3);
+        for (size_t j = 0; j < n; j++) {
+            words[i][j] = 'a' + rng_below(r, 26);
+        }
+        words[i][n] = '\0';
+        cumulative[i] = total += 1.0 / (i + 1);
+    }
+
+    size_t at = 0, line = 0;
+    while (at < length) {
+        /* find the first word whose cumulative weight is past a
+         * random point in the total */
+        double u = rng_double(r) * total;
+        size_t lo = 0, hi = TEXT_WORDS - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (cumulative[mid] <= u) lo = mid + 1;
+            else hi = mid;
+        }
+        char piece[20];
+        size_t n = strlen(words[lo]);
+        memcpy(piece, words[lo], n);
+        uint64_t punctuation = rng_below(r, 16);
+        if (!punctuation) piece[n++] = '.';
+        else if (punctuation == 1) piece[n++] = ',';
+        line += n + 1;
+        piece[n++] = line > 70 ? '\n' : ' ';
+        if (line > 70) line = 0;
+        if (n > length - at) n = length - at;
+        memcpy(data + at, piece, n);
+        at += n;
+    }
+}
+
+/* Noise, which nothing can compress. */
+static void make_random(rng *r, byte *data, size_t length) {
+    for (size_t at = 0; at < length; at += 8) {
+        uint64_t bits = rng_next(r);
+        memcpy(data + at, &bits, length - at < 8 ? length - at : 8);
+    }
+}
+
+/* Runs of the same byte, mostly short but some long, of a
+ * handful of different bytes: something like a simple image.
+ */
+static void make_runs(rng *r, byte *data, size_t length) {
+    size_t at = 0;
+    while (at < length) {
+        size_t n = 1 + rng_below(r, 1 + rng_below(r, 256));
+        if (n > length - at) n = length - at;
+        memset(data + at, rng_below(r, 16), n);
+        at += n;
+    }
+}
+
+/* 32-byte records of the sort a program might log or save:
+ * a counting id, a slowly increasing timestamp, a couple of
+ * small enums, a smallish number and 8 bytes of noise, all
+ * little-endian, and some zero padding.
+ */
+static void put_le(byte *p, uint64_t n, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++, n >>= 8) p[i] = n;
+}
+
+static void make_binary(rng *r, byte *data, size_t length) {
+    uint64_t time = 1500000000;
+    for (size_t at = 0, id = 0; at < length; at += 32, id++) {
+        byte record[32] = {0};
+        time += rng_below(r, 1000);
+        put_le(record, id, 4);
+        put_le(record + 4, time, 4);
+        put_le(record + 8, rng_below(r, 8), 2);
+        put_le(record + 10, rng_below(r, 4) << 8, 2);
+        put_le(record + 12, rng_below(r, 1 << 20), 8);
+        put_le(record + 20, rng_next(r), 8);
+        memcpy(data + at, record, length - at < 32 ? length - at : 32);
+    }
+}
+
+typedef struct corpus {
+    const char *name;
+    void (*make)(rng *r, byte *data, size_t length);
+} corpus;
+
+static const corpus corpora[] = {
+    {"text", make_text},
+    {"random", make_random},
+    {"runs", make_runs},
+    {"binary", make_binary},
+};
+#define CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+/* Make length bytes of the given kind in a new memory-backed
+ * file, and return its file descriptor. The same kind and
+ * length always gives the same bytes.
+ */
+static int make_corpus(size_t which, size_t length) {
+    int fd = memfd_create(corpora[which].name, 0);
+    if (fd < 0 || ftruncate(fd, length) < 0) {
+        WHINE("couldn't make %zu bytes of test data\n", length);
+        exit(1);
+    }
+    byte *data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        WHINE("couldn't make %zu bytes of test data\n", length);
+        exit(1);
+    }
+    rng r;
+    rng_seed(&r, which + 1);
+    corpora[which].make(&r, data, length);
+    munmap(data, length);
+    return fd;
+}
+
+/* What one run of a pipeline did. */
+typedef struct run_result {
+    double seconds;
+    size_t out_bytes;
+    long peak_rss_kb;
+} run_result;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Run steps in a child process, from the start of file
+ * descriptor in to file descriptor out, or if out is -1, to a
+ * pipe that we read and count and throw away (so a pipeline's
+ * last stage writes to a pipe as it usually would). The child
+ * reports its peak memory use back over a pipe of its own,
+ * taking the biggest of its own and its children's, which
+ * pipeline() makes sure have all exited by then. (names are
+ * the stages' names, for --stats.)
+ */
+static run_result run(stage *steps, const char *names, int in, int out) {
+    int data[2] = {-1, -1}, report[2];
+    if (out < 0) {
+        pipe(data);
+        enlarge_pipe(data[1]);
+        out = data[1];
+    }
+    pipe(report);
+    lseek(in, 0, SEEK_SET);
+
+    run_result result = {0};
+    double start = now();
+    pid_t child = fork();
+    if (!child) {
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        close(in);
+        close(out);
+        if (data[0] >= 0) close(data[0]);
+        close(report[0]);
+        run_pipeline(STDIN_FILENO, STDOUT_FILENO, steps, names);
+        struct rusage self, children;
+        getrusage(RUSAGE_SELF, &self);
+        getrusage(RUSAGE_CHILDREN, &children);
+        long peak = self.ru_maxrss > children.ru_maxrss
+            ? self.ru_maxrss : children.ru_maxrss;
+        write(report[1], &peak, sizeof(peak));
+        _exit(0);
+    }
+    close(report[1]);
+    if (data[0] >= 0) {
+        close(data[1]);
+        byte *buffer = malloc(BYTES_PIPE_SIZE);
+        ssize_t n;
+        while ((n = read(data[0], buffer, BYTES_PIPE_SIZE)) > 0) {
+            result.out_bytes += n;
+        }
+        free(buffer);
+        close(data[0]);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    result.seconds = now() - start;
+    if (read(report[0], &result.peak_rss_kb, sizeof(long)) != sizeof(long)
+            || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        WHINE("benchmark run failed\n");
+        exit(1);
+    }
+    close(report[0]);
+    if (data[0] < 0) result.out_bytes = lseek(out, 0, SEEK_END);
+    return result;
+}
+
+/* Pipelines that start by decoding want encoded input, so
+ * before timing one, we put the data through the matching
+ * encoders, in reverse order: decode (hamming_decode then
+ * lzw_decode) gets the output of lzw_encode then
+ * hamming_encode. Returns the file descriptor for the
+ * pipeline to read, which is just corpus_fd if there's
+ * nothing to do.
+ */
+static void (*encoder_for(stage step))(bytes_in *, bytes_out *,
+        const options *) {
+    if (step == lzw_decode) return lzw_encode;
+    if (step == huff_decode) return huff_encode;
+    if (step == hamming_decode) return hamming_encode;
+    return NULL;
+}
+
+static int prepare(stage *steps, int corpus_fd, const char *name) {
+    void (*encoders[8])(bytes_in *, bytes_out *, const options *);
+    size_t count = 0;
+    while (steps[count] && encoder_for(steps[count]) && count < 7) count++;
+    if (!count) return corpus_fd;
+    for (size_t i = 0; i < count; i++) {
+        encoders[count - 1 - i] = encoder_for(steps[i]);
+    }
+    encoders[count] = NULL;
+    int fd = memfd_create(name, 0);
+    run(encoders, NULL, corpus_fd, fd);
+    return fd;
+}
+
+static void print_result(const char *name, const char *corpus,
+        size_t size, size_t in_bytes, run_result r) {
+    printf("{\"bench\": \"%s\", \"corpus\": \"%s\", \"size\": %zu, "
+            "\"in_bytes\": %zu, \"out_bytes\": %zu, \"ratio\": %.4f, "
+            "\"seconds\": %.6f, \"mb_per_s\": %.2f, \"ns_per_byte\": %.3f, "
+            "\"peak_rss_kb\": %ld, \"threads\": %d, \"jobs\": %ju, "
+            "\"block_size\": %ju}\n",
+            name, corpus, size, in_bytes, r.out_bytes,
+            in_bytes ? (double)r.out_bytes / in_bytes : 0.0,
+            r.seconds, size / r.seconds / 1e6, r.seconds * 1e9 / size,
+            r.peak_rss_kb, opts.threads, (uintmax_t)opts.jobs,
+            (uintmax_t)opts.block_size);
+    /* (and straight away, not just so it shows up promptly: a
+     * pipeline's stages exit() rather than _exit(), so anything
+     * still buffered when run() forks would be printed again) */
+    fflush(stdout);
+}
+
+/* The bench tool: time every subcommand over every corpus at
+ * every size (going up by 16 times from BENCH_MIN_SIZE, plus
+ * opts.bench_size itself if that isn't on the way).
+ */
+int bench(void) {
+    if (opts.bench_size > BENCH_MAX_SIZE) {
+        WHINE("bench: --size can't be more than %ju KiB (for more, "
+                "use stress)\n", (uintmax_t)(BENCH_MAX_SIZE >> 10));
+        return 2;
+    }
+    /* the pipelines read the data we give them, not a file */
+    opts.input = NULL;
+    /* and channel needn't tell us how many bits it flipped
+     * every time */
+    opts.quiet = 1;
+    size_t max = opts.bench_size;
+    for (size_t size = BENCH_MIN_SIZE; size <= max;
+            size = size * 16 > max && size < max ? max : size * 16) {
+        for (size_t c = 0; c < CORPORA; c++) {
+            int corpus_fd = make_corpus(c, size);
+            for (size_t i = 0; i < CASES; i++) {
+                int in = prepare(cases[i].steps, corpus_fd, cases[i].name);
+                size_t in_bytes = lseek(in, 0, SEEK_END);
+                const bench_case *b = &cases[i];
+                run_result best = run(b->steps, b->stage_names, in, -1);
+                for (size_t k = 1; size <= BENCH_REPEAT_SIZE && k < BENCH_REPEATS; k++) {
+                    run_result r = run(b->steps, b->stage_names, in, -1);
+                    if (r.seconds < best.seconds) best = r;
+                }
+                print_result(b->name, corpora[c].name, size, in_bytes, best);
+                if (in != corpus_fd) close(in);
+            }
+            close(corpus_fd);
+        }
+    }
+    return 0;
+}
+
+/* The stress test, for sizes that bench can't go to: push
+ * opts.bench_size bytes of each kind of data through lzw_id
+ * (lzw_encode, then lzw_decode, with whatever options were
+ * given), and check that what comes out is what went in,
+ * without ever holding much of it at once. That way it can
+ * go as far as anyone has the patience for: far enough for
+ * stream positions, code counts and the like to run past 32
+ * bits, say. Rather than making up that much data, we make a
+ * STRESS_CHUNK-byte piece of each kind and send it over and
+ * over, with the chunk's number written over its first 8
+ * bytes, so that no two chunks are quite the same. It prints
+ * a line of JSON per kind of data:
+ *
+ *     {"stress": "lzw_id", "corpus": "text", "size": 17179869184,
+ *      "seconds": 402.1, "mb_per_s": 42.7, "ok": true}
+ *
+ * and if anything came out wrong, "ok" is false and
+ * "first_bad" says where.
+ */
+#define STRESS_CHUNK ((size_t)16 << 20)
+
+/* Write size bytes of chunks (see stress) to fd. */
+static void feed_chunks(int fd, byte *chunk, word size) {
+    for (word n = 0, sent = 0; sent < size; n++) {
+        put_le(chunk, n, 8);
+        size_t length = size - sent < STRESS_CHUNK ? size - sent : STRESS_CHUNK;
+        for (size_t at = 0; at < length;) {
+            ssize_t written = write(fd, chunk + at, length - at);
+            if (written < 0) return;
+            at += written;
+        }
+        sent += length;
+    }
+}
+
+/* Read what the pipeline wrote from in, and return how far it
+ * matches size bytes of chunks (so, size if it's all right, or
+ * at least as far as it goes). */
+static word check_chunks(bytes_in *in, byte *chunk, word size) {
+    word checked = 0;
+    for (word n = 0; checked < size; n++) {
+        put_le(chunk, n, 8);
+        size_t length = size - checked < STRESS_CHUNK ? size - checked : STRESS_CHUNK;
+        for (size_t at = 0; at < length;) {
+            const byte *data;
+            size_t avail = peek_bytes(in, length - at, &data);
+            if (!avail) return checked + at;
+            if (avail > length - at) avail = length - at;
+            if (memcmp(data, chunk + at, avail)) {
+                while (data[0] == chunk[at]) data++, at++;
+                return checked + at;
+            }
+            consume_bytes(in, avail);
+            at += avail;
+        }
+        checked += length;
+    }
+    return checked;
+}
+
+/* The stress tool (see above). */
+int stress(void) {
+    opts.input = NULL;
+    word size = opts.bench_size;
+    const stage steps[] = {lzw_encode, lzw_decode, NULL};
+    int failed = 0;
+    for (size_t c = 0; c < CORPORA; c++) {
+        byte *chunk = malloc(STRESS_CHUNK);
+        rng r;
+        rng_seed(&r, c + 1);
+        corpora[c].make(&r, chunk, STRESS_CHUNK);
+        int in[2], out[2];
+        pipe(in);
+        pipe(out);
+        enlarge_pipe(in[1]);
+        enlarge_pipe(out[1]);
+        double start = now();
+        pid_t feeder = fork();
+        if (!feeder) {
+            close(in[0]);
+            close(out[0]);
+            close(out[1]);
+            feed_chunks(in[1], chunk, size);
+            _exit(0);
+        }
+        pid_t coder = fork();
+        if (!coder) {
+            close(in[1]);
+            close(out[0]);
+            run_pipeline(in[0], out[1], steps, "lzw_encode, lzw_decode");
+            exit(0);
+        }
+        close(in[0]);
+        close(in[1]);
+        close(out[1]);
+        bytes_in got;
+        bytes_in_init(&got, out[0]);
+        word good = check_chunks(&got, chunk, size);
+        const byte *data;
+        int extra = good == size && peek_bytes(&got, 1, &data);
+        bytes_in_free(&got);
+        /* (if we stopped early, closing this makes sure the
+         * others stop too) */
+        close(out[0]);
+        int feeder_status, coder_status;
+        waitpid(feeder, &feeder_status, 0);
+        waitpid(coder, &coder_status, 0);
+        double seconds = now() - start;
+        int ok = good == size && !extra && WIFEXITED(coder_status)
+            && !WEXITSTATUS(coder_status);
+        printf("{\"stress\": \"lzw_id\", \"corpus\": \"%s\", \"size\": %ju, "
+                "\"seconds\": %.3f, \"mb_per_s\": %.2f, \"ok\": %s",
+                corpora[c].name, (uintmax_t)size, seconds,
+                size / seconds / 1e6, ok ? "true" : "false");
+        if (!ok) printf(", \"first_bad\": %ju", (uintmax_t)good);
+        printf("}\n");
+        fflush(stdout);
+        failed |= !ok;
+        free(chunk);
+    }
+    return failed;
+}
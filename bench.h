@@ -0,0 +1,5 @@
+#include "general.h"
+
+/* Timing every subcommand over made-up data; see bench.c. */
+int bench(void);
+int stress(void);
@@ -3,79 +3,159 @@
 #include "byte_io.h"
 #include "bit_io.h"
 
-/* Get some bits from the file descriptor and write them into
+/* Make sure at least bit_count bits are buffered, unless the
+ * input ends first. This is the slow path of peek_bits(): it
+ * hands the bytes we've finished with back to the byte stream
+ * so that it can slide the rest down and read more behind them.
+ */
+void refill_bits(bits_in *bi, word bit_count) {
+    const byte *data;
+    consume_bytes(bi->in, bi->pos >> 3);
+    bi->pos &= 7;
+    peek_bytes(bi->in, (bi->pos + bit_count + 7) >> 3, &data);
+}
+
+/* Get some bits from the byte stream and write them into
  * the bits argument, zeroing the rest of it.
- * Returns the number of input bits placed into the argument.
+ * Returns the number of input bits placed into the argument,
+ * which is only less than bit_count at EOF.
  */
 byte read_bits(bits_in *bi, byte bit_count, word *bits) {
-    /* We're going to branch, and in each branch, we will record
-     * how many bits we set. Then, afterward, we'll clear any
-     * unset bits. So it's OK to just copy the whole buffer to
-     * begin with. */
-    *bits = bi->buffer;
-    /* in most cases, the number of bits we set will be the number
-     * of bits requested, so we'll assume that to begin with, and
-     * change it if necessary */
-    byte bits_set = bit_count;
-    if (bi->buffer_length >= bit_count) {
-        /* if the buffer already has as many bits as we want,
-         * all we need to do for this branch is remove them
-         * from the buffer */
-        bi->buffer >>= bit_count;
-        bi->buffer_length -= bit_count;
+    if (bit_count > BITS_MAX_FAST) {
+        /* too many to get with one load, so take them in two
+         * halves */
+        word high;
+        byte got = read_bits(bi, 32, bits);
+        if (got < 32) return got;
+        got = read_bits(bi, bit_count - 32, &high);
+        *bits |= high << 32;
+        return 32 + got;
     }
-    else {
-        /* otherwise, we need to do some reading and some
-         * slightly-more-advanced buffer juggling */
-        word input = 0;
-        byte bits_needed = bit_count - bi->buffer_length,
-             /* read an entire word at a time even if we need less,
-              * to save on read calls—we can just buffer the rest */
-             bits_read = read_amap(bi->in, &input, WORD_BYTES) * 8;
-        if (bits_read < bits_needed) {
-            bits_set = bi->buffer_length + bits_read;
-        }
-        *bits |= input << bi->buffer_length;
-        /* aforementioned buffer juggling */
-        bi->buffer = input >> bits_needed;
-        bi->buffer_length = bits_read - bits_needed;
+    *bits = 0;
+    if (!bit_count) return 0;
+    word w = peek_bits(bi, bit_count), avail = bits_buffered(bi);
+    if (avail < bit_count) {
+        /* we ran into EOF, so only the bits we got are real */
+        if (!avail) return 0;
+        bit_count = avail;
+        w &= BITS_MASK(bit_count);
     }
-    /* aforementioned clearing of unset bits */
-    *bits &= (1 << bits_set) - 1;
-    return bits_set;
+    consume_bits(bi, bit_count);
+    *bits = w;
+    return bit_count;
 }
 
-/* Send up to WORD_BITS bits to the file descriptor.
- * Probably won't immediately write all of them,
- * unless the word boundaries line up.
+/* Read count codes of bit_count (at most BITS_MAX_FAST) bits
+ * apiece into codes. Returns how many codes were read; that's
+ * fewer than count if the input runs out first (a partial code
+ * at the end is left unread), or if count codes wouldn't fit
+ * in the byte stream's buffer at once.
+ * Since we refill just once, up front, the loop itself has no
+ * branches but its own: the codes are all the same width, so
+ * there's nothing to decide per code. Any of the codes can be
+ * given back with unread_bits() afterwards, which is handy if
+ * the caller finds out partway through that it wanted fewer.
  */
-void write_bits(bits_out *bo, byte bit_count, word bits) {
-    byte bits_left = WORD_BITS - bo->buffer_length;
-    if (bits_left <= bit_count) {
-        /* if we're writing enough bits to fill our buffer,
-         * write the filled buffer and replace the buffer with
-         * the excess bits (if any) */
-        write_word(bo->out, bo->buffer | (bits << bo->buffer_length));
-        bo->buffer = bits >> bits_left;
-        bo->buffer_length = bit_count - bits_left;
+size_t read_bits_batch(bits_in *bi, byte bit_count, size_t count, word *codes) {
+    word wanted = (word)count * bit_count;
+    /* (if that's more than the byte stream's buffer holds, it
+     * fills up as much as it can, which is plenty) */
+    if (bits_buffered(bi) < wanted) refill_bits(bi, wanted);
+    word avail = bits_buffered(bi) / bit_count;
+    if (count > avail) count = avail;
+
+    const byte *base = bi->in->buffer + bi->in->start;
+    word pos = bi->pos, mask = BITS_MASK(bit_count);
+    for (size_t i = 0; i < count; i++, pos += bit_count) {
+        codes[i] = load_word_le(base + (pos >> 3)) >> (pos & 7) & mask;
     }
-    else {
-        /* otherwise, just buffer all of the bits */
-        bo->buffer |= bits << bo->buffer_length;
-        bo->buffer_length += bit_count;
+    bi->pos = pos;
+    return count;
+}
+
+/* Read a phased-in code (see bit_io.h) into the bits argument.
+ * Returns the number of bits it took, or 0 if the input ends
+ * first. Unlike peek_bits(), this doesn't wait for the last
+ * bit unless it turns out to need it, so a short code right at
+ * the end of what's been written so far (as at one of
+ * lzw_decode's sync points) can be read straight away.
+ */
+byte read_bits_phased(bits_in *bi, byte bit_count, word shorts, word *bits) {
+    byte width = bit_count - 1;
+    word w = peek_bits(bi, width);
+    if (w >= shorts) {
+        w = peek_bits(bi, ++width);
+        if (w >> (bit_count - 1)) w -= shorts;
     }
+    if (bits_buffered(bi) < width) return 0;
+    consume_bits(bi, width);
+    *bits = w;
+    return width;
+}
+
+/* Like read_bits_batch, but for phased-in codes whose shorts
+ * starts at shorts and goes down by one for each code after
+ * (their range growing by one apiece, as an LZW dictionary's
+ * does while it fills), so count can be at most shorts + 1.
+ * We still refill just once, up front, for count codes at
+ * their longest. Short and long codes are about as likely as
+ * each other, so a branch on which each one is would be
+ * mispredicted half the time; instead, is_short is all ones for
+ * a short code, and masks off the bit it doesn't have.
+ * Giving codes back afterwards takes adding up their lengths
+ * (with phased_bits()). A lone code is read with
+ * read_bits_phased, so as not to wait for a bit it may not
+ * need.
+ */
+size_t read_bits_phased_batch(bits_in *bi, byte bit_count, word shorts,
+        size_t count, word *codes) {
+    if (count == 1) return !!read_bits_phased(bi, bit_count, shorts, codes);
+    word wanted = (word)count * bit_count;
+    if (bits_buffered(bi) < wanted) refill_bits(bi, wanted);
+
+    const byte *base = bi->in->buffer + bi->in->start;
+    byte top = bit_count - 1;
+    word pos = bi->pos, end = pos + bits_buffered(bi),
+         mask = BITS_MASK(bit_count), low = BITS_MASK(top);
+    size_t i;
+    for (i = 0; i < count; i++, shorts--) {
+        word w = load_word_le(base + (pos >> 3)) >> (pos & 7),
+             is_short = -(word)((w & low) < shorts),
+             v = w & mask & ~(is_short & ((word)1 << top));
+        /* (a partial code at the end is left unread) */
+        if (pos + bit_count + is_short > end) break;
+        codes[i] = v - (shorts & -(v >> top));
+        pos += bit_count + is_short;
+    }
+    bi->pos = pos;
+    return i;
+}
+
+/* Skip ahead to a whole byte, and hand everything we've used
+ * back to the byte stream, so that the caller can read whole
+ * bytes from it directly (as for a stored segment of an LZW
+ * stream). Reading bits afterwards carries on from wherever
+ * the byte stream has got to.
+ */
+void align_bits(bits_in *bi) {
+    consume_bytes(bi->in, (bi->pos + 7) >> 3);
+    bi->pos = 0;
 }
 
-/* Send any remaining buffered bits to the file descriptor,
- * padding with zeros if necessary. Only call this once, when
- * done with the bits_out.
+/* Send any remaining buffered bits to the byte stream,
+ * padding with zeros if necessary. Call this when done with
+ * the bits_out, or to get to a whole byte so as to write
+ * whole bytes to the byte stream directly. (This doesn't flush
+ * the byte stream itself; whoever owns that is responsible
+ * for it.)
  * Returns the number of excess zeros used for padding.
  */
 byte flush_bits(bits_out *bo) {
-    byte bl = bo->buffer_length,
-         buffered = bl / 8 + (bl % 8 != 0);
-    write(bo->out, &bo->buffer, buffered);
-    return 8 * buffered - bl;
+    byte bl = bo->buffer_length;
+    if (!bl) return 0;
+    write_byte(bo->out, bo->buffer);
+    bo->buffer = bo->buffer_length = 0;
+    return 8 - bl;
 }
 
 
@@ -85,20 +165,27 @@ byte flush_bits(bits_out *bo) {
  * puts $<.each_byte.map{|b|format('%08b',b).reverse}.join.scan /.{,7}/
  */
 void bits_out_example(void) {
-    bits_out bo = BITS_OUT(STDOUT_FILENO);
+    bytes_out out;
+    bytes_out_init(&out, STDOUT_FILENO);
+    bits_out bo = BITS_OUT(&out);
     for (word i = 0; i < 127; i++) {
         write_bits(&bo, 7, i);
     }
     int leftover = flush_bits(&bo);
+    flush_bytes(&out);
+    bytes_out_free(&out);
     fprintf(stderr, "%d\n", leftover);
 }
 
 void bits_in_example(void) {
-    bits_in bi = BITS_IN(STDIN_FILENO);
+    bytes_in in;
+    bytes_in_init(&in, STDIN_FILENO);
+    bits_in bi = BITS_IN(&in);
     for (int i = 1; i < 11; i++) {
         word w;
         read_bits(&bi, i, &w);
-        printf("%lu\n", w);
+        printf("%ju\n", (uintmax_t)w);
     }
+    bytes_in_free(&in);
 }
 
@@ -1,41 +1,170 @@
+#include <string.h>
+
 #include "general.h"
 
+/* Both of these sit on top of the buffered byte streams from
+ * byte_io.h, so include that first.
+ *
+ * Bits are packed least-significant first, and words go to
+ * and from memory little-endian, whatever the host's byte
+ * order is, so a stream means the same thing everywhere. */
+
+/* The most bits peek_bits() or write_bits() can handle in one
+ * go without splitting: a word load or store starting partway
+ * through a byte has up to 7 bits of it taken up already.
+ */
+#define BITS_MAX_FAST (WORD_BITS - 8)
+
+/* A mask of the low count bits of a word, for 0 < count <=
+ * WORD_BITS. (Shifting down like this, rather than doing
+ * (1 << count) - 1, works all the way up to a whole word.) */
+#define BITS_MASK(count) (~(word)0 >> (WORD_BITS - (count)))
+
+static inline word load_word_le(const byte *p) {
+    word w;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&w, p, WORD_BYTES);
+#else
+    w = 0;
+    for (size_t i = WORD_BYTES; i--;) w = w << 8 | p[i];
+#endif
+    return w;
+}
+
+static inline void store_word_le(byte *p, word w) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(p, &w, WORD_BYTES);
+#else
+    for (size_t i = 0; i < WORD_BYTES; i++, w >>= 8) p[i] = w;
+#endif
+}
+
 /* A struct for holding the current state in the process of
- * reading bits from some file descriptor.
+ * reading bits from some byte stream.
+ *
+ * Rather than shuffling bits through a buffer of its own, this
+ * reads straight out of the byte stream's buffer: pos counts
+ * how many bits past the byte stream's current position we've
+ * used up. Whole bytes are only handed back to the byte stream
+ * (consumed) when we go to refill, so until then anything
+ * we've read can be unread just by moving pos back.
+ * Don't read from the byte stream directly while a bits_in is
+ * using it.
  */
 typedef struct bits_in {
-    /* the file descriptor */
-    int in;
+    /* the byte stream */
+    bytes_in *in;
 
-    /* a "buffer" of read-but-unconsumed bits */
-    word buffer;
-
-    /* number of data bits in the buffer */
-    byte buffer_length;
+    /* bits used up since in's start */
+    word pos;
 } bits_in;
-#define BITS_IN(in) ((bits_in) {(in), 0, 0});
+#define BITS_IN(in) ((bits_in) {(in), 0})
 
 /* A struct for holding the current state in the process of
- * writing bits to some file descriptor.
+ * writing bits to some byte stream.
  *
- * Invariant: buffer_length should always be < WORD_BITS.
+ * Invariant: buffer_length should always be < 8; whole bytes
+ * go to the byte stream's buffer as soon as they're complete.
  */
 typedef struct bits_out {
-    /* the file descriptor */
-    int out;
+    /* the byte stream */
+    bytes_out *out;
 
-    /* a "buffer" of read-but-unconsumed bits.
-     * we could technically buffer as little as a byte at a time,
-     * but this saves on write calls. */
+    /* the bits of the last, incomplete byte */
     word buffer;
 
     /* number of data bits in the buffer */
     byte buffer_length;
 } bits_out;
-#define BITS_OUT(out) ((bits_out) {(out), 0, 0});
+#define BITS_OUT(out) ((bits_out) {(out), 0, 0})
 
-byte read_bits(bits_in *bi, byte bit_count, word *out);
+void refill_bits(bits_in *bi, word bit_count);
+byte read_bits(bits_in *bi, byte bit_count, word *bits);
+size_t read_bits_batch(bits_in *bi, byte bit_count, size_t count, word *codes);
+byte read_bits_phased(bits_in *bi, byte bit_count, word shorts, word *bits);
+size_t read_bits_phased_batch(bits_in *bi, byte bit_count, word shorts,
+        size_t count, word *codes);
 
-void write_bits(bits_out *bo, byte bit_count, word bits);
+void align_bits(bits_in *bi);
 byte flush_bits(bits_out *bo);
 
+/* How many bits are buffered and ready to read. */
+static inline word bits_buffered(const bits_in *bi) {
+    return (word)(bi->in->end - bi->in->start) * 8 - bi->pos;
+}
+
+/* Look at the next bit_count (at most BITS_MAX_FAST) bits
+ * without using them up. Near EOF there may be fewer than that
+ * left (check bits_buffered()), and the missing bits are junk.
+ * This is the whole fast path: a compare that almost always
+ * goes the same way, then a load, a shift, and a mask.
+ */
+static inline word peek_bits(bits_in *bi, byte bit_count) {
+    if (bits_buffered(bi) < bit_count) refill_bits(bi, bit_count);
+    const byte *p = bi->in->buffer + bi->in->start + (bi->pos >> 3);
+    return load_word_le(p) >> (bi->pos & 7) & BITS_MASK(bit_count);
+}
+
+/* Use up bit_count peeked bits. */
+static inline void consume_bits(bits_in *bi, word bit_count) {
+    bi->pos += bit_count;
+}
+
+/* Give back the last bit_count bits read. This is only safe
+ * for bits read since the last refill, i.e. since the last
+ * peek_bits() that found too few bits buffered, or the start
+ * of the last read_bits_batch().
+ */
+static inline void unread_bits(bits_in *bi, word bit_count) {
+    bi->pos -= bit_count;
+}
+
+/* Send up to BITS_MAX_FAST bits to the byte stream. bits
+ * shouldn't have anything set above the low bit_count.
+ * Every call stores a whole word into the byte stream's
+ * buffer and then commits however many bytes of it are
+ * complete, which saves deciding whether there are any.
+ */
+static inline void write_bits_fast(bits_out *bo, byte bit_count, word bits) {
+    bo->buffer |= bits << bo->buffer_length;
+    bo->buffer_length += bit_count;
+    store_word_le(reserve_bytes(bo->out, WORD_BYTES), bo->buffer);
+    commit_bytes(bo->out, bo->buffer_length >> 3);
+    bo->buffer >>= bo->buffer_length & ~7;
+    bo->buffer_length &= 7;
+}
+
+/* Send up to WORD_BITS bits to the byte stream. */
+static inline void write_bits(bits_out *bo, byte bit_count, word bits) {
+    if (bit_count > BITS_MAX_FAST) {
+        write_bits_fast(bo, 32, bits & BITS_MASK(32));
+        bits >>= 32;
+        bit_count -= 32;
+    }
+    write_bits_fast(bo, bit_count, bits);
+}
+
+/* Phased-in codes (or truncated binary codes) are for numbers
+ * that go up to some max that takes bit_count bits, but isn't
+ * one less than a power of 2, so that plain bit_count-bit
+ * numbers would leave some of their range unused. With max + 1
+ * being 2^bit_count - shorts, the numbers below shorts take
+ * one bit fewer, and the rest take all bit_count. For a reader
+ * to tell which before it needs the last bit, it's the low
+ * bits, which come first, that say: a short number is below
+ * shorts, and the low bit_count - 1 bits of a long one aren't
+ * (it goes as itself if it's below 2^(bit_count - 1), and
+ * otherwise, shorts is added to it). With shorts at 0, these
+ * are just plain bit_count-bit numbers. bit_count can be at
+ * most BITS_MAX_FAST.
+ * This says how many bits bits takes up. */
+static inline byte phased_bits(byte bit_count, word shorts, word bits) {
+    return bit_count - (bits < shorts);
+}
+
+/* Send bits to the byte stream as a phased-in code. */
+static inline void write_bits_phased(bits_out *bo, byte bit_count,
+        word shorts, word bits) {
+    write_bits_fast(bo, phased_bits(bit_count, shorts, bits),
+            bits + (shorts & -(word)(bits >> (bit_count - 1))));
+}
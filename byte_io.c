@@ -1,36 +1,534 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #include "byte_io.h"
+#include "ring.h"
+#include "stats.h"
+
+/* Set up a bytes_in reading from file descriptor in.
+ */
+void bytes_in_init(bytes_in *bi, int in) {
+    bi->in = in;
+    bi->ring = NULL;
+    bi->buffer = malloc(BYTES_BUFFER_SIZE + BYTES_SLACK);
+    bi->start = bi->end = 0;
+    bi->capacity = BYTES_BUFFER_SIZE;
+    bi->eof = 0;
+    bi->mapped = 0;
+    bi->stats = NULL;
+    bi->flush_to = NULL;
+    bi->arrived = 0;
+}
+
+/* Set up a bytes_in reading from ring r. It has no buffer of
+ * its own: it reads the bytes where they are in the ring (see
+ * fill_bytes), and gives back their room once it's used them.
+ */
+void bytes_in_init_ring(bytes_in *bi, ring *r) {
+    bytes_in_init_mem(bi, r->buffer, 0);
+    bi->ring = r;
+    bi->capacity = BYTES_BUFFER_SIZE;
+    bi->eof = 0;
+}
+
+/* Set up a bytes_in reading the length bytes at data. The
+ * bytes aren't copied, so they need to stay put until we're
+ * done. Like the buffers we allocate ourselves, they need
+ * BYTES_SLACK more readable bytes after them.
+ */
+void bytes_in_init_mem(bytes_in *bi, const byte *data, size_t length) {
+    bi->in = -1;
+    bi->ring = NULL;
+    /* (we never write to it, since there's nothing to refill
+     * it with) */
+    bi->buffer = (byte *)data;
+    bi->start = 0;
+    bi->end = bi->capacity = length;
+    bi->eof = 1;
+    bi->mapped = 0;
+    bi->stats = NULL;
+    bi->flush_to = NULL;
+    bi->arrived = 0;
+}
 
-/* This is mostly equivalent to read(), except that it is
- * guaranteed to read as many bytes as the file descriptor
- * will provide before EOF or an error.
- * This is useful when we have a fixed word size that's
- * larger than a byte, since using read() directly might
- * give us less than we need.
- * Based on this similar function given to me by a person
- * in ##C on Freenode: http://ix.io/rUp/c
- */
-ssize_t read_amap(int fd, void *buf, size_t count) {
-    /* The implementation is simple: Just keep calling read()
-     * until it returns 0 or the total number of bytes read
-     * reaches the requested amount. */
+/* Set up a bytes_in reading the file at path. If it's a
+ * regular file, we map it into memory rather than reading it.
+ * Then there's no copying it into a buffer (stages work on the
+ * page cache directly), and we can tell the kernel we'll go
+ * through it in order, so that it reads ahead. Anything else
+ * (a FIFO, a terminal...) we just read as usual.
+ */
+void bytes_in_init_file(bytes_in *bi, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        WHINE("%s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size) {
+        bytes_in_init(bi, fd);
+        return;
+    }
+    /* Readers want BYTES_SLACK readable bytes past the end, but
+     * if the file ends at (or just before) a page boundary, the
+     * pages after it wouldn't be mapped at all. So we reserve
+     * zeroed memory for the file plus the slack first, then map
+     * the file over the start of it. */
+    size_t length = st.st_size, mapped = length + BYTES_SLACK;
+    byte *map = mmap(NULL, mapped, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED || mmap(map, length, PROT_READ,
+                MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        if (map != MAP_FAILED) munmap(map, mapped);
+        bytes_in_init(bi, fd);
+        return;
+    }
+    close(fd);
+    madvise(map, length, MADV_SEQUENTIAL);
+    bytes_in_init_mem(bi, map, length);
+    bi->mapped = mapped;
+}
+/* If we're reading from a ring, this tells the producer we
+ * won't read any more, so that it doesn't wait on us forever
+ * if we stopped before EOF.
+ */
+void bytes_in_free(bytes_in *bi) {
+    if (bi->ring) ring_abandon(bi->ring);
+    if (bi->mapped) munmap(bi->buffer, bi->mapped);
+    else if (bi->in >= 0) free(bi->buffer);
+}
+
+/* For --flush-ms: have bi flush bo, the output of the stage
+ * reading it, whenever it's waited ms milliseconds on input
+ * with some of what it's already read not flushed yet (see
+ * bytes_in_stalled). Without that, a stage holds on to its
+ * output until it has a bufferful, which could be forever if
+ * the input only trickles in.
+ */
+void bytes_in_flush_to(bytes_in *bi, bytes_out *bo, word ms) {
+    bi->flush_to = bo;
+    bi->flush_ns = ms * 1000000;
+    /* (if the stage has read ahead already, as hamming_decode
+     * does to find out whether to call this, what's buffered
+     * only just arrived, as far as flushing goes) */
+    if (bi->end > bi->start) bi->arrived = stats_now();
+}
+
+/* Wait up to ns nanoseconds for bi's file descriptor (or ring)
+ * to have something to read, and return whether it does. (At
+ * EOF, or if there's an error, read() will have something to
+ * say straight away, so that counts.)
+ */
+static int input_ready(bytes_in *bi, word ns) {
+    /* (everything buffered is still in the ring) */
+    if (bi->ring) return ring_wait_read(bi->ring, bi->end, ns);
+    struct pollfd p = {bi->in, POLLIN, 0};
+    /* (rounding up, so as not to wake just short of the
+     * deadline and have to go back to sleep) */
+    int ms = (ns + 999999) / 1000000, got;
+    while ((got = poll(&p, 1, ms)) < 0 && errno == EINTR);
+    return got != 0;
+}
+
+/* With bytes_in_flush_to, whether the stage reading bi should
+ * flush everything it's holding on to right now. Call this
+ * when you've used up what's buffered and are about to ask for
+ * more. If some of the input that's come in hasn't been
+ * flushed yet, this waits for more until flush_ns after that
+ * arrived; if nothing turns up by then (or it's later than
+ * that already), the answer's yes, and then it's no again
+ * until more input arrives. A stage whose output is all
+ * whole bytes needn't call it at all: the byte stream asks it
+ * before each wait for input, and flushes flush_to itself.
+ */
+int bytes_in_stalled(bytes_in *bi) {
+    if (!bi->arrived || bi->eof) return 0;
+    word now = stats_now(), due = bi->arrived + bi->flush_ns;
+    if (now < due && input_ready(bi, due - now)) return 0;
+    bi->arrived = 0;
+    return 1;
+}
+
+/* Call read() until at least count bytes are buffered or the
+ * file descriptor runs dry. Each read() asks for as much as
+ * will fit, so we make one syscall per buffer rather than
+ * one per byte (or per word).
+ * This plays the role that read_amap() ("as many/much as
+ * possible") used to, which was based on a similar function
+ * given to me by a person in ##C on Freenode:
+ * http://ix.io/rUp/c
+ */
+static void fill_bytes(bytes_in *bi, size_t count) {
+    if (bi->eof) return;
+    /* slide whatever's left to the front of the buffer to
+     * make as much room as possible (or from a ring, give
+     * back what's used up, and start the buffer from what
+     * isn't) */
+    if (bi->ring) {
+        ring_consume(bi->ring, bi->start);
+        bi->end -= bi->start;
+        bi->start = 0;
+    }
+    else if (bi->start) {
+        memmove(bi->buffer, bi->buffer + bi->start, bi->end - bi->start);
+        bi->end -= bi->start;
+        bi->start = 0;
+    }
+    word since = bi->stats ? stats_now() : 0;
+    size_t before = bi->end;
+    while (!bi->eof && bi->end < count) {
+        if (bi->flush_to) {
+            /* (see bytes_in_stalled) */
+            if (bi->end > before && !bi->arrived) bi->arrived = stats_now();
+            if (bytes_in_stalled(bi)) flush_bytes(bi->flush_to);
+        }
+        if (bi->ring) {
+            /* (the buffer is wherever the ring's got to, and
+             * takes in as much as it has, short of the slack;
+             * that goes on into the next bytes of the ring,
+             * which readers never use, so it doesn't matter
+             * that the producer might be writing them) */
+            const byte *data;
+            size_t avail = ring_peek(bi->ring, bi->end, &data),
+                   most = bi->ring->capacity - BYTES_SLACK;
+            bi->buffer = (byte *)data;
+            if (avail <= bi->end) bi->eof = 1;
+            else bi->end = avail < most ? avail : most;
+            continue;
+        }
+        ssize_t nread = read(bi->in, bi->buffer + bi->end,
+                bi->capacity - bi->end);
+        if (nread > 0) bi->end += nread;
+        else if (nread < 0 && errno == EINTR) continue;
+        else {
+            /* an error is as good as EOF for our purposes,
+             * but we should at least say something */
+            if (nread < 0) WHINE("read: %s\n", strerror(errno));
+            bi->eof = 1;
+        }
+    }
+    if (bi->flush_to && !bi->arrived && bi->end > before) {
+        bi->arrived = stats_now();
+    }
+    if (bi->stats) {
+        bi->stats->bytes_in += bi->end - before;
+        stats_waited(bi->stats, since);
+    }
+}
+
+/* Look at the next count bytes of input without consuming
+ * them, refilling the buffer first if necessary.
+ * Sets *data to point at the buffered bytes and returns how
+ * many there are; that's at least count unless the input
+ * ends first, and may be more. (count is capped at the
+ * buffer's capacity.)
+ * The pointer is only good until the next call that might
+ * refill the buffer.
+ */
+size_t peek_bytes(bytes_in *bi, size_t count, const byte **data) {
+    if (count > bi->capacity) count = bi->capacity;
+    if (bi->end - bi->start < count) fill_bytes(bi, count);
+    *data = bi->buffer + bi->start;
+    return bi->end - bi->start;
+}
+
+/* Copy up to count bytes of input into buf. Returns the
+ * number of bytes copied, which is only less than count
+ * at EOF.
+ */
+size_t read_bytes(bytes_in *bi, void *buf, size_t count) {
     byte *buf_ = buf;
-    ssize_t remaining = count;
-    while (remaining > 0) {
-        ssize_t nread = read(fd, buf_, remaining);
-        if (!nread) break;
-        buf_ += nread;
-        remaining -= nread;
+    size_t copied = 0;
+    while (copied < count) {
+        const byte *data;
+        size_t avail = peek_bytes(bi, count - copied, &data);
+        if (!avail) break;
+        if (avail > count - copied) avail = count - copied;
+        memcpy(buf_ + copied, data, avail);
+        consume_bytes(bi, avail);
+        copied += avail;
     }
-    return count - remaining;
+    return copied;
 }
 
-/* These are just some meaningful aliases. */
 
-ssize_t write_byte(int fd, byte x) {
-    return write(fd, &x, 1);
+/* take_bytes, except that if the bytes need copying, they're
+ * copied into spare (which needs room for count + BYTES_SLACK
+ * bytes), for callers that keep a buffer to reuse. */
+size_t take_bytes_into(bytes_in *bi, size_t count, const byte **data,
+        byte *spare) {
+    if (bytes_in_memory(bi)) {
+        size_t avail = peek_bytes(bi, count, data);
+        if (avail > count) avail = count;
+        consume_bytes(bi, avail);
+        return avail;
+    }
+    *data = spare;
+    return read_bytes(bi, spare, count);
 }
 
-ssize_t write_word(int fd, word x) {
-    return write(fd, &x, WORD_BYTES);
+/* Take the next count bytes of input (fewer at EOF) as a block
+ * of their own, which stays good after we move on, for handing
+ * to another thread. Returns how many bytes there are and sets
+ * *data to point at them. If we're reading from memory, that's
+ * just a pointer into it; otherwise the bytes are copied into
+ * a fresh buffer (with BYTES_SLACK spare bytes, like ours),
+ * which *owned is set to, for the caller to free. (When it's
+ * not needed, *owned is NULL.)
+ */
+size_t take_bytes(bytes_in *bi, size_t count, const byte **data,
+        byte **owned) {
+    *owned = bytes_in_memory(bi) ? NULL : malloc(count + BYTES_SLACK);
+    count = take_bytes_into(bi, count, data, *owned);
+    if (!count) {
+        free(*owned);
+        *owned = NULL;
+    }
+    return count;
+}
+
+/* Set up a bytes_out writing to file descriptor out.
+ */
+void bytes_out_init(bytes_out *bo, int out) {
+    bo->out = out;
+    bo->ring = NULL;
+    bo->buffer = malloc(BYTES_BUFFER_SIZE);
+    bo->length = 0;
+    bo->capacity = BYTES_BUFFER_SIZE;
+    bo->splice = NULL;
+    bo->stats = NULL;
 }
 
+/* Set up a bytes_out writing to ring r. It has no buffer of
+ * its own either: its buffer is room reserved in the ring,
+ * which flushing hands over before reserving more. (It starts
+ * out with none, so the first write flushes.)
+ */
+void bytes_out_init_ring(bytes_out *bo, ring *r) {
+    bo->out = -1;
+    bo->ring = r;
+    bo->buffer = NULL;
+    bo->length = bo->capacity = 0;
+    bo->splice = NULL;
+    bo->stats = NULL;
+}
+
+/* Set up a bytes_out collecting everything written to it in
+ * memory, starting with room for capacity bytes.
+ */
+void bytes_out_init_mem(bytes_out *bo, size_t capacity) {
+    bo->out = -1;
+    bo->ring = NULL;
+    bo->buffer = malloc(capacity);
+    bo->length = 0;
+    bo->capacity = capacity;
+    bo->splice = NULL;
+    bo->stats = NULL;
+}
+
+/* Writing to a pipe with vmsplice() hands the kernel the pages
+ * of our buffer themselves instead of copying them, which means
+ * we mustn't touch a buffer again until the reader has read
+ * everything we spliced from it. Nobody will tell us when that
+ * is, but we can work it out: every page (or piece of one) we
+ * splice takes up a slot in the pipe, the pipe only has so many
+ * slots, and they're read in order. So once we've spliced a
+ * pipeful of slots after a buffer, it must be free again.
+ * We keep a set of buffers, and after each flush we move on to
+ * one that's free, making a new one if none is free yet. (That
+ * settles down at about a pipeful of buffers.) The buffers are
+ * mapped rather than malloc'd, so that when we unmap them at
+ * the end, any pages still in the pipe stay with the pipe,
+ * rather than going back to malloc to be handed out again.
+ *
+ * This is only safe if whoever's reading the pipe really reads
+ * it. If they splice it somewhere else instead, our pages could
+ * end up outliving their slots. Our own stages read, as do most
+ * things.
+ */
+typedef struct spliced {
+    byte *buffer;
+    /* how many slots we'd spliced in total as of this buffer's
+     * last flush */
+    word done_at;
+} spliced;
+
+typedef struct splicer {
+    spliced *buffers;
+    size_t count, current, page;
+    /* how many slots we've spliced in total */
+    word slots;
+} splicer;
+
+static byte *splice_buffer(size_t capacity) {
+    byte *buffer = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        WHINE("mmap: %s\n", strerror(errno));
+        exit(4);
+    }
+    return buffer;
+}
+
+/* Switch bo over to vmsplice, if it's writing to a pipe.
+ * Call this before writing anything.
+ */
+void bytes_out_splice(bytes_out *bo) {
+    struct stat st;
+    if (bo->out < 0 || fstat(bo->out, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+        return;
+    }
+    enlarge_pipe(bo->out);
+    splicer *s = malloc(sizeof(splicer));
+    s->buffers = malloc(sizeof(spliced));
+    s->buffers[0] = (spliced){splice_buffer(bo->capacity), 0};
+    s->count = 1;
+    s->current = 0;
+    s->page = sysconf(_SC_PAGESIZE);
+    s->slots = 0;
+    free(bo->buffer);
+    bo->buffer = s->buffers[0].buffer;
+    bo->splice = s;
+}
+
+/* flush_bytes, for a bytes_out that's splicing.
+ */
+static void splice_bytes(bytes_out *bo) {
+    splicer *s = bo->splice;
+    size_t done = 0;
+    while (done < bo->length) {
+        struct iovec iov = {bo->buffer + done, bo->length - done};
+        ssize_t nspliced = vmsplice(bo->out, &iov, 1, 0);
+        if (nspliced < 0) {
+            if (errno == EINTR) continue;
+            WHINE("vmsplice: %s\n", strerror(errno));
+            exit(4);
+        }
+        /* (buffers start on a page boundary) */
+        s->slots += (done % s->page + nspliced + s->page - 1) / s->page;
+        done += nspliced;
+    }
+    s->buffers[s->current].done_at = s->slots;
+    bo->length = 0;
+
+    /* (if we can't find out how big the pipe is, it's probably
+     * the size we asked for in bytes_out_splice) */
+    int pipe_size = fcntl(bo->out, F_GETPIPE_SZ);
+    if (pipe_size <= 0) pipe_size = BYTES_PIPE_SIZE;
+    word pipe_slots = pipe_size / s->page;
+    for (size_t i = 1; i < s->count; i++) {
+        size_t next = (s->current + i) % s->count;
+        if (s->slots - s->buffers[next].done_at >= pipe_slots) {
+            s->current = next;
+            bo->buffer = s->buffers[next].buffer;
+            return;
+        }
+    }
+    s->buffers = realloc(s->buffers, sizeof(spliced) * ++s->count);
+    s->current = s->count - 1;
+    s->buffers[s->current] = (spliced){splice_buffer(bo->capacity), 0};
+    bo->buffer = s->buffers[s->current].buffer;
+}
+
+
+/* Note that this doesn't flush; do that first if you
+ * care about the buffered bytes.
+ */
+void bytes_out_free(bytes_out *bo) {
+    if (bo->splice) {
+        splicer *s = bo->splice;
+        for (size_t i = 0; i < s->count; i++) {
+            munmap(s->buffers[i].buffer, bo->capacity);
+        }
+        free(s->buffers);
+        free(s);
+    }
+    else if (!bo->ring) free(bo->buffer);
+}
+
+/* flush_bytes, minus the bookkeeping for --stats.
+ */
+static void drain_bytes(bytes_out *bo) {
+    if (bo->splice) {
+        splice_bytes(bo);
+        return;
+    }
+    if (bo->ring) {
+        ring_commit(bo->ring, bo->length);
+        bo->buffer = ring_reserve(bo->ring, BYTES_BUFFER_SIZE);
+        bo->length = 0;
+        bo->capacity = BYTES_BUFFER_SIZE;
+        return;
+    }
+    if (bo->out < 0) {
+        /* in memory, "flushing" means making more room */
+        size_t capacity = bo->capacity * 2;
+        if (capacity < bo->length + BYTES_BUFFER_SIZE) {
+            capacity = bo->length + BYTES_BUFFER_SIZE;
+        }
+        bo->buffer = realloc(bo->buffer, capacity);
+        bo->capacity = capacity;
+        return;
+    }
+    size_t written = 0;
+    while (written < bo->length) {
+        ssize_t nwritten = write(bo->out, bo->buffer + written,
+                bo->length - written);
+        if (nwritten >= 0) written += nwritten;
+        else if (errno != EINTR) {
+            WHINE("write: %s\n", strerror(errno));
+            exit(4);
+        }
+    }
+    bo->length = 0;
+}
+
+/* Write out everything that's buffered. There's nothing
+ * sensible to do if the write fails (most likely, whoever
+ * was reading from us has gone away), so we give up.
+ * (With --stats, we count what we wrote and how long it took;
+ * "writing" to memory doesn't count, since it never waits.)
+ */
+void flush_bytes(bytes_out *bo) {
+    if (!bo->stats || (bo->out < 0 && !bo->ring)) {
+        drain_bytes(bo);
+        return;
+    }
+    word since = stats_now();
+    bo->stats->bytes_out += bo->length;
+    drain_bytes(bo);
+    stats_waited(bo->stats, since);
+}
+
+/* Buffer count bytes from buf for writing.
+ */
+void write_bytes(bytes_out *bo, const void *buf, size_t count) {
+    const byte *buf_ = buf;
+    while (count > 0) {
+        size_t room = bo->capacity - bo->length;
+        if (!room) {
+            flush_bytes(bo);
+            room = bo->capacity - bo->length;
+        }
+        if (room > count) room = count;
+        memcpy(bo->buffer + bo->length, buf_, room);
+        bo->length += room;
+        buf_ += room;
+        count -= room;
+    }
+}
+
+/* Ask for fd, a pipe, to be BYTES_PIPE_SIZE bytes. If we can't
+ * have that, the pipe works just as well as before, only with
+ * more trips through it, so we don't complain.
+ */
+void enlarge_pipe(int fd) {
+    fcntl(fd, F_SETPIPE_SZ, BYTES_PIPE_SIZE);
+}
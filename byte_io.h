@@ -2,10 +2,169 @@
 
 #include "general.h"
 
-#define read_byte(fd, buf) read(fd, buf, 1)
+/* How many bytes bytes_in and bytes_out buffer at a time.
+ * Bigger buffers mean fewer read()/write() calls; this is
+ * comfortably larger than a default pipe buffer. */
+#define BYTES_BUFFER_SIZE ((size_t)1 << 17)
 
-/* "amap" = "as many/much as possible" */
-ssize_t read_amap(int fd, void *buf, size_t count);
-ssize_t write_byte(int fd, byte x);
-ssize_t write_word(int fd, word x);
+/* How big we ask for the pipes we make to be. The default of
+ * 64 KiB is smaller than one of our buffers, so a bufferful
+ * would take several trips through it. (Unprivileged processes
+ * can normally go up to 1 MiB.) */
+#define BYTES_PIPE_SIZE (1 << 20)
 
+/* bytes_in buffers are allocated with this many spare bytes
+ * past their capacity, which are never filled, so that readers
+ * can load a whole word at a time from anywhere in the
+ * buffered data without going off the end. */
+#define BYTES_SLACK WORD_BYTES
+
+/* Bytes can come from or go to a file descriptor; or, when
+ * stages run on threads in one process, a ring (see ring.h;
+ * only byte_io.c needs to know what's in one); or just memory,
+ * when a chunk of a stream is being worked on by itself. For
+ * the last two, the file descriptor is -1. */
+struct ring;
+struct splicer;
+/* (and with --stats, both ends of a stage count what they do
+ * in the stage's stage_stats, from stats.h) */
+struct stage_stats;
+
+/* A struct for holding the current state in the process of
+ * reading bytes from some file descriptor (or ring, or
+ * memory).
+ * The buffered-but-unconsumed bytes are the ones in
+ * buffer[start] up to (but not including) buffer[end].
+ * When reading from memory, the buffer is the memory itself,
+ * and it all counts as buffered right from the start; when
+ * reading from a ring, it's the part of the ring the bytes
+ * are in, and moves along it with each refill.
+ */
+typedef struct bytes_in {
+    /* the file descriptor, */
+    int in;
+    /* or, if this isn't NULL, the ring */
+    struct ring *ring;
+
+    byte *buffer;
+    size_t start, end, capacity;
+
+    /* set once the file descriptor has run dry */
+    byte eof;
+
+    /* if nonzero, the memory we're reading is a file we mapped
+     * ourselves, and this is how much of it to unmap */
+    size_t mapped;
+
+    /* if this isn't NULL, where to count bytes read and time
+     * spent waiting for them */
+    struct stage_stats *stats;
+
+    /* With --flush-ms, if this isn't NULL, the stage's output,
+     * to flush whenever the input stalls (see
+     * bytes_in_stalled): that is, whenever flush_ns have gone
+     * by since the oldest input that hasn't been flushed yet
+     * arrived (at arrived, by stats_now(), or 0 if there isn't
+     * any), and we need more. */
+    struct bytes_out *flush_to;
+    word flush_ns, arrived;
+} bytes_in;
+
+/* A struct for holding the current state in the process of
+ * writing bytes to some file descriptor (or ring, or memory).
+ * The bytes waiting to be written are buffer[0] up to (but
+ * not including) buffer[length].
+ * When writing to memory, nothing is ever actually written;
+ * the buffer just grows to hold everything, and whoever's
+ * done with it can take the bytes from there. When writing to
+ * a ring, the buffer is room in the ring, which each flush
+ * hands over (without copying it anywhere).
+ */
+typedef struct bytes_out {
+    /* the file descriptor, */
+    int out;
+    /* or, if this isn't NULL, the ring */
+    struct ring *ring;
+
+    byte *buffer;
+    size_t length, capacity;
+
+    /* if this isn't NULL, the file descriptor is a pipe and we
+     * write to it with vmsplice (see byte_io.c) */
+    struct splicer *splice;
+
+    /* if this isn't NULL, where to count bytes written and
+     * time spent waiting to write them */
+    struct stage_stats *stats;
+} bytes_out;
+
+void bytes_in_init(bytes_in *bi, int in);
+void bytes_in_init_ring(bytes_in *bi, struct ring *r);
+void bytes_in_init_mem(bytes_in *bi, const byte *data, size_t length);
+void bytes_in_init_file(bytes_in *bi, const char *path);
+void bytes_in_free(bytes_in *bi);
+void bytes_in_flush_to(bytes_in *bi, struct bytes_out *bo, word ms);
+int bytes_in_stalled(bytes_in *bi);
+size_t peek_bytes(bytes_in *bi, size_t count, const byte **data);
+size_t read_bytes(bytes_in *bi, void *buf, size_t count);
+size_t take_bytes_into(bytes_in *bi, size_t count, const byte **data,
+        byte *spare);
+size_t take_bytes(bytes_in *bi, size_t count, const byte **data,
+        byte **owned);
+
+void bytes_out_init(bytes_out *bo, int out);
+void bytes_out_init_ring(bytes_out *bo, struct ring *r);
+void bytes_out_init_mem(bytes_out *bo, size_t capacity);
+void bytes_out_splice(bytes_out *bo);
+void bytes_out_free(bytes_out *bo);
+void flush_bytes(bytes_out *bo);
+void write_bytes(bytes_out *bo, const void *buf, size_t count);
+
+void enlarge_pipe(int fd);
+
+/* Whether we're reading from memory, in which case the
+ * pointers peek_bytes() hands out stay good for as long as
+ * the bytes_in does (since nothing ever gets slid down over
+ * them), not just until the next refill. */
+static inline int bytes_in_memory(const bytes_in *bi) {
+    return bi->in < 0 && !bi->ring;
+}
+
+/* Mark count peeked bytes as used up. */
+static inline void consume_bytes(bytes_in *bi, size_t count) {
+    bi->start += count;
+}
+
+/* Make sure there are at least count free bytes at the end
+ * of the buffer (flushing if necessary) and return a pointer
+ * to them. Once they're filled in, call commit_bytes() to
+ * mark them as ready to write. count should be no more than
+ * BYTES_BUFFER_SIZE.
+ */
+static inline byte *reserve_bytes(bytes_out *bo, size_t count) {
+    if (bo->capacity - bo->length < count) flush_bytes(bo);
+    return bo->buffer + bo->length;
+}
+
+/* Mark count reserved bytes as filled in. */
+static inline void commit_bytes(bytes_out *bo, size_t count) {
+    bo->length += count;
+}
+
+/* Single-byte versions of the above. These are the hot
+ * path for byte-at-a-time callers, so they only fall back
+ * to the out-of-line functions when the buffer needs
+ * refilling or flushing.
+ * read_byte returns 0 at EOF and 1 otherwise. */
+
+static inline int read_byte(bytes_in *bi, byte *x) {
+    const byte *data;
+    if (bi->start == bi->end && !peek_bytes(bi, 1, &data)) return 0;
+    *x = bi->buffer[bi->start++];
+    return 1;
+}
+
+static inline void write_byte(bytes_out *bo, byte x) {
+    if (bo->length == bo->capacity) flush_bytes(bo);
+    bo->buffer[bo->length++] = x;
+}
@@ -0,0 +1,127 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "byte_io.h"
+#include "random.h"
+#include "options.h"
+#include "stats.h"
+#include "channel.h"
+
+/* A noisy channel, for testing error correction: copies its
+ * input to its output, flipping each bit with probability
+ * 2^-o->error_log2.
+ *
+ * Deciding bit by bit would mean a random number for every bit,
+ * almost all of them to decide to do nothing. Instead we work
+ * out how far it is to the next error directly: the number of
+ * good bits before an error follows a geometric distribution,
+ * which we can sample with one random number and a logarithm
+ * (if U is uniform on (0, 1], floor(log U / log(1 - p)) is
+ * geometric with parameter p). So the cost is per error, not
+ * per bit, and apart from that we're just copying bytes.
+ *
+ * With o->burst > 1, each error is a burst instead: a stretch
+ * of that many bits whose first and last bits are flipped and
+ * whose bits in between are each flipped with probability 1/2,
+ * which is the usual model for burst errors (a scratch on a
+ * disk, say, or a burst of interference). Bursts don't overlap;
+ * the gap to the next one is counted from the end of the last.
+ */
+
+typedef struct channel_state {
+    rng r;
+    /* log(1 - p), for sampling gaps */
+    double log_keep;
+    /* how many bits a burst covers */
+    byte burst;
+    /* how many bits to copy before the next burst starts */
+    word skip;
+    /* the flips still to make (bit 0 being the next bit), for
+     * a burst that ran off the end of the last chunk */
+    word carry;
+    /* how many bits we've flipped so far */
+    word flips;
+} channel_state;
+
+static word next_gap(channel_state *s) {
+    double u = 1.0 - rng_double(&s->r);
+    return floor(log(u) / s->log_keep);
+}
+
+/* The pattern of flips for a burst of s->burst bits. */
+static word next_burst(channel_state *s) {
+    if (s->burst == 1) return 1;
+    word edges = (word)1 | (word)1 << (s->burst - 1);
+    return (rng_next(&s->r) & (~(word)0 >> (WORD_BITS - s->burst))) | edges;
+}
+
+/* Flip the bits set in pattern, starting from bit bit of data
+ * (which is length bytes long), and return any of them that
+ * go off the end, shifted down to start from the first bit
+ * after it. */
+static word apply(channel_state *s, byte *data, size_t length,
+        word bit, word pattern) {
+    for (; pattern; pattern >>= 1, bit++) {
+        if (bit >= (word)length * 8) return pattern;
+        if (pattern & 1) {
+            data[bit >> 3] ^= 1 << (bit & 7);
+            s->flips++;
+        }
+    }
+    return 0;
+}
+
+static void channel_chunk(channel_state *s, byte *data, size_t length) {
+    word bits = (word)length * 8,
+         bit = 0;
+    if (s->carry) s->carry = apply(s, data, length, 0, s->carry);
+    while (bit < bits && s->skip < bits - bit) {
+        bit += s->skip;
+        s->carry = apply(s, data, length, bit, next_burst(s));
+        bit += s->burst;
+        s->skip = next_gap(s);
+    }
+    /* skip counts from the end of the last burst, which might
+     * be past the end of this chunk */
+    if (bit > bits) s->skip += bit - bits;
+    else s->skip -= bits - bit;
+}
+
+/* Where the seed comes from when --seed isn't given: something
+ * different each time, since that's what a noisy channel is
+ * like. It's reported at the end, so a run can be repeated. */
+static word default_seed(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return (word)t.tv_sec * 1000000007 ^ t.tv_nsec ^ (word)getpid() << 32;
+}
+
+void channel(bytes_in *in, bytes_out *out, const options *o) {
+    channel_state s;
+    word seed = o->seeded ? o->seed : default_seed();
+    rng_seed(&s.r, seed);
+    s.log_keep = log1p(-ldexp(1, -o->error_log2));
+    s.burst = o->burst;
+    s.carry = s.flips = 0;
+    s.skip = next_gap(&s);
+
+    word total = 0;
+    const byte *data;
+    size_t avail;
+    while ((avail = peek_bytes(in, 1, &data))) {
+        if (avail > BYTES_BUFFER_SIZE) avail = BYTES_BUFFER_SIZE;
+        byte *copy = reserve_bytes(out, avail);
+        memcpy(copy, data, avail);
+        channel_chunk(&s, copy, avail);
+        commit_bytes(out, avail);
+        consume_bytes(in, avail);
+        total += avail;
+        if (out->stats) out->stats->flips = s.flips;
+    }
+    if (!o->quiet) {
+        WHINE("channel: flipped %ju of %ju bits (seed %ju)\n",
+                (uintmax_t)s.flips, (uintmax_t)total * 8, (uintmax_t)seed);
+    }
+}
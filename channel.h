@@ -0,0 +1,8 @@
+#include "general.h"
+
+struct options;
+
+/* The most bits one error burst can cover (see channel.c). */
+#define CHANNEL_MAX_BURST 64
+
+void channel(bytes_in *in, bytes_out *out, const struct options *o);
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "byte_io.h"
+#include "ring.h"
+#include "pool.h"
+#include "options.h"
+#include "stats.h"
+#include "codec.h"
+
+/* The stage's thread: run it from one ring to the other, then
+ * close the output so that the caller knows it's all there.
+ */
+static void *run_codec(void *arg) {
+    codec *c = arg;
+    bytes_in bi;
+    bytes_out bo;
+    bytes_in_init_ring(&bi, &c->rings[0]);
+    bytes_out_init_ring(&bo, &c->rings[1]);
+    if (c->settings.flush) bytes_in_flush_to(&bi, &bo, c->settings.flush_ms);
+    c->step(&bi, &bo, &c->settings);
+    flush_bytes(&bo);
+    ring_close(&c->rings[1]);
+    bytes_in_free(&bi);
+    bytes_out_free(&bo);
+    return NULL;
+}
+
+/* Start the stage's thread. If there can't be one, the stage
+ * gives up before it's begun, with status 4 (as the command
+ * line does when it can't write), and the codec is done;
+ * returns 0 then, and 1 otherwise.
+ */
+static int codec_start(codec *c) {
+    c->finished = 0;
+    c->running = !pthread_create(&c->thread, NULL, run_codec, c);
+    if (!c->running) {
+        stage_fail(&c->error, 4, "codec: couldn't start a thread for "
+                "the stage\n");
+        ring_close(&c->rings[1]);
+    }
+    return c->running;
+}
+
+/* Get the stage to stop, whatever it was doing, and wait for
+ * it to: whatever it still has to write is thrown away, and if
+ * the input's still open, it ends here.
+ */
+static void codec_stop(codec *c) {
+    ring_abandon(&c->rings[1]);
+    if (!c->finished) ring_close(&c->rings[0]);
+    if (c->running) pthread_join(c->thread, NULL);
+    c->running = 0;
+}
+
+/* Set c up to run step with (a copy of) settings, and start
+ * it going. Returns 1, or 0 if there wasn't the memory for its
+ * rings or a thread to run it on, in which case there's
+ * nothing to free.
+ */
+int codec_init(codec *c, void (*step)(bytes_in *, bytes_out *,
+            const options *), const options *settings) {
+    c->step = step;
+    c->settings = *settings;
+    if (!c->settings.jobs) c->settings.jobs = pool_default_workers();
+    /* (there's nobody to read anything a stage might have to
+     * say, not even channel's count of its flips) */
+    c->settings.quiet = 1;
+    c->settings.stats = 0;
+    /* (rings want to be cache-line aligned) */
+    c->rings = aligned_alloc(64, sizeof(ring) * 2);
+    if (!ring_init(&c->rings[0])) {
+        free(c->rings);
+        return 0;
+    }
+    if (!ring_init(&c->rings[1])) {
+        ring_free(&c->rings[0]);
+        free(c->rings);
+        return 0;
+    }
+    stage_error_init(&c->error);
+    c->settings.error = &c->error;
+    /* we're at one end of each, so codec_wait waits on both */
+    ring_share_waits(&c->rings[1], &c->rings[0]);
+    if (!codec_start(c)) {
+        codec_free(c);
+        return 0;
+    }
+    return 1;
+}
+
+/* Hand the stage as much of the count bytes at data as there's
+ * room for right now, and return how much that was. If it's
+ * less than count, there's no room for the rest until the
+ * stage gets further along (which might mean draining its
+ * output first).
+ */
+size_t codec_feed(codec *c, const void *data, size_t count) {
+    return ring_write_some(&c->rings[0], data, count);
+}
+
+/* Copy up to count bytes of whatever output the stage has
+ * written so far into data, and return how many. The stage
+ * saves its output up a bufferful at a time (or until it's
+ * done, or with flush set, until its input stalls), so there
+ * mightn't be any for a while.
+ */
+size_t codec_drain(codec *c, void *data, size_t count) {
+    return ring_read_some(&c->rings[1], data, count);
+}
+
+/* codec_feed and codec_drain without the copying, for a
+ * caller that can make its input right where the stage reads
+ * it, or use the output right where the stage wrote it.
+ * codec_space sets *data to point at the room there is right
+ * now for input and returns how much (which may be none), to
+ * fill in and then hand over with codec_fed. codec_output does
+ * the same for the output written so far, which stays put
+ * until codec_drained says how much of it has been used.
+ */
+size_t codec_space(codec *c, byte **data) {
+    return ring_room(&c->rings[0], data);
+}
+
+void codec_fed(codec *c, size_t count) {
+    ring_commit(&c->rings[0], count);
+}
+
+size_t codec_output(codec *c, const byte **data) {
+    return ring_avail(&c->rings[1], data);
+}
+
+void codec_drained(codec *c, size_t count) {
+    ring_consume(&c->rings[1], count);
+}
+
+/* Wait until there's room to feed more input (unless we're
+ * finished with the input) or some output to drain, or the
+ * stage is done. (Output that codec_output handed out but
+ * that isn't drained yet counts, so this won't wait if there's
+ * any.)
+ */
+void codec_wait(codec *c) {
+    ring_wait_pair(c->finished ? NULL : &c->rings[0], &c->rings[1]);
+}
+
+/* Tell the stage there's no more input. */
+void codec_finish(codec *c) {
+    if (c->finished) return;
+    ring_close(&c->rings[0]);
+    c->finished = 1;
+}
+
+/* Whether the stage is done and all of its output drained. */
+int codec_done(codec *c) {
+    return ring_finished(&c->rings[1]);
+}
+
+/* 0 if the stage hasn't given up on its input (so far), or
+ * else the status the command line would have exited with: 3
+ * for input that makes no sense, 2 for settings that don't
+ * (like a dict that isn't a dictionary). Once it's nonzero,
+ * c->error.message says why, and won't change.
+ */
+int codec_status(codec *c) {
+    return stage_failed(&c->error);
+}
+
+/* Drop whatever c was in the middle of and start its stage
+ * over, for a new stream. Cheaper than codec_free and then
+ * codec_init, since the rings are kept. Returns 0 if there
+ * wasn't a thread to start it on (see codec_start); c still
+ * needs freeing then, or can be reset again.
+ */
+int codec_reset(codec *c) {
+    codec_stop(c);
+    ring_reset(&c->rings[0]);
+    ring_reset(&c->rings[1]);
+    stage_error_clear(&c->error);
+    return codec_start(c);
+}
+
+void codec_free(codec *c) {
+    codec_stop(c);
+    ring_free(&c->rings[0]);
+    ring_free(&c->rings[1]);
+    free(c->rings);
+    stage_error_free(&c->error);
+}
+
+/* For when the whole input is in memory already: run step
+ * with (a copy of) settings over the length bytes at data,
+ * right on this thread, and return how many bytes of output
+ * there were, in a buffer that *out is set to (for the caller
+ * to free). Anything that goes wrong goes to error (see
+ * stats.h), which the caller sets up with stage_error_init;
+ * as with a codec, if error->status is nonzero afterwards, the
+ * stage gave up partway through. (If error is NULL, there's
+ * no telling, but it still never exits.)
+ * The stages read a word at a time, up to BYTES_SLACK bytes
+ * past the end of their input. size says how many bytes at
+ * data may be read: if that's at least length + BYTES_SLACK,
+ * the input is read in place; if not (pass length if there's
+ * nothing after it), it's copied into a buffer with room
+ * for the slack first.
+ */
+size_t codec_run(void (*step)(bytes_in *, bytes_out *, const options *),
+        const options *settings, const byte *data, size_t length,
+        size_t size, byte **out, stage_error *error) {
+    stage_error ignored;
+    if (!error) stage_error_init(error = &ignored);
+    options o = *settings;
+    if (!o.jobs) o.jobs = pool_default_workers();
+    o.quiet = 1;
+    o.stats = 0;
+    o.error = error;
+    byte *padded = NULL;
+    if (size < length + BYTES_SLACK) {
+        padded = malloc(length + BYTES_SLACK);
+        memcpy(padded, data, length);
+        memset(padded + length, 0, BYTES_SLACK);
+        data = padded;
+    }
+    bytes_in bi;
+    bytes_out bo;
+    bytes_in_init_mem(&bi, data, length);
+    bytes_out_init_mem(&bo, length + BYTES_BUFFER_SIZE);
+    /* (no flush_bytes: in memory, that would only make more
+     * room) */
+    step(&bi, &bo, &o);
+    bytes_in_free(&bi);
+    free(padded);
+    if (error == &ignored) stage_error_free(&ignored);
+    *out = bo.buffer;
+    return bo.length;
+}
@@ -0,0 +1,91 @@
+#include <pthread.h>
+
+#include "general.h"
+
+/* Running a stage (lzw_encode, hamming_decode, or any of the
+ * others from the subcommand list) inside another program, on
+ * its own buffers rather than file descriptors. Include
+ * byte_io.h, options.h and stats.h first (or just include
+ * codes.h, which includes everything a program using the
+ * library needs).
+ *
+ * The stages are written as loops that pull in input and push
+ * out output as they please, so a codec runs its stage on a
+ * thread of its own, between two rings (see ring.h), just as
+ * pipeline_threads does. The caller feeds input into one ring
+ * and drains output from the other, and never has to wait
+ * unless it runs out of other things to do. The stage works
+ * on the rings in place, so codec_feed and codec_drain are the
+ * only copies made (and codec_space and codec_output do
+ * without even those):
+ *
+ *     options settings = codes_defaults;
+ *     settings.max_bits = 12;
+ *     codec c;
+ *     if (!codec_init(&c, lzw_encode, &settings)) ...out of memory...
+ *     while (length) {
+ *         size_t fed = codec_feed(&c, data, length);
+ *         data += fed, length -= fed;
+ *         size_t got = codec_drain(&c, buf, sizeof buf);
+ *         ...use got bytes of buf...
+ *         if (!fed && !got) codec_wait(&c);
+ *     }
+ *     codec_finish(&c);
+ *     while (!codec_done(&c)) {
+ *         size_t got = codec_drain(&c, buf, sizeof buf);
+ *         ...use got bytes of buf...
+ *         if (!got) codec_wait(&c);
+ *     }
+ *     if (codec_status(&c)) ...c.error.message says what's wrong...
+ *     codec_free(&c);
+ *
+ * The stage gets its settings from a copy of the ones it's
+ * given (start from codes_defaults, as above), so the
+ * caller's can change or go away; all but dict, which is only
+ * a pointer to the path. It never writes on standard
+ * error or exits. If its input doesn't make sense, it gives
+ * up: codec_status says so, c.error.message says why, and the
+ * codec is done once its output (whatever it got as far as) is
+ * drained, taking but ignoring any more input. (Complaints it
+ * carries on after, like a block that doesn't match its
+ * checksum, are counted in c.error.complaints; the first one
+ * goes in the message if nothing's given up.) The stage saves
+ * its output up a bufferful at a time, unless its settings
+ * have flush set; then, once it's run out of input for
+ * flush_ms milliseconds, everything it's been fed so far comes
+ * out (so with 0, just stopping feeding it is enough to get it
+ * all back).
+ */
+typedef struct codec {
+    void (*step)(bytes_in *, bytes_out *, const options *);
+    /* the stage's own copy of its settings, whose error points
+     * at the next field */
+    options settings;
+    stage_error error;
+    /* the ring to the stage, then the one from it */
+    struct ring *rings;
+    pthread_t thread;
+    /* set while there's a thread to join */
+    byte running;
+    /* set once codec_finish has been called */
+    byte finished;
+} codec;
+
+int codec_init(codec *c, void (*step)(bytes_in *, bytes_out *,
+            const options *), const options *settings);
+size_t codec_feed(codec *c, const void *data, size_t count);
+size_t codec_drain(codec *c, void *data, size_t count);
+size_t codec_space(codec *c, byte **data);
+void codec_fed(codec *c, size_t count);
+size_t codec_output(codec *c, const byte **data);
+void codec_drained(codec *c, size_t count);
+void codec_wait(codec *c);
+void codec_finish(codec *c);
+int codec_done(codec *c);
+int codec_status(codec *c);
+int codec_reset(codec *c);
+void codec_free(codec *c);
+
+size_t codec_run(void (*step)(bytes_in *, bytes_out *, const options *),
+        const options *settings, const byte *data, size_t length,
+        size_t size, byte **out, stage_error *error);
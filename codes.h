@@ -0,0 +1,15 @@
+/* Everything a program using the codecs as a library
+ * (libcodes.a or libcodes.so) needs: the stages, the settings
+ * they take, what they report when they go wrong, and codec.h
+ * for running them on the program's own buffers. Include this
+ * instead of the headers it includes.
+ */
+#include "byte_io.h"
+#include "options.h"
+#include "stats.h"
+#include "lzw.h"
+#include "lzw_encode.h"
+#include "lzw_decode.h"
+#include "huffman.h"
+#include "hamming.h"
+#include "codec.h"
@@ -0,0 +1,49 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "codetable.h"
+
+/* a reasonable starting size; it'll double as needed */
+#define CODETABLE_INITIAL_BITS 12
+
+/* Set up an empty codetable.
+ */
+void codetable_init(codetable *t) {
+    t->bits = CODETABLE_INITIAL_BITS;
+    t->slots = calloc((size_t)1 << t->bits, sizeof(codetable_slot));
+    t->count = 0;
+    t->stamp = CODETABLE_STAMP_ONE;
+}
+
+void codetable_free(codetable *t) {
+    free(t->slots);
+}
+
+/* Empty the table out, keeping its current size. That's just
+ * a matter of moving on to the next generation, unless we've
+ * run out of them.
+ */
+void codetable_clear(codetable *t) {
+    t->stamp += CODETABLE_STAMP_ONE;
+    if (!t->stamp) {
+        memset(t->slots, 0, sizeof(codetable_slot) << t->bits);
+        t->stamp = CODETABLE_STAMP_ONE;
+    }
+    t->count = 0;
+}
+
+/* Double the number of slots, rehashing everything from this
+ * generation into the new array.
+ */
+void codetable_grow(codetable *t) {
+    codetable old = *t;
+    t->bits++;
+    t->slots = calloc((size_t)1 << t->bits, sizeof(codetable_slot));
+    for (word i = 0; i < (word)1 << old.bits; i++) {
+        if ((old.slots[i].key & ~(CODETABLE_STAMP_ONE - 1)) == t->stamp) {
+            *codetable_probe(t, old.slots[i].key) = old.slots[i];
+        }
+    }
+    codetable_free(&old);
+}
+
@@ -0,0 +1,91 @@
+#include "general.h"
+
+/* A hash table mapping (code number, byte) pairs to code
+ * numbers. Used for the LZW dictionary: the key is a word
+ * that's already in the dictionary plus one more byte, and
+ * the value is the code number of the longer word.
+ *
+ * This replaces a tree with a sorted linked list of children
+ * at each node, which meant a malloc per entry and a pointer
+ * chase per child per lookup. Here, everything lives in one
+ * flat array, we use open addressing with linear probing, and
+ * a lookup is usually a single cache miss.
+ *
+ * Clearing the table doesn't touch the slots: each key is
+ * stamped with the table's generation in its top bits, and
+ * clearing just starts a new generation, after which any slot
+ * with an older stamp counts as empty. That matters when the
+ * table gets cleared a lot, as it does for every one of a
+ * stream of small records (see lzw_encode.c); otherwise we'd
+ * wipe a big table over and over to get rid of a few entries.
+ */
+typedef struct codetable_slot {
+    /* (code << 8 | byte) + 1, plus the stamp of the generation
+     * it was filled in, or 0 if it's never been filled */
+    word key;
+    word code;
+} codetable_slot;
+
+/* The low CODETABLE_KEY_BITS bits of a key are the (code,
+ * byte) pair, and the rest are the stamp. Codes have at most
+ * 24 bits, so the pair (plus one) fits in 33; the other 31
+ * are enough generations that starting over from generation 1
+ * (wiping the table for real) hardly ever happens. */
+#define CODETABLE_KEY_BITS 33
+#define CODETABLE_STAMP_ONE ((word)1 << CODETABLE_KEY_BITS)
+
+typedef struct codetable {
+    /* there are 1 << bits slots */
+    codetable_slot *slots;
+    byte bits;
+
+    /* number of slots in use in this generation */
+    word count;
+
+    /* the current generation, shifted into place in a key */
+    word stamp;
+} codetable;
+
+void codetable_init(codetable *t);
+void codetable_free(codetable *t);
+void codetable_clear(codetable *t);
+void codetable_grow(codetable *t);
+
+/* Turn a (code, byte) pair into a key for t. */
+static inline word codetable_key(const codetable *t, word code, byte next) {
+    return ((code << 8 | next) + 1) | t->stamp;
+}
+
+/* Find the slot that holds key, or the empty slot where it
+ * would go if it's not in the table. Either way, the caller
+ * can tell which it is by checking whether the slot's key is
+ * key.
+ */
+static inline codetable_slot *codetable_probe(const codetable *t, word key) {
+    /* Fibonacci hashing: multiply by 2^64 / phi and keep the
+     * top bits, which depend on all of the bits of the pair
+     * (the stamp is left out, so that it doesn't move things
+     * around from one generation to the next) */
+    word mask = ((word)1 << t->bits) - 1,
+         i = ((key & (CODETABLE_STAMP_ONE - 1)) * (word)0x9E3779B97F4A7C15)
+             >> (WORD_BITS - t->bits),
+         diff;
+    /* a slot with a different key but the same stamp is in
+     * use; anything else is either key's or empty */
+    while ((diff = t->slots[i].key ^ key) && diff < CODETABLE_STAMP_ONE) {
+        i = (i + 1) & mask;
+    }
+    return &t->slots[i];
+}
+
+/* Fill in an empty slot returned by codetable_probe. Don't use
+ * the slot pointer afterward; the table may have been resized.
+ */
+static inline void codetable_fill(codetable *t, codetable_slot *slot,
+        word key, word code) {
+    slot->key = key;
+    slot->code = code;
+    /* keep the table at most half full, so that probe
+     * sequences stay short */
+    if (++t->count > (word)1 << (t->bits - 1)) codetable_grow(t);
+}
@@ -0,0 +1,133 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+/* Like most CRCs, CRC32C works with the bits of each byte
+ * lowest first, so the polynomial is written backwards, and
+ * the CRC is inverted going in and coming out, so that
+ * leading and trailing zero bytes still count. The kernels
+ * below leave the inverting to crc32c(), and just work on the
+ * raw remainder. */
+#define CRC32C_POLY 0x82F63B78u
+
+/* tables[0] is the usual table for a byte at a time; each
+ * tables[k] after it is what tables[k - 1] comes to after
+ * another zero byte, which lets us do 8 bytes at a time with
+ * one lookup apiece ("slicing by 8") */
+static uint32_t tables[8][256];
+
+static uint32_t crc_bytes(uint32_t crc, const byte *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        crc = tables[0][(crc ^ data[i]) & 0xFF] ^ crc >> 8;
+    }
+    return crc;
+}
+
+static uint32_t crc_table(uint32_t crc, const byte *data, size_t length) {
+    for (; length >= 8; data += 8, length -= 8) {
+        uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16
+                | (uint32_t)data[3] << 24);
+        crc = tables[7][lo & 0xFF] ^ tables[6][lo >> 8 & 0xFF]
+            ^ tables[5][lo >> 16 & 0xFF] ^ tables[4][lo >> 24]
+            ^ tables[3][data[4]] ^ tables[2][data[5]]
+            ^ tables[1][data[6]] ^ tables[0][data[7]];
+    }
+    return crc_bytes(crc, data, length);
+}
+
+static uint32_t (*kernel)(uint32_t, const byte *, size_t) = crc_table;
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* With SSE4.2's crc32 instruction, 8 bytes take one
+ * instruction, but each has to wait a few cycles for the one
+ * before it to finish. So we run three at once, over three
+ * neighbouring stretches of STRIPE bytes, and then stitch
+ * them together: the remainder of a then b is the remainder
+ * of a, carried on through as many zero bytes as b has, xor
+ * the remainder of b alone (CRCs being linear like that). And
+ * carrying a remainder on through STRIPE zero bytes is
+ * linear too, so a table per byte of it, shift[], does it in
+ * four lookups. */
+#define STRIPE 4096
+
+static uint32_t shift[4][256];
+
+static inline uint32_t shift_stripe(uint32_t crc) {
+    return shift[0][crc & 0xFF] ^ shift[1][crc >> 8 & 0xFF]
+        ^ shift[2][crc >> 16 & 0xFF] ^ shift[3][crc >> 24];
+}
+
+static inline uint64_t load64(const byte *p) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return x;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const byte *data, size_t length) {
+    uint64_t a = crc;
+    for (; length >= 3 * STRIPE; data += 3 * STRIPE, length -= 3 * STRIPE) {
+        uint64_t b = 0, c = 0;
+        for (size_t i = 0; i < STRIPE; i += 8) {
+            a = _mm_crc32_u64(a, load64(data + i));
+            b = _mm_crc32_u64(b, load64(data + STRIPE + i));
+            c = _mm_crc32_u64(c, load64(data + 2 * STRIPE + i));
+        }
+        a = shift_stripe(shift_stripe(a) ^ b) ^ c;
+    }
+    for (; length >= 8; data += 8, length -= 8) {
+        a = _mm_crc32_u64(a, load64(data));
+    }
+    for (; length; data++, length--) a = _mm_crc32_u8(a, *data);
+    return a;
+}
+#endif
+
+/* Fill in the tables, and use the crc32 instruction if the CPU
+ * has it. */
+static void build_tables(void) {
+    for (uint32_t x = 0; x < 256; x++) {
+        uint32_t crc = x;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc >> 1 ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        tables[0][x] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int x = 0; x < 256; x++) {
+            uint32_t crc = tables[k - 1][x];
+            tables[k][x] = tables[0][crc & 0xFF] ^ crc >> 8;
+        }
+    }
+#if defined(__x86_64__)
+    /* each bit's worth of shift[] the slow way, then every
+     * byte's worth from those */
+    static const byte zeros[STRIPE];
+    uint32_t bits[32];
+    for (int bit = 0; bit < 32; bit++) {
+        bits[bit] = crc_table((uint32_t)1 << bit, zeros, STRIPE);
+    }
+    for (int k = 0; k < 4; k++) {
+        for (int x = 0; x < 256; x++) {
+            uint32_t s = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                if (x >> bit & 1) s ^= bits[8 * k + bit];
+            }
+            shift[k][x] = s;
+        }
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) kernel = crc_sse42;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const byte *data, size_t length) {
+    /* (stages may be running on several threads at once, as in
+     * hamming.c) */
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, build_tables);
+    return ~kernel(~crc, data, length);
+}
@@ -0,0 +1,13 @@
+#include "general.h"
+
+/* CRC32C (the Castagnoli polynomial, as used by iSCSI, ext4
+ * and friends), for checking that compressed data hasn't been
+ * damaged since it was written. x86 CPUs since SSE4.2 have an
+ * instruction for it, which we use if it's there; otherwise
+ * it's done with tables, 8 bytes at a time.
+ *
+ * Pass 0 to start, and the result so far to carry on, so
+ * that crc32c(crc32c(0, a, n), b, m) is the CRC of a then b.
+ * (The CRC of "123456789" is e3069283.)
+ */
+uint32_t crc32c(uint32_t crc, const byte *data, size_t length);
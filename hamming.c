@@ -1,7 +1,14 @@
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "byte_io.h"
+#include "pool.h"
+#include "slab.h"
+#include "options.h"
+#include "stats.h"
 #include "hamming.h"
+#include "secded.h"
 
 typedef uint16_t byte2;
 
@@ -26,19 +33,6 @@ typedef uint16_t byte2;
     E(x, 0) ^ E(x, 1) ^ E(x, 2) ^ E(x, 3) ^\
     E(x, 4) ^ E(x, 5) ^ E(x, 6) ^ E(x, 7)
 
-/* Perform Hamming(8, 4) encoding, reading from file descriptor
- * in and writing to file descriptor out.
- * Writes two bytes for each input byte.
- */
-void hamming_encode(int in, int out) {
-    /* This is really simple! */
-    byte next_byte;
-    while (read_byte(in, &next_byte)) {
-        byte2 encoded = HAMMING_ENCODE_BYTE(next_byte);
-        write(out, &encoded, 2);
-    }
-}
-
 /* the [COL]umns of the [C]heck matrix */
 #define CCOL0 0x09
 #define CCOL1 0x0A
@@ -73,57 +67,704 @@ void hamming_encode(int in, int out) {
     P(x, 2, 0) | P(x, 4, 1) | P(x, 5, 2) | P(x, 6, 3) |\
     P(x, A, 4) | P(x, C, 5) | P(x, D, 6) | P(x, E, 7)
 
-/* Perform Hamming(8, 4) decoding, reading from file descriptor
- * in and writing to file descriptor out.
- * Writes one bytes for each two input bytes.
- */
-void hamming_decode(int in, int out) {
-    byte2 next_byte2;
-    /* we want to know how many bytes the read_amap() fetches
-     * so that we can pad with zeroes if necessary */
-    int nread;
-    while ((nread = read_amap(in, &next_byte2, 2))) {
-        if (nread == 1) next_byte2 &= 0xFF;
-        /* check_lo is the syndrome for the lower 8 bits of
-         * next_byte2; check_hi is the syndrome for the upper
-         * 8 bits */
-        byte check = HAMMING_CHECK_BYTE2(next_byte2),
-             check_lo = check & 15,
-             check_hi = check >> 4;
-        /* if the high bit is set, we have an odd number of
-         * errors, which we assume is just 1 */
-        if (check_lo & 8) {
-            /* If the error is anywhere but the extended bit,
-             * the lower 3 bits of the syndrome will be its
-             * 1-based index, so we need to extract the lower
-             * 3 bits and subtract 1. If the error is in the
-             * extended bit, the syndrome will be 0b1000.
-             * (check_lo - 1) & 7 does the trick in either
-             * case. */
-            check_lo = (check_lo - 1) & 7;
-            /* just flip the incorrect bit */
-            next_byte2 ^= 1 << check_lo;
+/* Decode a single byte2, correcting single errors. Returns
+ * the data byte in the low 8 bits and HAMMING_* flags saying
+ * what we found in the high 8.
+ * This is the slow, obviously-correct version; we only use it
+ * to fill in decode_table.
+ */
+static byte2 hamming_decode_byte2(byte2 next_byte2) {
+    byte2 flags = 0;
+    /* check_lo is the syndrome for the lower 8 bits of
+     * next_byte2; check_hi is the syndrome for the upper
+     * 8 bits */
+    byte check = HAMMING_CHECK_BYTE2(next_byte2),
+         check_lo = check & 15,
+         check_hi = check >> 4;
+    /* if the high bit is set, we have an odd number of
+     * errors, which we assume is just 1 */
+    if (check_lo & 8) {
+        /* If the error is anywhere but the extended bit,
+         * the lower 3 bits of the syndrome will be its
+         * 1-based index, so we need to extract the lower
+         * 3 bits and subtract 1. If the error is in the
+         * extended bit, the syndrome will be 0b1000.
+         * (check_lo - 1) & 7 does the trick in either
+         * case. */
+        check_lo = (check_lo - 1) & 7;
+        /* just flip the incorrect bit */
+        next_byte2 ^= 1 << check_lo;
+        flags |= HAMMING_CORRECTED_LO;
+    }
+    else if (check_lo) {
+        /* any nonzero syndrome with a zero high bit can
+         * only result from an even, nonzero number of
+         * errors, which we assume is 2 */
+        flags |= HAMMING_DOUBLE_LO;
+    }
+    /* the next bit is all of the same logic but for the
+     * upper 8 bits of next_byte2 */
+    if (check_hi & 8) {
+        check_hi = (check_hi - 1) & 7;
+        next_byte2 ^= 1 << (check_hi + 8);
+        flags |= HAMMING_CORRECTED_HI;
+    }
+    else if (check_hi) {
+        flags |= HAMMING_DOUBLE_HI;
+    }
+    /* now that we've used the parity information, we
+     * throw it away and keep the data bits */
+    return HAMMING_PROJECT(next_byte2) | flags << 8;
+}
+
+/* Rather than evaluating the macros above for every symbol,
+ * we evaluate them once for every possible input and look
+ * the answers up afterward. encode_table maps a data byte
+ * to its byte2; decode_table maps a received byte2 straight
+ * to what hamming_decode_byte2 says about it. That's 128 KiB
+ * for the latter, which is small enough to stay in cache. */
+static byte2 encode_table[1 << 8];
+static byte2 decode_table[1 << 16];
+
+/* The vectorized kernels below can't index a 256-entry table,
+ * but they can index 16-entry ones with a byte shuffle. Since
+ * both halves of a byte2 are independent codewords, and the
+ * matrices are linear, everything they need can be computed
+ * a nibble at a time from these. In each pair, the first
+ * table is indexed by the low nibble of a byte and the second
+ * by the high nibble. */
+static struct {
+    /* a byte's low (resp. high) nibble's contribution to
+     * the low (resp. high) byte of its byte2 */
+    byte encode[2][16];
+    /* a received byte's nibbles' contributions to its
+     * syndrome, and to its data nibble */
+    byte check[2][16], project[2][16];
+    /* for each syndrome, the bit to flip to correct it and
+     * the _LO flag (shift left for the _HI one) it raises */
+    byte correct[16], flag[16];
+} nibble_tables;
+
+/* The plain table-driven kernels. Each kernel handles some
+ * prefix of its input and returns how many symbols that was;
+ * these ones handle everything, and the vectorized ones leave
+ * the odd few at the end for these to finish off.
+ * The decoding kernels or their HAMMING_* flags into *flags.
+ */
+
+static size_t encode_scalar(const byte *in, byte *out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        byte2 x = encode_table[in[i]];
+        out[2 * i] = x & 0xFF;
+        out[2 * i + 1] = x >> 8;
+    }
+    return count;
+}
+
+static size_t decode_scalar(const byte *in, byte *out, size_t count,
+        byte *flags) {
+    byte2 found = 0;
+    for (size_t i = 0; i < count; i++) {
+        byte2 x = decode_table[in[2 * i] | in[2 * i + 1] << 8];
+        out[i] = x & 0xFF;
+        found |= x;
+    }
+    *flags |= found >> 8;
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* Encoding 16 bytes at a time: look up both nibbles of every
+ * byte at once with pshufb, then interleave the results into
+ * byte2s.
+ */
+__attribute__((target("sse4.1")))
+static size_t encode_sse41(const byte *in, byte *out, size_t count) {
+    const __m128i nibble = _mm_set1_epi8(0x0F),
+          enc_lo = _mm_loadu_si128((void*)nibble_tables.encode[0]),
+          enc_hi = _mm_loadu_si128((void*)nibble_tables.encode[1]);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i x = _mm_loadu_si128((void*)(in + i)),
+                lo = _mm_shuffle_epi8(enc_lo, _mm_and_si128(x, nibble)),
+                hi = _mm_shuffle_epi8(enc_hi,
+                        _mm_and_si128(_mm_srli_epi16(x, 4), nibble));
+        _mm_storeu_si128((void*)(out + 2 * i), _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((void*)(out + 2 * i + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+    return i;
+}
+
+/* Decode the 8 byte2s in x to 8 data bytes, one per 16-bit
+ * lane, or'ing per-byte flags into *found.
+ * Every byte of x is its own codeword, so we can find all 16
+ * syndromes at once. Usually they're all zero and we can skip
+ * straight to projecting; otherwise, correcting is just one
+ * more lookup (the syndrome tells us which bit to flip).
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i decode_x8_sse41(__m128i x, __m128i *found) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i lo = _mm_and_si128(x, nibble),
+            hi = _mm_and_si128(_mm_srli_epi16(x, 4), nibble),
+            syndrome = _mm_xor_si128(
+                _mm_shuffle_epi8(
+                    _mm_loadu_si128((void*)nibble_tables.check[0]), lo),
+                _mm_shuffle_epi8(
+                    _mm_loadu_si128((void*)nibble_tables.check[1]), hi));
+    if (!_mm_testz_si128(syndrome, syndrome)) {
+        x = _mm_xor_si128(x, _mm_shuffle_epi8(
+                    _mm_loadu_si128((void*)nibble_tables.correct), syndrome));
+        *found = _mm_or_si128(*found, _mm_shuffle_epi8(
+                    _mm_loadu_si128((void*)nibble_tables.flag), syndrome));
+        lo = _mm_and_si128(x, nibble);
+        hi = _mm_and_si128(_mm_srli_epi16(x, 4), nibble);
+    }
+    /* now each byte holds its data nibble, so each 16-bit lane
+     * is (lo nibble) | (hi nibble) << 8; fold that into a byte */
+    __m128i data = _mm_or_si128(
+            _mm_shuffle_epi8(
+                _mm_loadu_si128((void*)nibble_tables.project[0]), lo),
+            _mm_shuffle_epi8(
+                _mm_loadu_si128((void*)nibble_tables.project[1]), hi));
+    return _mm_and_si128(_mm_or_si128(data, _mm_srli_epi16(data, 4)),
+            _mm_set1_epi16(0x00FF));
+}
+
+/* Turn a vector of per-byte flags from the decoders into
+ * HAMMING_* flags: even bytes are the low halves of byte2s,
+ * and odd bytes are the high halves.
+ */
+static byte fold_flags(const byte *found, size_t length) {
+    byte flags = 0;
+    for (size_t i = 0; i < length; i += 2) {
+        flags |= found[i] | found[i + 1] << 1;
+    }
+    return flags;
+}
+
+__attribute__((target("sse4.1")))
+static size_t decode_sse41(const byte *in, byte *out, size_t count,
+        byte *flags) {
+    __m128i found = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = decode_x8_sse41(
+                    _mm_loadu_si128((void*)(in + 2 * i)), &found),
+                b = decode_x8_sse41(
+                    _mm_loadu_si128((void*)(in + 2 * i + 16)), &found);
+        _mm_storeu_si128((void*)(out + i), _mm_packus_epi16(a, b));
+    }
+    byte found_bytes[16];
+    _mm_storeu_si128((void*)found_bytes, found);
+    *flags |= fold_flags(found_bytes, 16);
+    return i;
+}
+
+/* The AVX2 versions are the same, but twice as wide. The only
+ * wrinkle is that the unpack and pack instructions work within
+ * 128-bit lanes, so we have to put the lanes back in order
+ * afterward.
+ */
+
+__attribute__((target("avx2")))
+static size_t encode_avx2(const byte *in, byte *out, size_t count) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F),
+          enc_lo = _mm256_broadcastsi128_si256(
+                  _mm_loadu_si128((void*)nibble_tables.encode[0])),
+          enc_hi = _mm256_broadcastsi128_si256(
+                  _mm_loadu_si128((void*)nibble_tables.encode[1]));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i x = _mm256_loadu_si256((void*)(in + i)),
+                lo = _mm256_shuffle_epi8(enc_lo,
+                        _mm256_and_si256(x, nibble)),
+                hi = _mm256_shuffle_epi8(enc_hi,
+                        _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble)),
+                first = _mm256_unpacklo_epi8(lo, hi),
+                second = _mm256_unpackhi_epi8(lo, hi);
+        _mm256_storeu_si256((void*)(out + 2 * i),
+                _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((void*)(out + 2 * i + 32),
+                _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i decode_x16_avx2(__m256i x, __m256i *found) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+#define TABLE(t) _mm256_broadcastsi128_si256(\
+        _mm_loadu_si128((void*)nibble_tables.t))
+    __m256i lo = _mm256_and_si256(x, nibble),
+            hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble),
+            syndrome = _mm256_xor_si256(
+                _mm256_shuffle_epi8(TABLE(check[0]), lo),
+                _mm256_shuffle_epi8(TABLE(check[1]), hi));
+    if (!_mm256_testz_si256(syndrome, syndrome)) {
+        x = _mm256_xor_si256(x,
+                _mm256_shuffle_epi8(TABLE(correct), syndrome));
+        *found = _mm256_or_si256(*found,
+                _mm256_shuffle_epi8(TABLE(flag), syndrome));
+        lo = _mm256_and_si256(x, nibble);
+        hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+    }
+    __m256i data = _mm256_or_si256(
+            _mm256_shuffle_epi8(TABLE(project[0]), lo),
+            _mm256_shuffle_epi8(TABLE(project[1]), hi));
+#undef TABLE
+    return _mm256_and_si256(_mm256_or_si256(data,
+                _mm256_srli_epi16(data, 4)), _mm256_set1_epi16(0x00FF));
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(const byte *in, byte *out, size_t count,
+        byte *flags) {
+    __m256i found = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i a = decode_x16_avx2(
+                    _mm256_loadu_si256((void*)(in + 2 * i)), &found),
+                b = decode_x16_avx2(
+                    _mm256_loadu_si256((void*)(in + 2 * i + 32)), &found);
+        _mm256_storeu_si256((void*)(out + i), _mm256_permute4x64_epi64(
+                    _mm256_packus_epi16(a, b), 0xD8));
+    }
+    byte found_bytes[32];
+    _mm256_storeu_si256((void*)found_bytes, found);
+    *flags |= fold_flags(found_bytes, 32);
+    return i;
+}
+#endif
+
+/* The kernels we're actually using: the widest ones the CPU
+ * we're running on supports. */
+static size_t (*encode_kernel)(const byte *, byte *, size_t) =
+    encode_scalar;
+static size_t (*decode_kernel)(const byte *, byte *, size_t, byte *) =
+    decode_scalar;
+
+/* Ask the CPU (via cpuid, which is what __builtin_cpu_supports
+ * uses under the hood) which instruction sets it has, and pick
+ * kernels accordingly.
+ */
+static void select_kernels(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        encode_kernel = encode_avx2;
+        decode_kernel = decode_avx2;
+    }
+    else if (__builtin_cpu_supports("sse4.1")) {
+        encode_kernel = encode_sse41;
+        decode_kernel = decode_sse41;
+    }
+#endif
+}
+
+/* Fill in the tables and pick the kernels.
+ */
+static void build_tables(void) {
+    for (int x = 0; x < 1 << 8; x++) {
+        encode_table[x] = HAMMING_ENCODE_BYTE(x);
+    }
+    for (int x = 0; x < 1 << 16; x++) {
+        decode_table[x] = hamming_decode_byte2(x);
+    }
+    for (int x = 0; x < 16; x++) {
+        nibble_tables.encode[0][x] = encode_table[x] & 0xFF;
+        nibble_tables.encode[1][x] = encode_table[x << 4] >> 8;
+        /* only look at the low byte of a byte2 here, so the
+         * syndrome is the low nibble of the check */
+        nibble_tables.check[0][x] = (HAMMING_CHECK_BYTE2(x)) & 15;
+        nibble_tables.check[1][x] = (HAMMING_CHECK_BYTE2(x << 4)) & 15;
+        nibble_tables.project[0][x] = HAMMING_PROJECT(x);
+        nibble_tables.project[1][x] = HAMMING_PROJECT(x << 4);
+        /* the same reasoning as in hamming_decode_byte2 */
+        nibble_tables.correct[x] = (x & 8) ? 1 << ((x - 1) & 7) : 0;
+        nibble_tables.flag[x] = (x & 8) ? HAMMING_CORRECTED_LO
+                              : x ? HAMMING_DOUBLE_LO : 0;
+    }
+    select_kernels();
+}
+
+/* Build the tables if that hasn't been done yet. Stages may
+ * be running on several threads at once (see main.c), so we
+ * let pthread_once make sure exactly one of them does it and
+ * the rest wait for it to finish.
+ */
+static void hamming_init(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, build_tables);
+}
+
+/* Encode count bytes from in, writing 2 * count bytes (low
+ * byte of each byte2 first) to out.
+ */
+void hamming_encode_block(const byte *in, byte *out, size_t count) {
+    hamming_init();
+    size_t done = encode_kernel(in, out, count);
+    encode_scalar(in + done, out + 2 * done, count - done);
+}
+
+/* Decode count byte2s (2 * count bytes) from in, writing
+ * count bytes to out. Returns every HAMMING_* flag raised
+ * by any of the symbols, or'd together, so that callers can
+ * cheaply tell whether anything interesting happened.
+ */
+byte hamming_decode_block(const byte *in, byte *out, size_t count) {
+    hamming_init();
+    byte flags = 0;
+    size_t done = decode_kernel(in, out, count, &flags);
+    decode_scalar(in + 2 * done, out + done, count - done, &flags);
+    return flags;
+}
+
+/* Complain about every double error in count byte2s from in
+ * (or as many as limit lets through). Double errors should be
+ * rare, so we only bother to look for them one symbol at a
+ * time once hamming_decode_block has told us there's at least
+ * one.
+ */
+static void whine_double_errors(const byte *in, size_t count,
+        whine_limit *limit) {
+    for (size_t i = 0; i < count; i++) {
+        byte flags = decode_table[in[2 * i] | in[2 * i + 1] << 8] >> 8;
+        if (flags & HAMMING_DOUBLE_LO) {
+            whine(limit, "hamming_decode: double error in byte %02x\n",
+                    in[2 * i]);
         }
-        else if (check_lo) {
-            /* any nonzero syndrome with a zero high bit can
-             * only result from an even, nonzero number of
-             * errors, which we assume is 2 */
-            WHINE("hamming_decode: double error in byte %02x\n",
-                    next_byte2 & 0xFF);
+        if (flags & HAMMING_DOUBLE_HI) {
+            whine(limit, "hamming_decode: double error in byte %02x\n",
+                    in[2 * i + 1]);
         }
-        /* the next bit is all of the same logic but for the
-         * upper 8 bits of next_byte2 */
-        if (check_hi & 8) {
-            check_hi = (check_hi - 1) & 7;
-            next_byte2 ^= 1 << (check_hi + 8);
+    }
+}
+
+/* Count the symbols in count byte2s from in that had an error
+ * we corrected, and that had two, for --stats. Like the above,
+ * this is only worth doing once we know there's something to
+ * find.
+ */
+static void count_errors(const byte *in, size_t count,
+        word *corrected, word *uncorrectable) {
+    for (size_t i = 0; i < count; i++) {
+        byte flags = decode_table[in[2 * i] | in[2 * i + 1] << 8] >> 8;
+        *corrected += !!(flags & HAMMING_CORRECTED_LO)
+            + !!(flags & HAMMING_CORRECTED_HI);
+        *uncorrectable += !!(flags & HAMMING_DOUBLE_LO)
+            + !!(flags & HAMMING_DOUBLE_HI);
+    }
+}
+
+/* Follow up on the flags hamming_decode_block returned for
+ * count byte2s from in.
+ */
+static void look_closer(const byte *in, size_t count, byte flags,
+        stage_stats *stats, whine_limit *limit) {
+    if (!flags) return;
+    if (stats) {
+        count_errors(in, count, &stats->corrected, &stats->uncorrectable);
+    }
+    if (flags & HAMMING_DOUBLE) whine_double_errors(in, count, limit);
+}
+
+/* Since every symbol is coded by itself, there's nothing to
+ * stop us from splitting the stream into chunks and coding them
+ * on several threads at once, as long as the results go out in
+ * the right order. Each chunk is this much input; that's big
+ * enough that handing it to a worker costs next to nothing
+ * compared to coding it, and small enough that a few per worker
+ * in flight don't add up to much memory. (It's even, so that
+ * when decoding, no symbol is split between two chunks.) */
+#define HAMMING_CHUNK ((size_t)1 << 20)
+
+/* Chunks come from a slab (see slab.h), with room after them
+ * for the output and, if the input isn't in memory, a copy of
+ * the input. */
+typedef struct hamming_chunk {
+    pool_task task;
+    /* the slab to put it back in */
+    slab *from;
+    const byte *input;
+    byte *output;
+    /* of the input */
+    size_t length;
+    /* from hamming_decode_block */
+    byte flags;
+    /* from count_errors, with --stats (if count_stats is set) */
+    byte count_stats;
+    word corrected, uncorrectable;
+    /* the odd byte out at the end of the last chunk (if there
+     * is one), padded with a zero */
+    byte padded[2];
+} hamming_chunk;
+
+static void run_encode_chunk(pool_task *t, size_t worker) {
+    hamming_chunk *c = (hamming_chunk *)t;
+    hamming_encode_block(c->input, c->output, c->length);
+}
+
+static void run_decode_chunk(pool_task *t, size_t worker) {
+    hamming_chunk *c = (hamming_chunk *)t;
+    size_t count = c->length / 2;
+    c->flags = hamming_decode_block(c->input, c->output, count);
+    if (c->length % 2) {
+        c->padded[0] = c->input[c->length - 1];
+        c->padded[1] = 0;
+        c->flags |= hamming_decode_block(c->padded, c->output + count, 1);
+    }
+    c->corrected = c->uncorrectable = 0;
+    if (c->flags && c->count_stats) {
+        count_errors(c->input, count, &c->corrected, &c->uncorrectable);
+        if (c->length % 2) {
+            count_errors(c->padded, 1, &c->corrected, &c->uncorrectable);
         }
-        else if (check_hi) {
-            WHINE("hamming_decode: double error in byte %02x\n",
-                    next_byte2 >> 8);
+    }
+}
+
+/* What next_chunk needs to know. */
+typedef struct chunk_source {
+    bytes_in *in;
+    byte decoding, count_stats;
+    slab chunks;
+    /* how much room to leave for each chunk's output */
+    size_t output_size;
+} chunk_source;
+
+/* Take the next chunk of input, if there's any left. */
+static pool_task *next_chunk(void *source) {
+    chunk_source *src = source;
+    hamming_chunk *c = slab_get(&src->chunks);
+    c->from = &src->chunks;
+    c->count_stats = src->count_stats;
+    c->output = (byte *)(c + 1);
+    c->length = take_bytes_into(src->in, HAMMING_CHUNK, &c->input,
+            c->output + src->output_size);
+    if (!c->length) {
+        slab_put(c->from, c);
+        return NULL;
+    }
+    c->task.run = src->decoding ? run_decode_chunk : run_encode_chunk;
+    return &c->task;
+}
+
+static void finish_encode_chunk(pool_task *t, void *out) {
+    hamming_chunk *c = (hamming_chunk *)t;
+    write_bytes(out, c->output, 2 * c->length);
+    slab_put(c->from, c);
+}
+
+/* Where decoded chunks go. */
+typedef struct decode_sink {
+    bytes_out *out;
+    whine_limit limit;
+} decode_sink;
+
+/* (We complain about double errors here rather than in the
+ * workers so that the complaints come out in order.) */
+static void finish_decode_chunk(pool_task *t, void *sink) {
+    hamming_chunk *c = (hamming_chunk *)t;
+    decode_sink *dst = sink;
+    size_t count = c->length / 2;
+    if (c->flags & HAMMING_DOUBLE) {
+        whine_double_errors(c->input, count, &dst->limit);
+        if (c->length % 2) whine_double_errors(c->padded, 1, &dst->limit);
+    }
+    if (dst->out->stats) {
+        dst->out->stats->corrected += c->corrected;
+        dst->out->stats->uncorrectable += c->uncorrectable;
+    }
+    write_bytes(dst->out, c->output, (c->length + 1) / 2);
+    slab_put(c->from, c);
+}
+
+/* Run a whole stream through a pool of o->jobs workers, a
+ * chunk at a time, with finish writing each chunk out to sink.
+ * A couple of chunks per worker are allowed in flight, so
+ * memory use stays bounded however long the stream is, and
+ * the chunks are recycled through a slab, so the same few
+ * chunks' worth of memory gets used over and over.
+ */
+static void hamming_parallel(bytes_in *in, byte decoding, const options *o,
+        void (*finish)(pool_task *t, void *sink), void *sink) {
+    chunk_source src = {in, decoding, o->stats};
+    src.output_size = decoding ? (HAMMING_CHUNK + 1) / 2 : 2 * HAMMING_CHUNK;
+    slab_init(&src.chunks, sizeof(hamming_chunk) + src.output_size
+            + HAMMING_CHUNK + BYTES_SLACK, in->stats);
+    pool p;
+    pool_init(&p, o->jobs);
+    pool_ordered(&p, 2 * o->jobs + 1, next_chunk, &src, finish, sink);
+    pool_free(&p);
+    slab_free(&src.chunks, NULL);
+}
+
+/* Write the header (see hamming.h) for the given mode, unless
+ * it's plain Hamming(8, 4), which goes without.
+ */
+static void write_header(bytes_out *out, byte mode) {
+    if (mode == HAMMING_NARROW) return;
+    for (int i = 0; i < HAMMING_HEADER_COPIES; i++) {
+        write_bytes(out, HAMMING_MAGIC, 2);
+        write_byte(out, mode);
+        write_byte(out, ~mode);
+    }
+}
+
+/* Whether the four bytes at h are a header (see hamming.h),
+ * for some mode or other, and whether it's a mode we know. */
+static int is_header(const byte *h) {
+    return !memcmp(h, HAMMING_MAGIC, 2) && (byte)~h[2] == h[3];
+}
+
+static int known_header(const byte *h) {
+    byte mode = h[2] & ~HAMMING_SYNCS;
+    return is_header(h) && (mode == HAMMING_NARROW || mode == HAMMING_WIDE);
+}
+
+/* Whether the two bytes at h are HAMMING_MAGIC, give or take a
+ * bit. A stream without a header can't start out like that,
+ * since neither byte of the magic is a Hamming(8, 4) code byte,
+ * and between them they're three bits away from any. */
+static int near_magic(const byte *h) {
+    unsigned diff = (h[0] ^ HAMMING_MAGIC[0]) << 8 | (h[1] ^ HAMMING_MAGIC[1]);
+    return !(diff & (diff - 1));
+}
+
+/* Read the header, if there is one, and return the mode
+ * (flags and all). If there isn't, we leave the input alone
+ * and go with Hamming(8, 4). If there's one we can't read, we
+ * give up (see stage_fail, which error goes to) and return 0.
+ * The vote copes with any number of errors, so long as no two
+ * are in the same bit of different copies. When two are, the
+ * third copy is still whole, so we go by any copy that's a
+ * header by itself (two errors can't make one out of another
+ * mode's, which would take four). That gets through any two
+ * errors in the header. Beyond that, if anything still looks
+ * like HAMMING_MAGIC, this is a header we can't read, not the
+ * start of a stream without one, and going on as Hamming(8, 4)
+ * would only turn a wide stream into garbage.
+ */
+static byte read_header(bytes_in *in, stage_error *error) {
+    const byte *data;
+    if (peek_bytes(in, HAMMING_HEADER, &data) < HAMMING_HEADER) {
+        return HAMMING_NARROW;
+    }
+    /* each bit of the vote is set if it's set in at least two
+     * of the three copies */
+    byte vote[4];
+    for (int i = 0; i < 4; i++) {
+        byte a = data[i], b = data[4 + i], c = data[8 + i];
+        vote[i] = (a & b) | (b & c) | (a & c);
+    }
+    const byte *header = known_header(vote) ? vote : NULL;
+    int magic = near_magic(vote);
+    for (int i = 0; i < HAMMING_HEADER_COPIES && !header; i++) {
+        const byte *copy = data + 4 * i;
+        if (known_header(copy)) header = copy;
+        magic |= near_magic(copy);
+    }
+    if (!header) {
+        if (!magic) return HAMMING_NARROW;
+        if (is_header(vote)) {
+            stage_fail(error, 3, "hamming_decode: unknown mode %d; "
+                    "input is probably corrupt\n", vote[2]);
+        }
+        else {
+            stage_fail(error, 3, "hamming_decode: damaged header; "
+                    "input is probably corrupt\n");
         }
-        /* now that we've used the parity information, we
-         * throw it away and write the data bits */
-        write_byte(out, HAMMING_PROJECT(next_byte2));
+        return 0;
+    }
+    consume_bytes(in, HAMMING_HEADER);
+    return header[2];
+}
+
+/* Perform Hamming(8, 4) encoding, reading from byte stream
+ * in and writing to byte stream out, with settings o.
+ * Writes two bytes for each input byte, after the header (if
+ * there is one).
+ * (With o->wide, it's Hamming(72, 64) instead; see
+ * secded.c.)
+ * With more than one job, this is done on a pool of threads.
+ */
+void hamming_encode(bytes_in *in, bytes_out *out, const options *o) {
+    const byte *data;
+    if (!peek_bytes(in, 1, &data)) return;
+    /* (the wide code holds its last word back for the padding,
+     * so there's no flushing that, and main won't have it) */
+    write_header(out, o->wide ? HAMMING_WIDE
+            : HAMMING_NARROW | (o->flush ? HAMMING_SYNCS : 0));
+    if (o->wide) {
+        secded_encode(in, out, o);
+        return;
+    }
+    /* (chunks only go out once they're whole, so with
+     * --flush-ms, it's done here) */
+    if (o->jobs > 1 && !o->flush) {
+        hamming_parallel(in, 0, o, finish_encode_chunk, out);
+        return;
+    }
+    /* This is really simple! We just take as much input as
+     * is buffered (and as will fit in the output buffer once
+     * doubled) and encode it all in one go. */
+    size_t avail;
+    while ((avail = peek_bytes(in, 1, &data))) {
+        if (avail > BYTES_BUFFER_SIZE / 2) avail = BYTES_BUFFER_SIZE / 2;
+        hamming_encode_block(data, reserve_bytes(out, 2 * avail), avail);
+        commit_bytes(out, 2 * avail);
+        consume_bytes(in, avail);
     }
 }
 
+/* Perform Hamming(8, 4) decoding, reading from byte stream
+ * in and writing to byte stream out, with settings o.
+ * Writes one byte for each two input bytes (or, if the header
+ * says so, decodes Hamming(72, 64) instead).
+ * If the header says the stream has HAMMING_SYNCS, we flush
+ * whenever the input stalls, --flush-ms or not (unless that
+ * gave a wait of its own).
+ * With more than one job, this is done on a pool of threads.
+ */
+void hamming_decode(bytes_in *in, bytes_out *out, const options *o) {
+    byte mode = read_header(in, o->error);
+    if (!mode) return;
+    if (mode & HAMMING_SYNCS && !in->flush_to) bytes_in_flush_to(in, out, 0);
+    if ((mode & ~HAMMING_SYNCS) == HAMMING_WIDE) {
+        secded_decode(in, out, o);
+        return;
+    }
+    if (o->jobs > 1 && !in->flush_to) {
+        decode_sink sink = {out, WHINE_LIMIT("hamming_decode", o->error)};
+        hamming_parallel(in, 1, o, finish_decode_chunk, &sink);
+        whine_done(&sink.limit);
+        return;
+    }
+    whine_limit limit = WHINE_LIMIT("hamming_decode", o->error);
+    const byte *data;
+    size_t avail;
+    /* ask for two bytes at a time so that we only come up
+     * short on the very last one */
+    while ((avail = peek_bytes(in, 2, &data)) >= 2) {
+        size_t count = avail / 2;
+        if (count > BYTES_BUFFER_SIZE) count = BYTES_BUFFER_SIZE;
+        byte flags = hamming_decode_block(data,
+                reserve_bytes(out, count), count);
+        look_closer(data, count, flags, out->stats, &limit);
+        commit_bytes(out, count);
+        consume_bytes(in, 2 * count);
+    }
+    /* if there's an odd byte out at the end, decode it as
+     * though it were padded with zeroes */
+    if (avail) {
+        byte padded[2] = {data[0], 0};
+        byte flags = hamming_decode_block(padded,
+                reserve_bytes(out, 1), 1);
+        look_closer(padded, 1, flags, out->stats, &limit);
+        commit_bytes(out, 1);
+        consume_bytes(in, 1);
+    }
+    whine_done(&limit);
+}
@@ -1,5 +1,47 @@
 #include "general.h"
 
-void hamming_encode(int in, int out);
-void hamming_decode(int in, int out);
+struct options;
 
+/* Flags that hamming_decode_block uses to report what it
+ * found: _LO is about the low byte of a symbol and _HI is
+ * about the high byte. */
+#define HAMMING_CORRECTED_LO 0x01
+#define HAMMING_CORRECTED_HI 0x02
+#define HAMMING_DOUBLE_LO    0x04
+#define HAMMING_DOUBLE_HI    0x08
+#define HAMMING_CORRECTED (HAMMING_CORRECTED_LO | HAMMING_CORRECTED_HI)
+#define HAMMING_DOUBLE    (HAMMING_DOUBLE_LO | HAMMING_DOUBLE_HI)
+
+/* hamming_encode's output starts with a header saying which
+ * code the rest is in: HAMMING_HEADER_COPIES copies of the four
+ * bytes HAMMING_MAGIC (two bytes), the mode, and the mode with
+ * its bits flipped. It goes through the same noisy channel as
+ * everything else, but it isn't coded, so hamming_decode reads
+ * it by majority vote, bit by bit, over the copies, or failing
+ * that, from any copy that's whole. If there's no sign of
+ * HAMMING_MAGIC at all, the stream is plain Hamming(8, 4),
+ * which is what hamming_encode still writes by default:
+ * only a stream in another mode (wide, or with syncs) gets a
+ * header, so the default output is just as it always was.
+ * Empty input gets empty output, not even a header. */
+#define HAMMING_MAGIC "Hm"
+#define HAMMING_HEADER_COPIES 3
+#define HAMMING_HEADER (4 * HAMMING_HEADER_COPIES)
+
+/* the modes: Hamming(8, 4), and Hamming(72, 64) (see secded.h) */
+#define HAMMING_NARROW 1
+#define HAMMING_WIDE   2
+/* Flag, or'd into the mode: hamming_encode was flushing its
+ * output whenever its input stalled (with --flush-ms), so
+ * hamming_decode should too, and put out everything it can as
+ * soon as it stops getting more. (It has to be told: holding
+ * on to its output until it has a bufferful is far faster
+ * otherwise, and the code has no room for a marker in the
+ * stream itself.) */
+#define HAMMING_SYNCS  0x80
+
+void hamming_encode_block(const byte *in, byte *out, size_t count);
+byte hamming_decode_block(const byte *in, byte *out, size_t count);
+
+void hamming_encode(bytes_in *in, bytes_out *out, const struct options *o);
+void hamming_decode(bytes_in *in, bytes_out *out, const struct options *o);
@@ -0,0 +1,857 @@
+#include <inttypes.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "byte_io.h"
+#include "bit_io.h"
+#include "options.h"
+#include "stats.h"
+#include "lzw.h"
+#include "lzw_dict.h"
+#include "huffman.h"
+
+/* LZW writes every code number at the full width of the
+ * dictionary, but some code numbers turn up a lot more than
+ * others, which a Huffman code can take advantage of: it
+ * gives each one a code whose length goes by how often it
+ * turned up, so common ones take fewer bits. How often they
+ * turn up changes as the dictionary does, so each chunk of
+ * code numbers (see huffman.h) gets a code of its own, worked
+ * out from what's in it, and sent along with it; if the code
+ * and the coded numbers come out bigger than the numbers
+ * were, the chunk is left as it was. On English text, that's
+ * most chunks (the code numbers are nearly as likely as each
+ * other), and the gain is a few percent at best; on data with
+ * a handful of things in it that repeat a lot, it's more like
+ * a fifth.
+ *
+ * Both ends have to be able to tell where one code number ends
+ * and the next starts in the LZW stream, which takes following
+ * the dictionary's size the way lzw_decode does (though not
+ * what's in it); code_widths does that.
+ *
+ * A chunk's Huffman code is canonical, so all it takes to
+ * send it is each code number's code length. It goes:
+ *
+ * - how many different code numbers there are, less 1, in
+ *   HUFF_MAX_LENGTH bits;
+ * - the code lengths' own code (a little Huffman code over the
+ *   lengths from 1 to HUFF_MAX_LENGTH, since a few of them are
+ *   much more common than the rest): each length's length, in
+ *   HUFF_META_BITS bits, 0 if it isn't used;
+ * - then for each of the code numbers, in increasing order,
+ *   the gap since the last (an Exp-Golomb code: the gap plus
+ *   1 has k + 1 bits, so k zeros and a one, and then the gap's
+ *   low k bits), and its code length, in the lengths' code.
+ *
+ * Codes go into the stream first bit first, so since bit_io
+ * packs bits lowest first, we store them bit-reversed; that
+ * way the next HUFF_MAX_LENGTH bits of the stream, as a
+ * number, index a table (see huff_table) that says which code
+ * number is next, and the one after that if it fits too.
+ */
+
+/* the most bits a code length's own code may take */
+#define HUFF_META_BITS 3
+#define HUFF_META_MAX ((1 << HUFF_META_BITS) - 1)
+
+/* Where we are in a run of LZW code numbers: just enough of
+ * lzw_decode's state (see decode_codes) to know how wide the
+ * next code number is (or how it's phased in, with
+ * LZW_PHASED), and whether a clear starts a stored segment. */
+typedef struct code_widths {
+    word max_ix, max_code, presets;
+    byte bits;
+    /* whether we're at the start of the dictionary, where a
+     * clear (with LZW_STORED) means a stored segment; and
+     * whether the dictionary's full */
+    byte fresh, full, stored, phased;
+} code_widths;
+
+static void widths_clear(code_widths *w) {
+    w->max_ix = LZW_CLEAR + w->presets;
+    w->bits = lzw_code_bits(w->max_ix);
+    w->fresh = 1;
+    w->full = 0;
+}
+
+static void widths_init(code_widths *w, byte max_bits, word presets,
+        byte flags) {
+    w->max_code = ((word)1 << max_bits) - 1;
+    w->presets = presets;
+    w->stored = !!(flags & LZW_STORED);
+    w->phased = !!(flags & LZW_PHASED);
+    widths_clear(w);
+}
+
+/* Read the next code number into *code. Returns how many bits
+ * it took, or 0 (leaving it unread) if there isn't a whole one
+ * left. */
+static inline byte widths_read(const code_widths *w, bits_in *bi,
+        word *code) {
+    if (w->phased) {
+        return read_bits_phased(bi, w->bits,
+                lzw_shorts(w->max_ix, w->bits, 1), code);
+    }
+    *code = peek_bits(bi, w->bits);
+    if (bits_buffered(bi) < w->bits) return 0;
+    consume_bits(bi, w->bits);
+    return w->bits;
+}
+
+/* Write code number code as it was in the LZW stream. */
+static inline void widths_write(const code_widths *w, bits_out *bo,
+        word code) {
+    if (w->phased) {
+        write_bits_phased(bo, w->bits, lzw_shorts(w->max_ix, w->bits, 1),
+                code);
+    }
+    else write_bits_fast(bo, w->bits, code);
+}
+
+/* Note that code number code went by, leaving w->bits the
+ * width of the next one. Returns 1 if it was the clear that
+ * starts a stored segment. */
+static inline int widths_next(code_widths *w, word code) {
+    if (code == LZW_CLEAR) {
+        if (w->fresh && w->stored) return 1;
+        widths_clear(w);
+    }
+    else if (w->fresh) {
+        w->fresh = 0;
+        w->max_ix = LZW_FIRST + w->presets;
+        w->bits = lzw_code_bits(w->max_ix);
+    }
+    else if (!w->full) {
+        if (w->max_ix < w->max_code) {
+            if (++w->max_ix >> w->bits) w->bits++;
+        }
+        else w->full = 1;
+    }
+    return 0;
+}
+
+/* Counts and lengths are worked out for the code numbers in
+ * sorted order, over the first n of symbols[]. */
+typedef struct huff_code {
+    uint32_t *symbols;
+    size_t n;
+    /* each symbol's count, then its length */
+    uint32_t *counts;
+    byte *lengths;
+    /* room for building the tree: the leaves' and internal
+     * nodes' weights (with the leaves' positions in the low
+     * 32 bits of theirs, while they're being sorted), their
+     * parents, and their depths */
+    uint64_t *weights;
+    uint32_t *parents;
+    byte *depths;
+} huff_code;
+
+static void huff_code_init(huff_code *c, size_t most) {
+    c->symbols = malloc(sizeof(uint32_t) * most);
+    c->counts = malloc(sizeof(uint32_t) * most);
+    c->lengths = malloc(most);
+    c->weights = malloc(sizeof(uint64_t) * 2 * most);
+    c->parents = malloc(sizeof(uint32_t) * 2 * most);
+    c->depths = malloc(2 * most);
+    c->n = 0;
+}
+
+static void huff_code_free(huff_code *c) {
+    free(c->symbols);
+    free(c->counts);
+    free(c->lengths);
+    free(c->weights);
+    free(c->parents);
+    free(c->depths);
+}
+
+/* Sort a[] (n of them) by bits low up to high of each, a
+ * byte at a time from the bottom, into tmp[] (just as big)
+ * and back. (A chunk has tens of thousands of code numbers to
+ * sort, and counts to sort them by, all of them small numbers,
+ * which a radix sort like this does several times as fast as
+ * qsort.) */
+static void sort_keys(uint64_t *a, uint64_t *tmp, size_t n, byte low,
+        byte high) {
+    uint64_t *from = a, *to = tmp;
+    for (byte shift = low; shift < high; shift += 8) {
+        size_t starts[257] = {0};
+        for (size_t i = 0; i < n; i++) starts[(from[i] >> shift & 0xFF) + 1]++;
+        for (int d = 0; d < 256; d++) starts[d + 1] += starts[d];
+        for (size_t i = 0; i < n; i++) {
+            to[starts[from[i] >> shift & 0xFF]++] = from[i];
+        }
+        uint64_t *t = from;
+        from = to;
+        to = t;
+    }
+    if (from != a) memcpy(a, from, sizeof(uint64_t) * n);
+}
+
+/* How many bits x takes. */
+static byte bit_length(word x) {
+    byte bits = 0;
+    while (x >> bits) bits++;
+    return bits;
+}
+
+/* Work out the lengths of a Huffman code for c's counts, none
+ * longer than limit bits (which 2^limit had better be at least
+ * c->n for). The usual way: repeatedly join the two lightest
+ * trees into one. Since the joined trees come out no lighter
+ * than the ones before, they can go in a queue of their own,
+ * so that once the leaves are sorted, the lightest two are
+ * always at the front of one queue or the other. If the tree
+ * comes out too deep, we flatten the counts out (which keeps
+ * them in order, so there's no sorting again) and try again.
+ */
+static void huff_lengths(huff_code *c, byte limit) {
+    size_t n = c->n;
+    if (n == 1) {
+        c->lengths[0] = 1;
+        return;
+    }
+    uint64_t *w = c->weights;
+    uint32_t most = 0;
+    for (size_t i = 0; i < n; i++) {
+        w[i] = (uint64_t)c->counts[i] << 32 | i;
+        if (c->counts[i] > most) most = c->counts[i];
+    }
+    sort_keys(w, w + n, n, 32, 32 + bit_length(most));
+    for (;;) {
+        size_t leaf = 0, node = n;
+        for (size_t next = n; next < 2 * n - 1; next++) {
+            uint64_t sum = 0;
+            for (int k = 0; k < 2; k++) {
+                size_t take;
+                if (node < next && (leaf == n || w[node] < w[leaf] >> 32)) {
+                    take = node++;
+                    sum += w[take];
+                }
+                else {
+                    take = leaf++;
+                    sum += w[take] >> 32;
+                }
+                c->parents[take] = next;
+            }
+            w[next] = sum;
+        }
+        byte deepest = 0;
+        c->depths[2 * n - 2] = 0;
+        for (size_t i = 2 * n - 2; i-- > 0;) {
+            c->depths[i] = c->depths[c->parents[i]] + 1;
+            if (c->depths[i] > deepest) deepest = c->depths[i];
+        }
+        if (deepest <= limit) break;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t count = w[i] >> 32;
+            w[i] = ((count + 1) >> 1) << 32 | (w[i] & 0xFFFFFFFF);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        c->lengths[w[i] & 0xFFFFFFFF] = c->depths[i];
+    }
+}
+
+/* The canonical codes for lengths[] (count of them, for
+ * symbols in increasing order): shorter codes come first, and
+ * among codes of the same length, in order of symbol. Each
+ * goes in codes[] bit-reversed, ready for write_bits. */
+static void canonical_codes(const byte *lengths, size_t count,
+        uint32_t *codes) {
+    /* how many codes of each length, and from those, the
+     * first code of each length */
+    uint32_t lengths_of[HUFF_MAX_LENGTH + 1] = {0}, next[HUFF_MAX_LENGTH + 1];
+    for (size_t i = 0; i < count; i++) lengths_of[lengths[i]]++;
+    uint32_t code = 0;
+    lengths_of[0] = 0;
+    for (int l = 1; l <= HUFF_MAX_LENGTH; l++) {
+        code = (code + lengths_of[l - 1]) << 1;
+        next[l] = code;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!lengths[i]) continue;
+        uint32_t code = next[lengths[i]]++, reversed = 0;
+        for (byte b = 0; b < lengths[i]; b++, code >>= 1) {
+            reversed = reversed << 1 | (code & 1);
+        }
+        codes[i] = reversed;
+    }
+}
+
+/* For decoding: entry x says what the bits x (the next
+ * bits of the stream, lowest first) start with. The low 5
+ * bits are the first code's length, the next 5 the first two
+ * codes' lengths together, and the next 2 how many codes the
+ * entry has: 1, or 2 if the next code fits in what's left
+ * of the bits too. The code numbers themselves are in the top
+ * 48 bits, 24 apiece. */
+typedef uint64_t huff_entry;
+#define ENTRY_LENGTH(e) ((e) & 31)
+#define ENTRY_BOTH(e) ((e) >> 5 & 31)
+#define ENTRY_COUNT(e) ((e) >> 10 & 3)
+#define ENTRY_FIRST(e) ((e) >> 16 & 0xFFFFFF)
+#define ENTRY_SECOND(e) ((e) >> 40)
+
+typedef struct huff_table {
+    huff_entry *entries;
+    byte bits;
+} huff_table;
+
+/* Fill in t (of 2^bits entries) for the code with lengths[]
+ * (count of them) for symbols[]. Every code must fit in bits.
+ */
+static void huff_table_build(huff_table *t, const uint32_t *symbols,
+        const byte *lengths, size_t count, uint32_t *codes) {
+    size_t size = (size_t)1 << t->bits;
+    memset(t->entries, 0, sizeof(huff_entry) * size);
+    canonical_codes(lengths, count, codes);
+    for (size_t i = 0; i < count; i++) {
+        byte l = lengths[i];
+        if (!l) continue;
+        huff_entry e = l | l << 5 | 1 << 10 | (huff_entry)symbols[i] << 16;
+        for (size_t x = codes[i]; x < size; x += (size_t)1 << l) {
+            t->entries[x] = e;
+        }
+    }
+    /* Then pair each entry up with whatever comes after its
+     * first code, if that fits in the rest of the bits. (The
+     * entry for the rest has the rest's bits at the bottom and
+     * zeros above, but if its first code fits in the rest,
+     * that's all it looked at.) */
+    for (size_t x = 0; x < size; x++) {
+        huff_entry e = t->entries[x];
+        byte l = ENTRY_LENGTH(e);
+        if (!l) continue;
+        huff_entry next = t->entries[x >> l];
+        byte both = l + ENTRY_LENGTH(next);
+        if (ENTRY_LENGTH(next) && both <= t->bits) {
+            t->entries[x] = l | both << 5 | 2 << 10
+                | (huff_entry)ENTRY_FIRST(e) << 16
+                | (huff_entry)ENTRY_FIRST(next) << 40;
+        }
+    }
+}
+
+/* What huff_encode (or huff_decode) does about input it can't
+ * make sense of: who to say it is, where to report it (see
+ * stage_fail), and where to go back to once it's given up.
+ * The input can stop making sense anywhere, right down in the
+ * middle of reading a code, and nothing in between has
+ * anything to clean up, so rather than check for it at every
+ * level on the way back up, we jump straight back to the top,
+ * which frees what it allocated and returns. */
+typedef struct huff_job {
+    const char *who;
+    stage_error *error;
+    jmp_buf bail;
+} huff_job;
+
+static void corrupt(huff_job *j) {
+    stage_fail(j->error, 3, "%s: input is probably corrupt\n", j->who);
+    longjmp(j->bail, 1);
+}
+
+/* Exp-Golomb codes, for the gaps between code numbers. */
+static void write_gap(bits_out *bo, word gap) {
+    word x = gap + 1;
+    byte k = 0;
+    while (x >> (k + 1)) k++;
+    write_bits(bo, k + 1, (word)1 << k);
+    if (k) write_bits(bo, k, x & BITS_MASK(k));
+}
+
+/* Read count bits, which had better be there. */
+static word take_bits(huff_job *j, bits_in *bi, byte count) {
+    word bits = peek_bits(bi, count);
+    if (bits_buffered(bi) < count) corrupt(j);
+    consume_bits(bi, count);
+    return bits;
+}
+
+static word read_gap(huff_job *j, bits_in *bi) {
+    word zeros = peek_bits(bi, 32);
+    if (!zeros) corrupt(j);
+    byte k = __builtin_ctzll(zeros);
+    take_bits(j, bi, k + 1);
+    return ((word)1 << k | (k ? take_bits(j, bi, k) : 0)) - 1;
+}
+
+static void write_varint(bytes_out *out, word x) {
+    for (; x >= 0x80; x >>= 7) write_byte(out, (x & 0x7F) | 0x80);
+    write_byte(out, x);
+}
+
+static int read_varint(bytes_in *in, word *x) {
+    *x = 0;
+    byte b, shift = 0;
+    do {
+        if (!read_byte(in, &b) || shift > 28) return 0;
+        *x |= (word)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return 1;
+}
+
+/* How many preset entries a stream with this header has (see
+ * lzw_decode, whose checks these are); the dictionary has to
+ * be given (as dict, from --dict), just as for lzw_decode. */
+static word read_lzw_header(huff_job *j, bytes_in *in, bytes_out *out,
+        const char *dict, byte *max_bits, byte *flags) {
+    byte header[6];
+    if (read_bytes(in, header, 2) < 2) corrupt(j);
+    *max_bits = header[0];
+    *flags = header[1];
+    if (*max_bits < LZW_MIN_BITS || *max_bits > LZW_MAX_BITS
+            || (*flags & ~(LZW_BLOCKS | LZW_PRESET | LZW_RECORDS | LZW_STORED
+                    | LZW_CHECKED | LZW_SYNCS | LZW_PHASED))
+            || (*flags & LZW_BLOCKS && *flags & LZW_RECORDS)) {
+        stage_fail(j->error, 3, "%s: bad LZW header\n", j->who);
+        longjmp(j->bail, 1);
+    }
+    /* (a chunk would have to end at each sync point and go
+     * straight out, and huff_decode would have to be sure not
+     * to read past it, which they don't) */
+    if (*flags & LZW_SYNCS) {
+        stage_fail(j->error, 2, "%s: input has sync points (from "
+                "--flush-ms), which this stage can't keep\n", j->who);
+        longjmp(j->bail, 1);
+    }
+    word presets = 0;
+    if (*flags & LZW_PRESET) {
+        if (read_bytes(in, header + 2, 4) < 4) corrupt(j);
+        uint32_t id = lzw_get32(header + 2);
+        if (!dict) {
+            stage_fail(j->error, 3, "%s: input was compressed with "
+                    "dictionary %08" PRIx32 "; pass it with --dict\n",
+                    j->who, id);
+            longjmp(j->bail, 1);
+        }
+        lzw_dict preset;
+        if (!lzw_dict_open(&preset, dict, j->error)) longjmp(j->bail, 1);
+        presets = preset.count;
+        lzw_dict_close(&preset);
+        if (preset.id != id) {
+            stage_fail(j->error, 3, "%s: input was compressed with "
+                    "dictionary %08" PRIx32 ", but %s is %08" PRIx32 "\n",
+                    j->who, id, dict, preset.id);
+            longjmp(j->bail, 1);
+        }
+    }
+    write_bytes(out, header, *flags & LZW_PRESET ? 6 : 2);
+    return presets;
+}
+
+/* Copy a stored segment's length and data from in to out. */
+static void copy_stored(huff_job *j, bytes_in *in, bytes_out *out) {
+    byte header[4];
+    if (read_bytes(in, header, 4) < 4) corrupt(j);
+    write_bytes(out, header, 4);
+    size_t length = lzw_get32(header);
+    while (length) {
+        const byte *data;
+        size_t avail = peek_bytes(in, length, &data);
+        if (!avail) corrupt(j);
+        if (avail > length) avail = length;
+        write_bytes(out, data, avail);
+        consume_bytes(in, avail);
+        length -= avail;
+    }
+}
+
+/* Everything huff_encode needs for a chunk. */
+typedef struct squeezer {
+    huff_job *job;
+    code_widths start;
+    word *codes;
+    /* for every code number there could be, how often it's
+     * turned up in this chunk, and then its code */
+    uint32_t *counts;
+    uint32_t *codes_for;
+    huff_code code, meta;
+    uint32_t meta_codes[HUFF_MAX_LENGTH + 1];
+    /* if in isn't in memory, where frames are copied to */
+    byte *spare;
+    size_t spare_size;
+} squeezer;
+
+/* Write out count code numbers (s->codes), which started in
+ * state w and took plain_bits bits in the LZW stream, as a
+ * chunk, with the given trailing bits if last is set. */
+static void squeeze_chunk(squeezer *s, bytes_out *out, code_widths w,
+        size_t count, word plain_bits, byte last, byte trailing,
+        word trailing_bits) {
+    huff_code *c = &s->code;
+    c->n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!s->counts[s->codes[i]]++) {
+            if (c->n < ((size_t)1 << HUFF_MAX_LENGTH)) {
+                c->symbols[c->n] = s->codes[i];
+            }
+            c->n++;
+        }
+    }
+    /* What would coding it take? */
+    byte coded = 0;
+    word table_bits = 0, coded_bits = 0;
+    huff_code *m = &s->meta;
+    if (c->n && c->n <= ((size_t)1 << HUFF_MAX_LENGTH)) {
+        for (size_t i = 0; i < c->n; i++) c->weights[i] = c->symbols[i];
+        sort_keys(c->weights, c->weights + c->n, c->n, 0,
+                bit_length(w.max_code));
+        for (size_t i = 0; i < c->n; i++) c->symbols[i] = c->weights[i];
+        for (size_t i = 0; i < c->n; i++) {
+            c->counts[i] = s->counts[c->symbols[i]];
+        }
+        huff_lengths(c, HUFF_MAX_LENGTH);
+        m->n = HUFF_MAX_LENGTH;
+        for (int l = 0; l < HUFF_MAX_LENGTH; l++) m->counts[l] = 0;
+        for (size_t i = 0; i < c->n; i++) {
+            m->counts[c->lengths[i] - 1]++;
+            coded_bits += (word)c->counts[i] * c->lengths[i];
+        }
+        /* (unused lengths get no code; the rest need one
+         * each, which huff_lengths only does for counts of at
+         * least 1, so they're squeezed out and put back) */
+        size_t used = 0;
+        for (int l = 0; l < HUFF_MAX_LENGTH; l++) {
+            if (m->counts[l]) {
+                m->counts[used] = m->counts[l];
+                m->symbols[used++] = l;
+            }
+        }
+        m->n = used;
+        huff_lengths(m, HUFF_META_MAX);
+        byte meta_lengths[HUFF_MAX_LENGTH] = {0};
+        for (size_t i = 0; i < used; i++) {
+            meta_lengths[m->symbols[i]] = m->lengths[i];
+        }
+        memcpy(m->lengths, meta_lengths, HUFF_MAX_LENGTH);
+        table_bits = HUFF_MAX_LENGTH + HUFF_MAX_LENGTH * HUFF_META_BITS;
+        word prev = 0;
+        for (size_t i = 0; i < c->n; i++) {
+            word gap = c->symbols[i] - prev;
+            byte k = 0;
+            while ((gap + 1) >> (k + 1)) k++;
+            table_bits += 2 * k + 1 + m->lengths[c->lengths[i] - 1];
+            prev = c->symbols[i] + 1;
+        }
+        coded = table_bits + coded_bits < plain_bits;
+    }
+
+    write_byte(out, (coded ? HUFF_CODED : 0) | (last ? HUFF_LAST : 0));
+    write_varint(out, count);
+    bits_out bo = BITS_OUT(out);
+    if (coded) {
+        canonical_codes(m->lengths, HUFF_MAX_LENGTH, s->meta_codes);
+        write_bits(&bo, HUFF_MAX_LENGTH, c->n - 1);
+        for (int l = 0; l < HUFF_MAX_LENGTH; l++) {
+            write_bits(&bo, HUFF_META_BITS, m->lengths[l]);
+        }
+        canonical_codes(c->lengths, c->n, c->counts);
+        word prev = 0;
+        for (size_t i = 0; i < c->n; i++) {
+            byte l = c->lengths[i];
+            write_gap(&bo, c->symbols[i] - prev);
+            write_bits(&bo, m->lengths[l - 1], s->meta_codes[l - 1]);
+            prev = c->symbols[i] + 1;
+            s->codes_for[c->symbols[i]] = c->counts[i] | (uint32_t)l << 24;
+        }
+        for (size_t i = 0; i < count; i++) {
+            uint32_t code = s->codes_for[s->codes[i]];
+            write_bits_fast(&bo, code >> 24, code & 0xFFFFFF);
+        }
+    }
+    else {
+        for (size_t i = 0; i < count; i++) {
+            widths_write(&w, &bo, s->codes[i]);
+            widths_next(&w, s->codes[i]);
+        }
+    }
+    if (last) {
+        write_bits(&bo, 5, trailing);
+        write_bits(&bo, trailing, trailing_bits);
+    }
+    flush_bits(&bo);
+    for (size_t i = 0; i < count; i++) s->counts[s->codes[i]] = 0;
+}
+
+/* Squeeze the run of code numbers in in (which is all of it),
+ * stored segments and all. */
+static void squeeze_codes(squeezer *s, bytes_in *in, bytes_out *out) {
+    bits_in bi = BITS_IN(in);
+    code_widths w = s->start;
+    for (;;) {
+        code_widths start = w;
+        size_t count = 0;
+        word plain_bits = 0;
+        byte segment = 0, last = 0;
+        while (count < HUFF_BLOCK) {
+            word code;
+            byte width = widths_read(&w, &bi, &code);
+            if (!width) {
+                last = 1;
+                break;
+            }
+            plain_bits += width;
+            s->codes[count++] = code;
+            if (widths_next(&w, code)) {
+                segment = 1;
+                break;
+            }
+        }
+        byte trailing = 0;
+        word trailing_bits = 0;
+        if (last) {
+            trailing = bits_buffered(&bi);
+            if (trailing) trailing_bits = peek_bits(&bi, trailing);
+            consume_bits(&bi, trailing);
+        }
+        squeeze_chunk(s, out, start, count, plain_bits, last, trailing,
+                trailing_bits);
+        if (last) break;
+        if (segment) {
+            /* the padding before a stored segment had better be
+             * zeros, since that's what huff_decode will put back */
+            byte pad = -bi.pos & 7;
+            if (pad && peek_bits(&bi, pad)) corrupt(s->job);
+            align_bits(&bi);
+            copy_stored(s->job, in, out);
+            bi = BITS_IN(in);
+        }
+    }
+    align_bits(&bi);
+}
+
+/* Squeeze the LZW stream in (after its header), frame by
+ * frame if it has them, as flags says. */
+static void squeeze_stream(squeezer *s, bytes_in *in, bytes_out *out,
+        byte flags) {
+    if (!(flags & (LZW_BLOCKS | LZW_RECORDS))) {
+        squeeze_codes(s, in, out);
+        return;
+    }
+    size_t size = LZW_FRAME_HEADER
+        + (flags & LZW_CHECKED ? LZW_FRAME_CHECK : 0), got;
+    byte header[LZW_FRAME_HEADER + LZW_FRAME_CHECK];
+    while ((got = read_bytes(in, header, size))) {
+        size_t length = lzw_get32(header + 4);
+        if (got < size || !lzw_frame_ok(lzw_get32(header), length,
+                    flags & LZW_RECORDS)) {
+            corrupt(s->job);
+        }
+        write_bytes(out, header, size);
+        if (!bytes_in_memory(in) && s->spare_size < length) {
+            s->spare_size = length;
+            s->spare = realloc(s->spare, length + BYTES_SLACK);
+        }
+        const byte *data;
+        if (take_bytes_into(in, length, &data, s->spare) < length) {
+            corrupt(s->job);
+        }
+        bytes_in frame;
+        bytes_in_init_mem(&frame, data, length);
+        squeeze_codes(s, &frame, out);
+        bytes_in_free(&frame);
+    }
+}
+
+/* Huffman code the code numbers of LZW stream in (see
+ * huffman.h), writing the result to out, with settings o. */
+void huff_encode(bytes_in *in, bytes_out *out, const options *o) {
+    const byte *data;
+    if (!peek_bytes(in, 1, &data)) return;
+    huff_job job = {"huff_encode", o->error};
+    if (setjmp(job.bail)) return;
+    write_byte(out, HUFF_MAGIC);
+    byte max_bits, flags;
+    word presets = read_lzw_header(&job, in, out, o->dict, &max_bits, &flags);
+
+    /* (allocated rather than on the stack, so that it's all still
+     * there to free if corrupt jumps back here) */
+    squeezer *s = malloc(sizeof(squeezer));
+    s->job = &job;
+    widths_init(&s->start, max_bits, presets, flags);
+    s->codes = malloc(sizeof(word) * HUFF_BLOCK);
+    s->counts = calloc((size_t)1 << max_bits, sizeof(uint32_t));
+    s->codes_for = malloc(sizeof(uint32_t) << max_bits);
+    huff_code_init(&s->code, HUFF_BLOCK);
+    huff_code_init(&s->meta, HUFF_MAX_LENGTH);
+    s->spare = NULL;
+    s->spare_size = 0;
+
+    if (!setjmp(job.bail)) squeeze_stream(s, in, out, flags);
+
+    huff_code_free(&s->code);
+    huff_code_free(&s->meta);
+    free(s->codes);
+    free(s->counts);
+    free(s->codes_for);
+    free(s->spare);
+    free(s);
+}
+
+/* Everything huff_decode needs for a chunk. */
+typedef struct unsqueezer {
+    huff_job *job;
+    code_widths start;
+    huff_code code;
+    huff_table table, meta;
+    uint32_t codes[(size_t)1 << HUFF_MAX_LENGTH];
+    word decoded[HUFF_BLOCK];
+} unsqueezer;
+
+/* Read a chunk's Huffman code into u->table. */
+static void read_code(unsqueezer *u, bits_in *bi) {
+    huff_code *c = &u->code;
+    c->n = take_bits(u->job, bi, HUFF_MAX_LENGTH) + 1;
+    /* (the lengths' code's symbols being the lengths) */
+    byte meta_lengths[HUFF_MAX_LENGTH];
+    uint32_t lengths[HUFF_MAX_LENGTH];
+    for (int l = 0; l < HUFF_MAX_LENGTH; l++) {
+        meta_lengths[l] = take_bits(u->job, bi, HUFF_META_BITS);
+        lengths[l] = l + 1;
+    }
+    huff_table_build(&u->meta, lengths, meta_lengths, HUFF_MAX_LENGTH,
+            u->codes);
+    word symbol = 0;
+    for (size_t i = 0; i < c->n; i++) {
+        word gap = read_gap(u->job, bi);
+        huff_entry e = u->meta.entries[peek_bits(bi, HUFF_META_MAX)];
+        symbol += gap;
+        if (!ENTRY_LENGTH(e) || symbol > u->start.max_code) corrupt(u->job);
+        take_bits(u->job, bi, ENTRY_LENGTH(e));
+        c->symbols[i] = symbol++;
+        c->lengths[i] = ENTRY_FIRST(e);
+    }
+    huff_table_build(&u->table, c->symbols, c->lengths, c->n, u->codes);
+}
+
+/* Put back the run of code numbers huff_encode squeezed, from
+ * in to out: chunk after chunk, with any stored segments in
+ * between, until the last one. */
+static void unsqueeze_codes(unsqueezer *u, bytes_in *in, bytes_out *out) {
+    bits_out bo = BITS_OUT(out);
+    code_widths w = u->start;
+    byte kind;
+    do {
+        word count;
+        if (!read_byte(in, &kind) || !read_varint(in, &count)
+                || count > HUFF_BLOCK) {
+            corrupt(u->job);
+        }
+        bits_in bi = BITS_IN(in);
+        byte segment = 0;
+        size_t i = 0;
+        if (kind & HUFF_CODED) {
+            /* Decoding the whole chunk first, and only then
+             * writing it out, keeps each lookup waiting on just
+             * the one before it, rather than on the writing too. */
+            read_code(u, &bi);
+            const huff_entry *entries = u->table.entries;
+            word *decoded = u->decoded;
+            size_t n = 0;
+            while (n < count) {
+                huff_entry e = entries[peek_bits(&bi, HUFF_MAX_LENGTH)];
+                /* (a code that isn't in the table, or that runs
+                 * past the end of the input) */
+                if (!ENTRY_LENGTH(e) || bits_buffered(&bi) < ENTRY_LENGTH(e)) {
+                    corrupt(u->job);
+                }
+                decoded[n++] = ENTRY_FIRST(e);
+                if (ENTRY_COUNT(e) == 2 && n < count
+                        && bits_buffered(&bi) >= ENTRY_BOTH(e)) {
+                    decoded[n++] = ENTRY_SECOND(e);
+                    consume_bits(&bi, ENTRY_BOTH(e));
+                }
+                else consume_bits(&bi, ENTRY_LENGTH(e));
+            }
+            while (i < count) {
+                word code = decoded[i++];
+                widths_write(&w, &bo, code);
+                if (widths_next(&w, code)) {
+                    segment = 1;
+                    break;
+                }
+            }
+        }
+        else {
+            while (i < count) {
+                word code;
+                if (!widths_read(&w, &bi, &code)) corrupt(u->job);
+                widths_write(&w, &bo, code);
+                i++;
+                if (widths_next(&w, code)) {
+                    segment = 1;
+                    break;
+                }
+            }
+        }
+        /* (a stored segment's clear always ends a chunk) */
+        if (i < count) corrupt(u->job);
+        if (kind & HUFF_LAST) {
+            byte trailing = take_bits(u->job, &bi, 5);
+            if (trailing) {
+                write_bits(&bo, trailing, take_bits(u->job, &bi, trailing));
+            }
+        }
+        align_bits(&bi);
+        if (segment) {
+            flush_bits(&bo);
+            copy_stored(u->job, in, out);
+        }
+    } while (!(kind & HUFF_LAST));
+    flush_bits(&bo);
+}
+
+/* Put back the LZW stream after its header, frame by frame
+ * if it has them, as flags says. */
+static void unsqueeze_stream(unsqueezer *u, bytes_in *in, bytes_out *out,
+        byte flags) {
+    if (!(flags & (LZW_BLOCKS | LZW_RECORDS))) {
+        unsqueeze_codes(u, in, out);
+        return;
+    }
+    size_t size = LZW_FRAME_HEADER
+        + (flags & LZW_CHECKED ? LZW_FRAME_CHECK : 0), got;
+    byte header[LZW_FRAME_HEADER + LZW_FRAME_CHECK];
+    while ((got = read_bytes(in, header, size))) {
+        if (got < size) corrupt(u->job);
+        write_bytes(out, header, size);
+        unsqueeze_codes(u, in, out);
+    }
+}
+
+/* Undo huff_encode (see huffman.h), reading from in and
+ * writing the LZW stream to out, with settings o. */
+void huff_decode(bytes_in *in, bytes_out *out, const options *o) {
+    byte magic;
+    if (!read_byte(in, &magic)) return;
+    if (magic != HUFF_MAGIC) {
+        stage_fail(o->error, 3, "huff_decode: input isn't from huff_encode\n");
+        return;
+    }
+    huff_job job = {"huff_decode", o->error};
+    if (setjmp(job.bail)) return;
+    byte max_bits, flags;
+    word presets = read_lzw_header(&job, in, out, o->dict, &max_bits, &flags);
+
+    unsqueezer *u = malloc(sizeof(unsqueezer));
+    u->job = &job;
+    widths_init(&u->start, max_bits, presets, flags);
+    huff_code_init(&u->code, (size_t)1 << HUFF_MAX_LENGTH);
+    u->table = (huff_table){
+        malloc(sizeof(huff_entry) << HUFF_MAX_LENGTH), HUFF_MAX_LENGTH};
+    u->meta = (huff_table){
+        malloc(sizeof(huff_entry) << HUFF_META_MAX), HUFF_META_MAX};
+
+    if (!setjmp(job.bail)) unsqueeze_stream(u, in, out, flags);
+
+    huff_code_free(&u->code);
+    free(u->table.entries);
+    free(u->meta.entries);
+    free(u);
+}
@@ -0,0 +1,46 @@
+#include "general.h"
+
+struct options;
+
+/* A second pass over lzw_encode's output, Huffman coding the
+ * code numbers rather than writing each one at the full width
+ * of the dictionary. Include byte_io.h first.
+ *
+ * huff_encode's output starts with HUFF_MAGIC (which, being
+ * more than LZW_MAX_BITS, can't be the start of an LZW
+ * stream), then the LZW stream's header as it is. The rest
+ * follows the shape of the LZW stream: frame headers, and
+ * stored segments' lengths and data, are copied as they are,
+ * but each run of code numbers (the whole stream's, or a
+ * frame's) is cut into chunks of up to HUFF_BLOCK code
+ * numbers, ending early at the LZW_CLEAR that starts a stored
+ * segment, which comes right after that chunk. A chunk is a
+ * byte of the flags below, the number of code numbers in it
+ * (7 bits a byte, low first, with the top bit set on every
+ * byte but the last), and then, bit-packed as in bit_io.h:
+ *
+ * - with HUFF_CODED, a canonical Huffman code for the chunk
+ *   (see huffman.c) and the code numbers in it; without, the
+ *   code numbers just as they were in the LZW stream;
+ * - with HUFF_LAST, meaning the run of code numbers ends with
+ *   this chunk, the number of bits left over at the end of the
+ *   run (its padding, that is), in 5 bits, and then those bits;
+ *
+ * and then padding out to a whole byte. So huff_decode puts
+ * back exactly the LZW stream that huff_encode was given, and
+ * anything else about it (the checksums of LZW_CHECKED, say)
+ * is still right. Empty input gets empty output.
+ */
+#define HUFF_MAGIC 0x48
+#define HUFF_CODED 1
+#define HUFF_LAST 2
+
+/* the most code numbers in a chunk, and so in a Huffman code;
+ * the code's lengths are limited to HUFF_MAX_LENGTH bits,
+ * which means a chunk with more than 2^HUFF_MAX_LENGTH
+ * different code numbers is left as it is */
+#define HUFF_BLOCK ((size_t)1 << 17)
+#define HUFF_MAX_LENGTH 16
+
+void huff_encode(bytes_in *in, bytes_out *out, const struct options *o);
+void huff_decode(bytes_in *in, bytes_out *out, const struct options *o);
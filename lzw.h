@@ -0,0 +1,137 @@
+#include "general.h"
+
+/* Things that lzw_encode and lzw_decode need to agree on.
+ *
+ * An LZW stream starts with a two-byte header: the largest
+ * number of bits a code number may take up, and a byte of
+ * flags (below), plus whatever the flags say follows. After
+ * that come the bit-packed code numbers.
+ */
+
+/* Flag: rather than one long run of code numbers, the stream
+ * is split into blocks, each compressed by itself with a fresh
+ * dictionary, so that they can be compressed and decompressed
+ * in parallel. Each block is a frame: a LZW_FRAME_HEADER-byte
+ * header holding its uncompressed and compressed lengths, 4
+ * bytes apiece, little-endian; then that many bytes of code
+ * numbers, padded out to a whole byte. */
+#define LZW_BLOCKS 1
+#define LZW_FRAME_HEADER 8
+
+/* Flag: the dictionary (every block's, with LZW_BLOCKS)
+ * starts out with a preset dictionary's entries in it, from
+ * LZW_FIRST up, and starts over from them after a clear. The
+ * 4 bytes after the flags hold the dictionary's ID,
+ * little-endian (see lzw_dict.h). */
+#define LZW_PRESET 2
+
+/* Flag: the input was a series of records, each a 4-byte
+ * little-endian length and then that many bytes, and each
+ * record was compressed by itself (from a fresh dictionary),
+ * as a frame just like LZW_BLOCKS's. lzw_decode writes each
+ * one back out as a record, length and all. Records can be
+ * empty, and can't be longer than LZW_MAX_RECORD. */
+#define LZW_RECORDS 4
+#define LZW_MAX_RECORD (LZW_MAX_BLOCK_KIB << 10)
+
+/* Flag: the code numbers may be interrupted by stored
+ * segments, where data that wasn't compressing (random data,
+ * or data that's already compressed) is kept as it is. A
+ * stored segment starts with a LZW_CLEAR where there can't
+ * otherwise be one: as the first code number after a clear
+ * (or of the stream, or of a frame). Then the stream is padded
+ * out to a whole byte, and there's a 4-byte little-endian
+ * length and that many bytes of data. After that, the code
+ * numbers carry on from the next byte, with a fresh
+ * dictionary (so another LZW_CLEAR straight away means another
+ * stored segment). */
+#define LZW_STORED 8
+
+/* Flag: every frame (so this only goes with LZW_BLOCKS or
+ * LZW_RECORDS) has another LZW_FRAME_CHECK bytes of header
+ * after its lengths: the CRC32C (see crc32c.h) of the lengths
+ * and the frame's code numbers, little-endian. That lets
+ * damage be found, and pinned down to a frame, without
+ * decompressing anything (see verify.c). With --check but
+ * neither --block-size nor --records, lzw_encode uses blocks
+ * of LZW_CHECK_BLOCK_KIB KiB. */
+#define LZW_CHECKED 16
+#define LZW_FRAME_CHECK 4
+#define LZW_CHECK_BLOCK_KIB 1024
+
+/* Flag: the code numbers may be interrupted by sync points,
+ * where lzw_encode (with --flush-ms) ran out of input for the
+ * time being and wrote out everything it had, so that
+ * lzw_decode can write out everything too. A sync point is
+ * the code number for the word lzw_encode was partway through
+ * (which might otherwise have gone on to be a longer one),
+ * then the sync code, at the width the code after that would
+ * have, then padding out to a whole byte. The sync code is the
+ * one just past the preset dictionary's entries (LZW_FIRST
+ * without --dict), so our own entries start one further on.
+ * Otherwise, the dictionary carries on as if nothing had
+ * happened. This only goes with a single run of code numbers
+ * (not LZW_BLOCKS or LZW_RECORDS; records are flushed at
+ * their ends anyway). With LZW_STORED too, there can be a sync
+ * point between stored segments, where the dictionary is
+ * fresh, and there's no word to finish: it's just the sync
+ * code (at the width of a first code) and the padding. */
+#define LZW_SYNCS 32
+
+/* Flag: code numbers are phased in (see bit_io.h), rather than
+ * all taking the number of bits the largest there can be does;
+ * see lzw_shorts. That saves up to a bit per code number while
+ * the dictionary fills (more just after it's gone up a bit
+ * than just before it goes up another), and nothing once it's
+ * full, when every code number's range is a power of 2. */
+#define LZW_PHASED 64
+
+/* the range of allowed block sizes, in KiB (at 3 bytes per
+ * byte at worst, the biggest still has room to expand in a
+ * 4-byte length) */
+#define LZW_MIN_BLOCK_KIB 64
+#define LZW_MAX_BLOCK_KIB ((word)1 << 18)
+
+/* Whether a frame's uncompressed and compressed lengths are
+ * anything lzw_encode could have written (which never spends
+ * more than 3 bytes per byte, plus the odd clear). Only
+ * records can be empty. */
+static inline int lzw_frame_ok(word expected, word length, byte records) {
+    return (expected || records) && expected <= LZW_MAX_BLOCK_KIB << 10
+        && length <= 4 * expected + 4;
+}
+
+/* Code numbers below 256 stand for single bytes. LZW_CLEAR
+ * tells the decoder to throw away its dictionary and start
+ * over from scratch, and the code numbers for new dictionary
+ * entries start at LZW_FIRST. */
+#define LZW_CLEAR 256
+#define LZW_FIRST 257
+
+/* the range of allowed maximum code widths */
+#define LZW_MIN_BITS 9
+#define LZW_MAX_BITS 24
+
+/* The number of bits a code number takes up when the largest
+ * one there can be is max_ix. */
+static inline byte lzw_code_bits(word max_ix) {
+    byte bits = 9;
+    while ((word)1 << bits <= max_ix) bits++;
+    return bits;
+}
+
+/* How many phased-in code numbers (see bit_io.h) are short
+ * when the largest one there can be is max_ix, which takes
+ * bit_count bits; without phased, none are. */
+static inline word lzw_shorts(word max_ix, byte bit_count, byte phased) {
+    return phased ? ((word)1 << bit_count) - 1 - max_ix : 0;
+}
+
+/* Frame header lengths go to and from memory with these. */
+static inline void lzw_put32(byte *p, uint32_t x) {
+    for (int i = 0; i < 4; i++, x >>= 8) p[i] = x;
+}
+
+static inline uint32_t lzw_get32(const byte *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
@@ -1,75 +1,282 @@
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "byte_io.h"
 #include "bit_io.h"
+#include "crc32c.h"
+#include "pool.h"
+#include "slab.h"
+#include "options.h"
+#include "stats.h"
+#include "lzw.h"
+#include "lzw_dict.h"
 #include "lzw_decode.h"
 
 /* For decoding, we want to do lookup by index rather than
  * by word, so we'll use an array (the "dictionary" type).
  * The most straightforward thing would be to put string
  * pointers in the array, but that takes up much more space
- * than necessary—any word we insert into the dictionary
- * will already have every prefix in the dictionary, because
- * of how LZW works. So instead, each element of the array
- * contains:
+ * than necessary. Instead, we notice that every word we
+ * decode is written to the output, and so is every word in
+ * the dictionary (the word we add after decoding index i is
+ * the word for the index before i, plus the first byte of
+ * i's word—and those are right next to each other in the
+ * output). So as long as we keep the recent output around,
+ * each entry can just point into it. Each element of the
+ * array contains:
  */
 typedef struct data_word {
-    /* the index of another entry whose word is everything
-     * but the last byte of this entry's word, */
-    int prev;
+    /* where the word last turned up in the output, counting
+     * from the start of the stream, (see output_window for
+     * how positions work) */
+    word offset;
 
-    /* the last byte, */
-    byte last;
+    /* the index of another entry whose word is everything
+     * but the last byte of this entry's word ("prev"), shifted
+     * up 8 bits, plus that last byte (as in a preset
+     * dictionary file; code numbers have at most 24 bits, so
+     * there's room, and packing them together makes an entry
+     * 16 bytes rather than 24, so more of the dictionary fits
+     * in the cache), */
+    uint32_t prev_last;
 
-    /* and the length of the word. */
-    short length;
+    /* and the length of the word (which is at most the number
+     * of entries, since each entry's word is one longer than
+     * its prev's). */
+    uint32_t length;
 } data_word;
 
-/* So, each list is stored, in effect, as a backwards linked
- * list. This gives us O(n) memory usage in the input length
- * (measured in code-numbers, so slightly better than O(n)
- * in byte length). */
+_Static_assert(LZW_MAX_BITS <= 24, "prev_last has 24 bits for prev");
+
+#define DATA_WORD(offset, prev, last, length) \
+    ((data_word){(offset), (uint32_t)(prev) << 8 | (last), (length)})
+
+/* prev_last means that each word is also
+ * stored, in effect, as a backwards linked list. We fall
+ * back on that for words whose offset has scrolled out of
+ * the window; it's slow (a cache miss per byte), but it only
+ * happens once per word, since we update the offset every
+ * time we write a word. */
 
 typedef data_word *dictionary;
 
-/* Given a dictionary, an index in it, and a file descriptor,
- * write the word at that index to the file descriptor.
+/* The recent output. We write decoded words here rather than
+ * straight to the byte stream, hand them over a big chunk at
+ * a time, and keep the tail end around when we do so that
+ * dictionary entries can keep pointing into it.
+ * Positions in the stream are counted from 1, so that an
+ * offset of 0 is never in the window. */
+typedef struct output_window {
+    byte *buffer;
+    size_t length, capacity;
+
+    /* how much of buffer we've handed over already */
+    size_t written;
+
+    /* the position of buffer[0] in the stream */
+    word base;
+} output_window;
+
+/* how big the window starts out, and how much of it we keep
+ * around when it fills up */
+#define WINDOW_SIZE ((size_t)1 << 22)
+#define WINDOW_HISTORY ((size_t)1 << 20)
+/* Short words are copied 16 bytes at a time regardless of
+ * their actual length, so we keep this much spare room at
+ * the end of the window. */
+#define WINDOW_SLACK 16
+
+/* the most codes we read from the input at once */
+#define BATCH_SIZE 256
+
+/* Everything decode_codes needs besides its input and output,
+ * kept from one call to the next, so that decoding lots of
+ * streams (each block, or each of a stream of small records)
+ * doesn't allocate anything per stream. The dictionary's
+ * starting entries never change, and the window just moves on
+ * past whatever the last stream left in it (so that none of
+ * the dictionary's offsets point into it any more). */
+typedef struct decoder {
+    byte max_bits;
+    /* whether the stream may have stored segments, and sync
+     * points, and whether its code numbers are phased in */
+    byte stored, syncs, phased;
+    /* the preset dictionary, or NULL if there isn't one */
+    const lzw_dict *preset;
+    /* where to report what's wrong with the input (see
+     * stage_fail) */
+    stage_error *error;
+    /* if the input ended partway through something (a stored
+     * segment, or with records, a frame), what it was, for
+     * lzw_decode to give up over once it's written out what
+     * it could */
+    const char *cut_short;
+    dictionary dict;
+    word dict_size;
+    output_window w;
+} decoder;
+
+/* Set d up for streams with code numbers of up to max_bits
+ * bits, the given preset dictionary (or NULL), and the rest of
+ * what the header's flags say (see lzw.h), reporting trouble
+ * to error.
+ */
+static void decoder_init(decoder *d, byte max_bits, const lzw_dict *preset,
+        byte flags, stage_error *error) {
+    d->max_bits = max_bits;
+    d->error = error;
+    d->cut_short = NULL;
+    d->stored = !!(flags & LZW_STORED);
+    d->syncs = !!(flags & LZW_SYNCS);
+    d->phased = !!(flags & LZW_PHASED);
+    d->preset = preset;
+    /* We dynamically allocate the dictionary so that we can
+     * grow it if necessary, since we don't know how high the
+     * indices will go (only that they won't go past max_code).
+     * To keep it simple, we'll keep its size in sync with
+     * the largest next_power we've seen—i.e., we grow by
+     * doubling size, starting with 512 (or enough for the
+     * preset dictionary and one more entry, if it's big). */
+    word presets = preset ? preset->count : 0;
+    d->dict_size = (word)1 << lzw_code_bits(LZW_FIRST + presets + d->syncs);
+    d->dict = malloc(sizeof(data_word) * d->dict_size);
+    /* initialize to our starting dictionary */
+    for (int i = 0; i < 256; i++) {
+        /* (the linked list ends at a single byte, so its prev
+         * is never looked at) */
+        d->dict[i] = DATA_WORD(0, 0, i, 1);
+    }
+    /* The preset entries are never overwritten, since our own
+     * entries go after them, so they only need filling in once.
+     * None of them is in the output yet; the linked list will
+     * take care of each one the first time it turns up. */
+    for (word i = 0; i < presets; i++) {
+        word prev = lzw_dict_prev(preset, i);
+        d->dict[LZW_FIRST + i] = DATA_WORD(0, prev,
+            lzw_dict_last(preset, i), d->dict[prev].length + 1);
+    }
+    d->w = (output_window){malloc(WINDOW_SIZE), 0, WINDOW_SIZE, 0, 1};
+}
+
+static void decoder_free(decoder *d) {
+    free(d->dict);
+    free(d->w.buffer);
+}
+
+/* Make room for count more bytes at the end of the window,
+ * sliding its contents down (and handing them over to the
+ * byte stream) if necessary.
+ */
+static void window_reserve(output_window *w, size_t count, bytes_out *out) {
+    if (w->length + count + WINDOW_SLACK <= w->capacity) return;
+    write_bytes(out, w->buffer + w->written, w->length - w->written);
+    size_t keep = w->length < WINDOW_HISTORY ? w->length : WINDOW_HISTORY;
+    memmove(w->buffer, w->buffer + w->length - keep, keep);
+    w->base += w->length - keep;
+    w->length = w->written = keep;
+    if (keep + count + WINDOW_SLACK > w->capacity) {
+        /* only for words longer than the whole window */
+        w->capacity = keep + count + WINDOW_SLACK;
+        w->buffer = realloc(w->buffer, w->capacity);
+    }
+}
+
+/* Copy a stored segment (see lzw.h), whose LZW_CLEAR we've
+ * just read from bi, straight from bi's byte stream to out.
+ * Whatever's in the window goes out first, and then the
+ * window moves on past the segment, which never goes in it;
+ * none of the dictionary will point into the segment, but
+ * then the dictionary starts afresh after it anyway. Returns
+ * 0 if the input ends partway through, setting *cut_short to
+ * say where. (In a frame, that just makes the frame come out
+ * short, which finish_decode_block or decode_records complain
+ * about.)
+ */
+static int copy_stored(bits_in *bi, output_window *w, bytes_out *out,
+        stage_stats *stats, const char **cut_short) {
+    align_bits(bi);
+    byte header[4];
+    if (read_bytes(bi->in, header, 4) < 4) {
+        *cut_short = "a stored segment's length";
+        return 0;
+    }
+    size_t length = lzw_get32(header);
+    write_bytes(out, w->buffer + w->written, w->length - w->written);
+    w->base += w->length + length;
+    w->length = w->written = 0;
+    while (length) {
+        const byte *data;
+        size_t avail = peek_bytes(bi->in, length, &data);
+        if (!avail) {
+            *cut_short = "a stored segment";
+            return 0;
+        }
+        if (avail > length) avail = length;
+        write_bytes(out, data, avail);
+        consume_bytes(bi->in, avail);
+        length -= avail;
+        if (stats) stats->stored += avail;
+    }
+    return 1;
+}
+
+/* Given a dictionary, an index in it, and a window, write
+ * the word at that index to the window.
  * When we're decoding, we need to know the first byte of each
  * index we decode because it will be the last byte of the
- * word we want to add to our dictionary. Since we're already
- * traversing the linked list in this function, we return
- * the first byte while we're at it, even though that's not
- * strictly related to its functionality.
+ * word we want to add to our dictionary, so we return that
+ * while we're at it.
  */
-byte write_data_word(data_word *dict, int ix, int out) {
-    /* Since the length of the word is part of the struct,
-     * we can pre-allocate a buffer to fill with the word.
-     * We'll fill it backwards as we traverse the list, so
-     * the first index we fill will be the buffer's length
-     * minus one. */
-    short buf_ix = dict[ix].length - 1;
-    byte buf[buf_ix + 1];
-    /* Standard linked list traversal, albeit with array
-     * indices rather than actual pointers. We use -1 for
-     * the sentinel value. */
-    while (ix != -1) {
-        buf[buf_ix--] = dict[ix].last;
-        ix = dict[ix].prev;
-    }
-    /* do the actual writing now that we have the word as a
-     * string, then return the first char as discussed */
-    write(out, buf, sizeof(buf));
-    return buf[0];
+static byte write_data_word(output_window *w, dictionary dict, word ix,
+        bytes_out *out) {
+    data_word *d = &dict[ix];
+    window_reserve(w, d->length, out);
+    byte *dest = w->buffer + w->length;
+    if (ix < 256) {
+        /* single bytes are easy */
+        *dest = ix;
+    }
+    else if (d->offset >= w->base) {
+        /* This is the usual case: the word is somewhere in the
+         * window, so we just copy it. Most words are short, so
+         * it's worth avoiding a real memcpy call for them. The
+         * word always ends before dest, so even if the 16
+         * bytes overlap, the ones we care about don't. */
+        const byte *src = w->buffer + (d->offset - w->base);
+        if (d->length <= 16) {
+            byte chunk[16];
+            memcpy(chunk, src, 16);
+            memcpy(dest, chunk, 16);
+        }
+        else memcpy(dest, src, d->length);
+    }
+    else {
+        /* Otherwise, standard linked list traversal, albeit
+         * with array indices rather than actual pointers,
+         * filling in the word backwards. */
+        byte *p = dest + d->length;
+        while (ix >= 256) {
+            *--p = (byte)dict[ix].prev_last;
+            ix = dict[ix].prev_last >> 8;
+        }
+        *--p = ix;
+    }
+    d->offset = w->base + w->length;
+    w->length += d->length;
+    return *dest;
 }
 
-/* Perform LZW decoding, reading from file descriptor in and
- * writing to file descriptor out.
+/* Decode code numbers from bi until it runs out, writing the
+ * decoded bytes to out, using d (which has the max_bits and
+ * preset dictionary from the header, which the callers below
+ * have already dealt with). If stats isn't NULL, we keep its
+ * dictionary counters up to date as we go. If the input's too
+ * corrupt to go on with, we give up (see stage_fail, which
+ * d->error goes to), and stop there.
  */
-void lzw_decode(int in, int out) {
-    /* lzw_encode's output is bit-packed, so we'll use a
-     * bits_in to get our input. */
-    bits_in bi = BITS_IN(in);
-
+static void decode_codes(decoder *d, bits_in *bi, bytes_out *out,
+        stage_stats *stats) {
     /* Each time we read an index, we'll only have as much
      * information as lzw_encode did when it wrote the
      * _previous_ index. Therefore, we call the "most
@@ -77,127 +284,624 @@ void lzw_decode(int in, int out) {
      * any given point, it will be the index that lzw_encode
      * writes "next" after being in the state we currently
      * know.
-     * The first index is a special case; normally, we have
-     * a previously-seen index whose word we concatenate to
-     * the first byte of the next index's word to determine
-     * the next word to add to the dictionary, but in this
-     * case, there's obviously no previous one. So we handle
-     * it separately by itself. In particular, we know that
-     * the first index will be 8 bits, and it will be equal
-     * to the actual byte it corresponds to (since that's
-     * our starting dictionary), so we can just copy a
-     * single byte from in to out. */
-    word next_ix = 0;
-    if (!read_byte(in, &next_ix)) return;
-    write_byte(out, next_ix);
-
-    /* max_ix, next_power, and bit_count serve similar roles
+     * max_ix, next_power, and bit_count serve similar roles
      * as in lzw_encode. In this case, they refer to the
      * maximum index we may _read_, so max_ix will generally
      * be one more than the maximum index _in the dictionary_,
-     * since our dictionary is one step behind. We start one
-     * higher here, since we've already read the first index.
+     * since our dictionary is one step behind.
      * Note that max_ix is the "next index" in the sense of
      * being the next index we're going to add to the
      * dictionary, but next_ix is the "next index" in the
      * sense of being the next index whose word we need to
-     * print. */
-    word max_ix = 256, next_power = 512;
-    byte bit_count = 9;
-    /* We dynamically allocate the dictionary so that we can
-     * grow it if necessary, since we don't know how high the
-     * indices will go. To keep it simple, we'll keep its
-     * size in sync with next_power—i.e., we grow by
-     * doubling size, starting with 512. */
-    dictionary dict = malloc(sizeof(data_word) * next_power);
-    /* initialize to our starting dictionary */
-    for (int i = 0; i < 256; i++) {
-        /* -1 is the sentinel value for the start/end of the
-         * linked list */
-        dict[i] = (data_word){-1, i, 1};
-    }
-    /* prev will be the previous index we read */
-    int prev = next_ix;
+     * print. Once max_ix reaches max_code, the dictionary is
+     * full; we fill in that last entry and then stop.
+     * With a preset dictionary, its entries come first, so
+     * every (re)start begins with max_ix past them, and
+     * first_free is where our own entries begin. With sync
+     * points, the sync code comes between the two (and
+     * otherwise, sync is LZW_CLEAR, which we'll have dealt with
+     * before we'd check for it). */
+    word presets = d->preset ? d->preset->count : 0,
+         fresh = LZW_CLEAR + presets + d->syncs,
+         first_free = LZW_FIRST + presets + d->syncs,
+         sync = d->syncs ? LZW_FIRST + presets : LZW_CLEAR,
+         next_ix, max_ix = fresh,
+         max_code = ((word)1 << d->max_bits) - 1;
+    byte bit_count = lzw_code_bits(max_ix), full = 0;
+    word next_power = (word)1 << bit_count;
+    /* (we work on copies of these, and put them back at the
+     * end) */
+    word dict_size = d->dict_size;
+    dictionary dict = d->dict;
+    output_window w = d->w;
+    w.base += w.length;
+    w.length = w.written = 0;
+    /* prev will be the previous index we read, or NO_PREV at
+     * the start and right after a clear, and prev_offset is
+     * where its word went in the output */
+#define NO_PREV -1
+    int prev = NO_PREV;
+    word prev_offset = 0;
 
     /* Invalid is the number of too-large indices we've seen.
-     * We'll exit if we see 10 of them, because the data is
+     * We'll give up if we see 10 of them, because the data is
      * probably too corrupt to be interesting. That should
      * probably be a percentage thing instead, but meh,
      * that would be complicated ;) */
     int invalid = 0;
-    /* We'll exit the loop once we hit EOF, which should be
-     * the only time read_bits returns anything other than
-     * bit_count (barring an error). The final thing we read
-     * won't be an index (it's too short), just garbage at
-     * the end (probably zeros, for output from lzw_encode),
-     * so we don't have to do anything with it. */
-    while (read_bits(&bi, bit_count, &next_ix) == bit_count) {
-        /* we'll set this to the first byte of next_ix's word */
-        byte first;
-        if (next_ix < max_ix) {
-            /* if next_ix is in the dictionary, this is super
-             * simple—just write that word (and snag its
-             * first byte) */
-            first = write_data_word(dict, next_ix, out);
-        }
-        else if (next_ix == max_ix) {
-            /* If it's the next index we'll add, we can still
-             * deal with it. The next index we add will
-             * consist of the last index's word followed by
-             * the next index's word's first byte, but then
-             * the next index's word's first byte is the last
-             * index's word's first byte, so we have everything
-             * we need. */
-            first = write_data_word(dict, prev, out);
-            write_byte(out, first);
+
+    /* Codes only change width at points we can see coming: once
+     * the dictionary is full, never (until a clear), and before
+     * that, when max_ix reaches next_power. So rather than read
+     * codes one at a time, we read a batch of as many as are sure
+     * to be the same width. The only surprise can be a clear;
+     * codes after one are narrower than we read them as, so we
+     * give them back to be read again. (A clear doesn't come
+     * until the dictionary is full, except just before a stored
+     * segment, but corrupt input might have one anywhere.)
+     * A clear that comes first thing, when we're only reading
+     * one code anyway, starts a stored segment instead, which
+     * we copy once we're out of the batch, and a sync code
+     * means flushing, which we do then too.
+     * With sync points, the encoder may well have flushed and
+     * be waiting on more input, so we don't ask for more codes
+     * than we have (unless that's none), or we might be waiting
+     * on codes that won't come until after whoever's reading
+     * our output has seen what came before them.
+     * Phased-in codes (see lzw.h) aren't all the same width, but
+     * how many are short goes down by one a code, as max_ix goes
+     * up, which read_bits_phased_batch knows about; once the
+     * dictionary's full, they're plain codes anyway. */
+    word codes[BATCH_SIZE];
+    byte segment = 0, synced = 0, failed = 0;
+    for (;;) {
+        size_t want = BATCH_SIZE;
+        if (prev == NO_PREV) want = 1;
+        else if (!full && next_power - max_ix < want) {
+            want = next_power - max_ix;
         }
-        else {
-            /* If it's larger than the next index we'll add,
-             * it couldn't even have been generated by
-             * lzw_encode, so we whine about it. If this is
-             * the 10th time it's happened, we just exit. */
-            WHINE("lzw_decode: invalid index %lu\n", next_ix);
-            invalid++;
-            if (invalid >= 10) {
-                WHINE("lzw_decode: exiting after 10 invalid indices; "
-                        "input is probably corrupt\n");
-                exit(3);
+        if (d->syncs && bits_buffered(bi) < (word)want * bit_count) {
+            want = bits_buffered(bi) / bit_count;
+            if (!want) want = 1;
+        }
+        byte width = bit_count;
+        word shorts = lzw_shorts(max_ix, bit_count, d->phased);
+        size_t got = d->phased && !full
+            ? read_bits_phased_batch(bi, width, shorts, want, codes)
+            : read_bits_batch(bi, width, want, codes), i;
+        for (i = 0; i < got; i++) {
+            next_ix = codes[i];
+            if (next_ix == LZW_CLEAR && prev == NO_PREV && d->stored) {
+                segment = 1;
+                i++;
+                break;
+            }
+            if (next_ix == LZW_CLEAR) {
+                /* Forget everything we've learned, and go back to
+                 * the state we started in. The dictionary keeps
+                 * its memory, since we'll probably fill it again. */
+                max_ix = fresh;
+                bit_count = lzw_code_bits(max_ix);
+                next_power = (word)1 << bit_count;
+                full = 0;
+                prev = NO_PREV;
+                if (stats) stats->dict_resets++;
+                i++;
+                break;
+            }
+            if (next_ix == sync) {
+                synced = 1;
+                i++;
+                break;
+            }
+            /* we'll set this to the first byte of next_ix's word,
+             * which is about to go here */
+            byte first;
+            word offset = w.base + w.length;
+            if (prev == NO_PREV && next_ix <= max_ix) {
+                /* The first index after a (re)start is a special
+                 * case; normally, we have a previously-seen index
+                 * whose word we concatenate to the first byte of
+                 * the next index's word to determine the next word
+                 * to add to the dictionary, but in this case,
+                 * there's obviously no previous one. We know the
+                 * index stands for a single byte (or a preset
+                 * entry, since we have nothing else in our
+                 * dictionary; it can't be LZW_CLEAR, which we've
+                 * dealt with above), so we can just write it, and
+                 * then the next entry to come is the first
+                 * non-reserved one. */
+                write_data_word(&w, dict, next_ix, out);
+                prev = next_ix;
+                prev_offset = offset;
+                /* (which, with a preset dictionary, might take
+                 * another bit, just as it did for lzw_encode) */
+                max_ix = first_free;
+                bit_count = lzw_code_bits(max_ix);
+                next_power = (word)1 << bit_count;
+                continue;
+            }
+            else if (next_ix < max_ix + full) {
+                /* if next_ix is in the dictionary, this is super
+                 * simple—just write that word (and snag its
+                 * first byte) */
+                first = write_data_word(&w, dict, next_ix, out);
+            }
+            else if (next_ix == max_ix && prev != NO_PREV) {
+                /* If it's the next index we'll add, we can still
+                 * deal with it. The next index we add will
+                 * consist of the last index's word followed by
+                 * the next index's word's first byte, but then
+                 * the next index's word's first byte is the last
+                 * index's word's first byte, so we have everything
+                 * we need. */
+                first = write_data_word(&w, dict, prev, out);
+                window_reserve(&w, 1, out);
+                w.buffer[w.length++] = first;
             }
-            /* just use 0, since there's no particular byte
-             * to favor */
-            first = 0;
-        }
-        max_ix++;
-        if (max_ix >= next_power) {
-            /* If the new upper bound on indices we may see
-             * is too large to fit in our number of bits (and
-             * additionally, therefore, out of bounds in our
-             * dictionary), increase our bit count (and make
-             * our dictionary bigger). */
-            next_power <<= 1;
-            bit_count++;
-            /* There is technically an edge case where we're
-             * actually on the last character and this
-             * unnecessarily allocates a bunch of extra memory
-             * (when the input length is a power of two), but
-             * any other doubling-based approach would also
-             * have similar problems, and I want to keep it
-             * simple. */
-            dict = realloc(dict, sizeof(data_word) * next_power);
-        }
-        /* Add the next index to the dictionary by consing the
-         * first character of the most recent input index's word
-         * to the end of the previous input index's word. Then
-         * the length is just the previous input index's word's
-         * length plus one. */
-        dict[max_ix - 1] = (data_word){prev, first, dict[prev].length + 1};
-        /* Then remember our most recent input index as the
-         * previous one, because we're about to read another
-         * index. */
-        prev = next_ix;
-    }
-
-    /* Don't leak! */
-    free(dict);
+            else {
+                /* If it's larger than the next index we'll add,
+                 * it couldn't even have been generated by
+                 * lzw_encode, so we whine about it. If this is
+                 * the 10th time it's happened, we give up. */
+                stage_complain(d->error, "lzw_decode: invalid index %ju\n",
+                        (uintmax_t)next_ix);
+                invalid++;
+                if (invalid >= 10) {
+                    stage_fail(d->error, 3, "lzw_decode: giving up after "
+                            "10 invalid indices; input is probably corrupt\n");
+                    failed = 1;
+                    break;
+                }
+                /* just use 0, since there's no particular byte
+                 * to favor */
+                next_ix = first = 0;
+                if (prev == NO_PREV) {
+                    /* (and if we have no word to extend, just
+                     * pretend we got a 0 byte) */
+                    write_data_word(&w, dict, 0, out);
+                    prev = 0;
+                    prev_offset = offset;
+                    max_ix = first_free;
+                    bit_count = lzw_code_bits(max_ix);
+                    next_power = (word)1 << bit_count;
+                    continue;
+                }
+                /* neither the word we're about to add nor the one
+                 * we're pretending we got is actually in the output
+                 * anywhere */
+                prev_offset = offset = 0;
+            }
+            if (!full) {
+                /* Add the next index to the dictionary by consing the
+                 * first character of the most recent input index's word
+                 * to the end of the previous input index's word. Then
+                 * the length is just the previous input index's word's
+                 * length plus one. */
+                dict[max_ix] = DATA_WORD(prev_offset, prev, first,
+                    dict[prev].length + 1);
+                if (max_ix < max_code) {
+                    max_ix++;
+                    if (max_ix >= next_power) {
+                        /* If the new upper bound on indices we may see
+                         * is too large to fit in our number of bits (and
+                         * additionally, therefore, out of bounds in our
+                         * dictionary), increase our bit count (and make
+                         * our dictionary bigger if it isn't already). */
+                        next_power <<= 1;
+                        bit_count++;
+                        if (next_power > dict_size) {
+                            dict_size = next_power;
+                            dict = realloc(dict, sizeof(data_word) * dict_size);
+                        }
+                    }
+                }
+                else full = 1;
+            }
+            /* Then remember our most recent input index as the
+             * previous one, because we're about to read another
+             * index. */
+            prev = next_ix;
+            prev_offset = offset;
+        }
+        if (failed) break;
+        if (stats) {
+            stats->dict_entries = max_ix < first_free ? presets
+                : max_ix - first_free + presets + full;
+            stats->code_bits = bit_count;
+        }
+        if (segment) {
+            segment = 0;
+            if (!copy_stored(bi, &w, out, stats, &d->cut_short)) break;
+        }
+        else if (i < got) {
+            /* (with plain codes, shorts is 0, and phased_bits
+             * says they're all width long) */
+            word unread = 0;
+            for (; i < got; i++) {
+                unread += phased_bits(width, shorts > i ? shorts - i : 0,
+                        codes[i]);
+            }
+            unread_bits(bi, unread);
+        }
+        /* We stop once we hit EOF, which is the only time we get
+         * fewer codes than we asked for. Whatever's left over
+         * isn't a whole code, just padding at the end (zeros, for
+         * output from lzw_encode), so there's nothing to do with
+         * it. */
+        else if (got < want) break;
+        if (synced) {
+            /* everything up to the sync point goes out now (and
+             * the padding after it is skipped) */
+            synced = 0;
+            align_bits(bi);
+            write_bytes(out, w.buffer + w.written, w.length - w.written);
+            w.written = w.length;
+            flush_bytes(out);
+            if (stats) stats->syncs++;
+        }
+    }
+    /* hand over whatever's left in the window */
+    write_bytes(out, w.buffer + w.written, w.length - w.written);
+    w.written = w.length;
+
+    d->dict = dict;
+    d->dict_size = dict_size;
+    d->w = w;
+}
+
+/* A frame for a worker to decompress, and then (once it's
+ * been decompressed) the result. Frames come from a slab (see
+ * slab.h), so that their buffers get reused. */
+typedef struct decode_block {
+    pool_task task;
+    /* a decoder per worker, as in lzw_encode.c */
+    decoder *decoders;
+    const byte *input;
+    size_t length, expected;
+    /* if the input isn't in memory, the buffer we copy it into,
+     * kept (and grown as needed) from one use to the next, like
+     * the output buffer */
+    byte *spare;
+    size_t spare_size;
+    bytes_out output;
+    /* with LZW_CHECKED, the frame's number (counting from 0),
+     * its checksum, the CRC of its header, and whether the
+     * rest didn't match */
+    word number;
+    uint32_t check, header_crc;
+    byte checked, damaged;
+    /* with --stats, what became of this block's dictionary */
+    byte count_stats;
+    stage_stats stats;
+    /* the slab (see slab.h) to put it back in */
+    slab *from;
+} decode_block;
+
+static void run_decode_block(pool_task *t, size_t worker) {
+    decode_block *b = (decode_block *)t;
+    /* (a damaged frame is still worth decoding: most of it may
+     * well come out right) */
+    b->damaged = b->checked
+        && crc32c(b->header_crc, b->input, b->length) != b->check;
+    bytes_in in;
+    bytes_in_init_mem(&in, b->input, b->length);
+    bits_in bi = BITS_IN(&in);
+    /* (a block fresh from the slab is all zeroes) */
+    if (!b->output.buffer) bytes_out_init_mem(&b->output, b->expected);
+    b->output.length = 0;
+    b->stats = (stage_stats){0};
+    decode_codes(&b->decoders[worker], &bi, &b->output,
+            b->count_stats ? &b->stats : NULL);
+    bytes_in_free(&in);
+}
+
+static void drop_decode_block(void *block) {
+    decode_block *b = block;
+    free(b->spare);
+    free(b->output.buffer);
+}
+
+/* What next_decode_block needs to know. */
+typedef struct decode_source {
+    bytes_in *in;
+    decoder *decoders;
+    slab blocks;
+    byte checked, count_stats;
+    word frames;
+    stage_error *error;
+    /* as with a decoder's */
+    const char *cut_short;
+} decode_source;
+
+/* And what finish_decode_block needs. */
+typedef struct decode_sink {
+    bytes_out *out;
+    whine_limit damaged;
+    /* how many blocks didn't match their checksums, or came out
+     * the wrong length */
+    word bad;
+} decode_sink;
+
+/* Read a frame header, setting *expected and *length to the
+ * frame's uncompressed and compressed lengths. Returns 0 if
+ * there isn't one (setting *cut_short if there's only part of
+ * one), or there's no making sense of it (which we report to
+ * error). If check isn't NULL, the frame has a checksum (see
+ * lzw.h), which goes in check[0], and the CRC of the lengths
+ * in check[1], for carrying on over the rest.
+ */
+static int read_frame_header(bytes_in *in, size_t *expected, size_t *length,
+        byte records, uint32_t *check, stage_error *error,
+        const char **cut_short) {
+    byte header[LZW_FRAME_HEADER + LZW_FRAME_CHECK];
+    size_t size = LZW_FRAME_HEADER + (check ? LZW_FRAME_CHECK : 0);
+    size_t got = read_bytes(in, header, size);
+    if (!got) return 0;
+    if (got < size) {
+        *cut_short = "a frame header";
+        return 0;
+    }
+    *expected = lzw_get32(header);
+    *length = lzw_get32(header + 4);
+    /* There's no way to get a frame like this out of
+     * lzw_encode, and it might have us allocate gigabytes, so
+     * we don't even try. */
+    if (!lzw_frame_ok(*expected, *length, records)) {
+        stage_fail(error, 3, "lzw_decode: bad frame header; "
+                "input is probably corrupt\n");
+        return 0;
+    }
+    if (check) {
+        check[0] = lzw_get32(header + LZW_FRAME_HEADER);
+        check[1] = crc32c(0, header, LZW_FRAME_HEADER);
+    }
+    return 1;
+}
+
+/* Read the next frame, if there's any left (and nothing's
+ * given up). */
+static pool_task *next_decode_block(void *source) {
+    decode_source *src = source;
+    size_t expected, length;
+    uint32_t check[2];
+    if (stage_failed(src->error) || !read_frame_header(src->in, &expected,
+                &length, 0, src->checked ? check : NULL, src->error,
+                &src->cut_short)) {
+        return NULL;
+    }
+    decode_block *b = slab_get(&src->blocks);
+    b->from = &src->blocks;
+    b->number = src->frames++;
+    b->checked = src->checked;
+    b->count_stats = src->count_stats;
+    b->check = check[0];
+    b->header_crc = check[1];
+    b->decoders = src->decoders;
+    b->expected = expected;
+    b->length = length;
+    if (!bytes_in_memory(src->in) && b->spare_size < length) {
+        b->spare_size = length;
+        b->spare = realloc(b->spare, length + BYTES_SLACK);
+    }
+    size_t got = take_bytes_into(src->in, b->length, &b->input, b->spare);
+    /* (what there is of it is decoded anyway, and is the last
+     * block there'll be) */
+    if (got < b->length) {
+        src->cut_short = "a frame";
+        b->length = got;
+    }
+    b->task.run = run_decode_block;
+    return &b->task;
+}
+
+/* Write out a decompressed block. */
+static void finish_decode_block(pool_task *t, void *sink_) {
+    decode_block *b = (decode_block *)t;
+    decode_sink *sink = sink_;
+    bytes_out *out = sink->out;
+    if (b->damaged) {
+        whine(&sink->damaged, "lzw_decode: block %ju doesn't match its "
+                "checksum, so it's damaged; decoding it anyway\n",
+                (uintmax_t)b->number);
+    }
+    if (out->stats) {
+        out->stats->blocks++;
+        out->stats->dict_entries = b->stats.dict_entries;
+        out->stats->code_bits = b->stats.code_bits;
+        out->stats->dict_resets += b->stats.dict_resets;
+        out->stats->stored += b->stats.stored;
+    }
+    if (b->output.length != b->expected) {
+        stage_complain(sink->damaged.error, "lzw_decode: block came out "
+                "to %zu bytes instead of %zu\n", b->output.length,
+                b->expected);
+    }
+    if (b->damaged || b->output.length != b->expected) sink->bad++;
+    write_bytes(out, b->output.buffer, b->output.length);
+    slab_put(b->from, b);
+}
+
+/* For a stream of records (see lzw.h): decode each frame,
+ * and write it out as a record. As in lzw_encode's
+ * encode_records, nothing is set up or torn down per record:
+ * there's one decoder for the lot, a frame that fits in in's
+ * buffer is decoded right out of it, and each record is
+ * decoded into the same buffer (which we need anyway, to be
+ * sure of its length before writing it). Returns how many
+ * records didn't match their checksums, or came out the wrong
+ * length.
+ */
+static word decode_records(bytes_in *in, bytes_out *out, decoder *d,
+        byte checked) {
+    bytes_out record;
+    bytes_out_init_mem(&record, BYTES_BUFFER_SIZE);
+    whine_limit mismatched = WHINE_LIMIT("lzw_decode", d->error);
+    size_t expected, length;
+    uint32_t check[2];
+    word bad = 0;
+    for (word number = 0; read_frame_header(in, &expected, &length, 1,
+                checked ? check : NULL, d->error, &d->cut_short); number++) {
+        const byte *data;
+        byte *owned = NULL;
+        byte taken = 0;
+        size_t got = peek_bytes(in, length, &data);
+        /* (too big for the buffer, or cut short) */
+        if (got < length) {
+            got = take_bytes(in, length, &data, &owned);
+            taken = 1;
+        }
+        if (got < length) {
+            d->cut_short = "a frame";
+            length = got;
+        }
+
+        byte damaged = checked
+            && crc32c(check[1], data, length) != check[0];
+        if (damaged) {
+            whine(&mismatched, "lzw_decode: record %ju doesn't match its "
+                    "checksum, so it's damaged; decoding it anyway\n",
+                    (uintmax_t)number);
+        }
+
+        bytes_in packed;
+        bytes_in_init_mem(&packed, data, length);
+        bits_in bi = BITS_IN(&packed);
+        record.length = 0;
+        decode_codes(d, &bi, &record, out->stats);
+        bytes_in_free(&packed);
+        if (taken) free(owned);
+        else consume_bytes(in, length);
+        if (stage_failed(d->error)) break;
+
+        if (record.length != expected) {
+            whine(&mismatched, "lzw_decode: record came out to %zu bytes "
+                    "instead of %zu\n", record.length, expected);
+        }
+        if (damaged || record.length != expected) bad++;
+        byte prefix[4];
+        lzw_put32(prefix, record.length);
+        write_bytes(out, prefix, 4);
+        write_bytes(out, record.buffer, record.length);
+        if (out->stats) out->stats->blocks++;
+    }
+    whine_done(&mismatched);
+    bytes_out_free(&record);
+    return bad;
 }
 
+/* Perform LZW decoding, reading from byte stream in and
+ * writing to byte stream out, with settings o.
+ */
+void lzw_decode(bytes_in *in, bytes_out *out, const options *o) {
+    /* First, the header (see lzw.h). */
+    byte max_bits, flags;
+    if (!read_byte(in, &max_bits)) return;
+    if (!read_byte(in, &flags)
+            || max_bits < LZW_MIN_BITS || max_bits > LZW_MAX_BITS
+            || (flags & ~(LZW_BLOCKS | LZW_PRESET | LZW_RECORDS | LZW_STORED
+                    | LZW_CHECKED | LZW_SYNCS | LZW_PHASED))
+            || (flags & LZW_BLOCKS && flags & LZW_RECORDS)
+            || (flags & LZW_SYNCS && flags & (LZW_BLOCKS | LZW_RECORDS))
+            || (flags & LZW_CHECKED && !(flags & (LZW_BLOCKS | LZW_RECORDS)))) {
+        stage_fail(o->error, 3, "lzw_decode: bad header; "
+                "input is probably corrupt\n");
+        return;
+    }
+
+    /* A stream compressed with a preset dictionary can't be
+     * decompressed without the very same one. */
+    lzw_dict preset, *use_preset = NULL;
+    if (flags & LZW_PRESET) {
+        byte id[4];
+        if (read_bytes(in, id, 4) < 4) {
+            stage_fail(o->error, 3, "lzw_decode: bad header; "
+                    "input is probably corrupt\n");
+            return;
+        }
+        if (!o->dict) {
+            stage_fail(o->error, 3, "lzw_decode: input was compressed "
+                    "with dictionary %08" PRIx32 "; pass it with --dict\n",
+                    lzw_get32(id));
+            return;
+        }
+        if (!lzw_dict_open(&preset, o->dict, o->error)) return;
+        if (preset.id != lzw_get32(id)) {
+            stage_fail(o->error, 3, "lzw_decode: input was compressed "
+                    "with dictionary %08" PRIx32 ", but %s is %08" PRIx32
+                    "\n", lzw_get32(id), o->dict, preset.id);
+            lzw_dict_close(&preset);
+            return;
+        }
+        if (LZW_CLEAR + preset.count + !!(flags & LZW_SYNCS)
+                >= ((word)1 << max_bits) - 1) {
+            stage_fail(o->error, 3, "lzw_decode: bad header; "
+                    "input is probably corrupt\n");
+            lzw_dict_close(&preset);
+            return;
+        }
+        use_preset = &preset;
+    }
+
+    const char *cut_short;
+    /* (how many blocks or records were damaged) */
+    word bad = 0;
+    if (flags & LZW_BLOCKS) {
+        /* Blocks are independent, so we decompress them on a
+         * pool of worker threads, the same way lzw_encode
+         * compressed them. */
+        decode_source src = {in, malloc(sizeof(decoder) * o->jobs),
+            .checked = flags & LZW_CHECKED, .count_stats = o->stats,
+            .error = o->error, .cut_short = NULL};
+        decode_sink sink = {out, WHINE_LIMIT("lzw_decode", o->error), 0};
+        for (word i = 0; i < o->jobs; i++) {
+            decoder_init(&src.decoders[i], max_bits, use_preset, flags,
+                    o->error);
+        }
+        slab_init(&src.blocks, sizeof(decode_block), out->stats);
+        pool p;
+        pool_init(&p, o->jobs);
+        pool_ordered(&p, 2 * o->jobs + 1,
+                next_decode_block, &src, finish_decode_block, &sink);
+        pool_free(&p);
+        whine_done(&sink.damaged);
+        slab_free(&src.blocks, drop_decode_block);
+        for (word i = 0; i < o->jobs; i++) decoder_free(&src.decoders[i]);
+        free(src.decoders);
+        cut_short = src.cut_short;
+        bad = sink.bad;
+    }
+    else {
+        decoder d;
+        decoder_init(&d, max_bits, use_preset, flags, o->error);
+        if (flags & LZW_RECORDS) {
+            bad = decode_records(in, out, &d, flags & LZW_CHECKED);
+        }
+        else {
+            /* lzw_encode's output is bit-packed, so we'll use a
+             * bits_in to get our input. */
+            bits_in bi = BITS_IN(in);
+            decode_codes(&d, &bi, out, out->stats);
+        }
+        cut_short = d.cut_short;
+        decoder_free(&d);
+    }
+    if (use_preset) lzw_dict_close(&preset);
+
+    /* Input that stops short, or that doesn't match its
+     * checksums, is as wrong as input that makes no sense, but
+     * there's no harm in having written out what there was
+     * (damaged frames and all) first. */
+    if (cut_short) {
+        flush_bytes(out);
+        stage_fail(o->error, 3, "lzw_decode: input ends partway through "
+                "%s; it's been cut short\n", cut_short);
+    }
+    else if (bad) {
+        flush_bytes(out);
+        stage_fail(o->error, 3, "lzw_decode: %ju %s%s damaged; input is "
+                "corrupt\n", (uintmax_t)bad,
+                flags & LZW_RECORDS ? "record" : "block",
+                bad == 1 ? " was" : "s were");
+    }
+}
@@ -1,4 +1,6 @@
 #include "general.h"
 
-void lzw_decode(int in, int out);
+struct options;
+
+void lzw_decode(bytes_in *in, bytes_out *out, const struct options *o);
 
@@ -0,0 +1,82 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "lzw.h"
+#include "lzw_dict.h"
+
+/* The ID of a dictionary: 32-bit FNV-1a over its entries. It
+ * doesn't need to be anything fancier; it's only there to
+ * catch decoding with the wrong dictionary, not to stand up
+ * to anybody trying to fool it.
+ */
+uint32_t lzw_dict_hash(const byte *entries, word count) {
+    uint32_t h = 2166136261u;
+    for (word i = 0; i < 4 * count; i++) {
+        h = (h ^ entries[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Map the dictionary file at path into memory and check that
+ * it makes sense. If it doesn't (or it can't be read at all),
+ * there's nothing sensible to do without it, so we give up
+ * (see stage_fail, which e goes to) and return 0; otherwise,
+ * 1.
+ */
+int lzw_dict_open(lzw_dict *d, const char *path, stage_error *e) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        stage_fail(e, 2, "%s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < LZW_DICT_HEADER) {
+        close(fd);
+        stage_fail(e, 2, "%s: not a dictionary\n", path);
+        return 0;
+    }
+    d->mapped = st.st_size;
+    const byte *map = mmap(NULL, d->mapped, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        stage_fail(e, 2, "%s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    d->count = lzw_get32(map + 4);
+    d->id = lzw_get32(map + 8);
+    d->entries = map + LZW_DICT_HEADER;
+    if (memcmp(map, "LZWd", 4)
+            || d->count > ((word)1 << LZW_MAX_BITS) - LZW_FIRST
+            || d->mapped != LZW_DICT_HEADER + 4 * d->count) {
+        stage_fail(e, 2, "%s: not a dictionary\n", path);
+        lzw_dict_close(d);
+        return 0;
+    }
+    for (word i = 0; i < d->count; i++) {
+        word prev = lzw_dict_prev(d, i);
+        if (prev >= LZW_FIRST + i || prev == LZW_CLEAR) {
+            stage_fail(e, 2, "%s: entry %ju extends one that isn't "
+                    "before it; the dictionary is corrupt\n",
+                    path, (uintmax_t)i);
+            lzw_dict_close(d);
+            return 0;
+        }
+    }
+    if (lzw_dict_hash(d->entries, d->count) != d->id) {
+        stage_fail(e, 2, "%s: ID doesn't match the entries; "
+                "the dictionary is corrupt\n", path);
+        lzw_dict_close(d);
+        return 0;
+    }
+    return 1;
+}
+
+void lzw_dict_close(lzw_dict *d) {
+    munmap((void *)(d->entries - LZW_DICT_HEADER), d->mapped);
+}
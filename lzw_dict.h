@@ -0,0 +1,49 @@
+#include "general.h"
+
+/* Preset dictionaries, for compressing small messages. An LZW
+ * dictionary starts out knowing nothing but single bytes, so
+ * it takes a few KiB of input before it's learned enough to
+ * compress well, and a message shorter than that barely
+ * compresses at all. But if the messages all look alike, we
+ * can learn from a pile of samples ahead of time (see train.c)
+ * and have both ends start from what we learned.
+ * Include lzw.h first.
+ *
+ * A dictionary file is a LZW_DICT_HEADER-byte header: the
+ * magic bytes "LZWd", then the number of entries and the
+ * dictionary's ID, 4 bytes apiece, little-endian. Then come
+ * the entries, 4 bytes each, little-endian: the code number
+ * of the word the entry extends, shifted up 8 bits, plus the
+ * byte it extends it by. The entries get the code numbers
+ * from LZW_FIRST up, in order, and each one may only extend a
+ * single byte or an entry before it. The ID is a hash of the
+ * entries, which the stream records so that the decoder can
+ * tell whether it has the right dictionary.
+ */
+#define LZW_DICT_HEADER 12
+
+typedef struct lzw_dict {
+    uint32_t id;
+    word count;
+    /* the entries, straight out of the file, which is mapped
+     * read-only and shared, so every process using the same
+     * dictionary shares the one copy in the page cache */
+    const byte *entries;
+    size_t mapped;
+} lzw_dict;
+
+struct stage_error;
+int lzw_dict_open(lzw_dict *d, const char *path, struct stage_error *e);
+void lzw_dict_close(lzw_dict *d);
+uint32_t lzw_dict_hash(const byte *entries, word count);
+
+/* Entry i (counting from 0, so code number LZW_FIRST + i) is
+ * the word with code number lzw_dict_prev(d, i) plus the byte
+ * lzw_dict_last(d, i). */
+static inline word lzw_dict_prev(const lzw_dict *d, word i) {
+    return lzw_get32(d->entries + 4 * i) >> 8;
+}
+
+static inline byte lzw_dict_last(const lzw_dict *d, word i) {
+    return d->entries[4 * i];
+}
@@ -2,110 +2,610 @@
 
 #include "byte_io.h"
 #include "bit_io.h"
-#include "sparse.h"
+#include "crc32c.h"
+#include "codetable.h"
+#include "pool.h"
+#include "slab.h"
+#include "options.h"
+#include "stats.h"
+#include "lzw.h"
+#include "lzw_dict.h"
 #include "lzw_encode.h"
 
-/* A 256-ary tree, with words at the nodes.
- * Used for the LZW dictionary.
- */
-typedef struct bytetree {
-    /* the code number for the data word described
-     * by this node's position in the tree */
-    word ix;
+/* We check how well we're doing every time this many bytes
+ * of input go by. */
+#define CHECK_INTERVAL ((word)1 << 16)
 
-    sparse *children;
-} bytetree;
+/* Data that isn't compressing is stored as it is instead (see
+ * lzw.h), in segments of up to STORED_SEGMENT bytes. Before
+ * each one, we try compressing the first STORED_PROBE bytes of
+ * it with a fresh dictionary, and if that comes out to no more
+ * than STORED_RESUME (in 256ths) of the size, we go back to
+ * compressing. */
+#define STORED_SEGMENT ((size_t)1 << 16)
+#define STORED_PROBE ((size_t)1 << 12)
+#define STORED_RESUME 240
 
-/* Allocate a bytetree node and a sparse for its children.
- */
-static bytetree *bytetree_new(word ix) {
-    bytetree *tree = malloc(sizeof(bytetree));
-    tree->ix = ix;
-    tree->children = sparse_new();
-    return tree;
-}
+/* What a fresh dictionary holds besides the single bytes:
+ * with --dict, the preset dictionary's entries. They go in a
+ * table of their own, which is only ever read, so it's hashed
+ * once and shared by every block (and record) and every
+ * worker, and starting over just means clearing the table of
+ * our own entries. Without --dict, count is 0.
+ * With --flush-ms, the code number after them is the sync code
+ * (see lzw.h), which is sync; otherwise, sync is 0.
+ * (And since everything that writes code numbers gets one of
+ * these, it also says how wide they get, and whether to phase
+ * them in.) */
+typedef struct dict_start {
+    codetable table;
+    word count, sync;
+    byte max_bits, phased;
+} dict_start;
 
-/* Recursively free an entire bytetree.
- */
-static void bytetree_free(bytetree *tree) {
-    sparse_free(bytetree_free, tree->children);
-    free(tree);
+/* The largest code number in a fresh dictionary. */
+static inline word fresh_max_ix(const dict_start *start) {
+    return LZW_CLEAR + start->count + (start->sync != 0);
 }
 
+/* Write code number code, when the largest there can be is
+ * max_ix, which takes bit_count bits; phased in, with --phased
+ * (see lzw.h). Returns how many bits that took. */
+static inline byte write_code(bits_out *bo, const dict_start *start,
+        word max_ix, byte bit_count, word code) {
+    word shorts = lzw_shorts(max_ix, bit_count, start->phased);
+    write_bits_phased(bo, bit_count, shorts, code);
+    return phased_bits(bit_count, shorts, code);
+}
 
-/* Perform LZW encoding, reading from file descriptor in
- * and writing to file descriptor out.
- * Each byte of input is considered a symbol, but output is
- * bit-packed.
+/* Encode what's left in byte stream in as code numbers,
+ * writing them to bo. Each byte of input is considered a
+ * symbol, but output is bit-packed. dict should be empty to
+ * begin with. If stats isn't NULL, we keep its dictionary
+ * counters up to date as we go.
+ * Normally, this goes on until the input runs out, and
+ * returns 0. But if the input isn't compressing (and storing
+ * is set), it writes a clear and stops right there, leaving
+ * the rest of the input for encode_codes to store, and
+ * returns 1.
  */
-void lzw_encode(int in, int out) {
-    /* We'll use normal read() calls for input, but since output
-     * is bit-packed, we'll use a bits_out. */
-    bits_out bo = BITS_OUT(out);
-
-    /* Our tree's root will be special-cased as an actual array,
-     * but the main loop assumes a normal bytetree "current node".
-     * So we need to manually take our first step before starting
-     * the main loop; hence we read a byte right at the beginning. */
+static int encode_run(bytes_in *in, bits_out *bo, codetable *dict,
+        const dict_start *start, byte storing, stage_stats *stats) {
+    /* The main loop assumes we're already partway through a
+     * known word, so we need to manually take our first step
+     * before starting it; hence we read a byte right at the
+     * beginning. */
     byte next_byte;
-    if (!read_byte(in, &next_byte)) return;
+    if (!read_byte(in, &next_byte)) return 0;
 
     /* max_ix is the current largest code number. bit_count
      * is the number of bits necessary to store max_ix; we
      * store it redundantly to avoid recomputing. next_power
      * is the next power of 2 after max_ix; we'll know to
-     * increment bit_count when max_ix reaches next_power. */
-    word max_ix = 255, next_power = 256;
-    byte bit_count = 8;
-    /* We special-case dict_root as an actual array since
-     * we know for certain that it will be frequently traversed
-     * and that it will use all 256 possible child nodes—no
-     * sense wasting time and space with a linked list. Also,
-     * it has no associated code number, so it doesn't even
-     * need to be a bytetree node. */
-    bytetree *dict_root[256];
-    for (int i = 0; i < 256; i++) {
-        dict_root[i] = bytetree_new(i);
-    }
-    /* the "current node" */
-    bytetree *dict_cur = dict_root[next_byte];
-
-    while (read_byte(in, &next_byte)) {
-        bytetree **next =
-            (bytetree**)sparse_at(dict_cur->children, next_byte);
-        if (*next != NULL) {
-            /* If we're still in a prefix of a data word that's
-             * already in the dictionary, just continue down. */
-            dict_cur = *next;
-        }
-        else {
+     * increment bit_count when max_ix reaches next_power.
+     * Once max_ix reaches max_code, the dictionary is full
+     * and we stop adding to it. A preset dictionary's entries
+     * come right after LZW_CLEAR, so they count towards max_ix
+     * from the start. */
+    word max_ix = fresh_max_ix(start),
+         max_code = ((word)1 << start->max_bits) - 1;
+    byte bit_count = lzw_code_bits(max_ix);
+    word next_power = (word)1 << bit_count;
+    /* Only a preset entry (or a single byte) can have a preset
+     * entry extending it, so words from first_preset up only
+     * need looking up in dict. */
+    word first_preset = start->count ? LZW_FIRST + start->count : 0;
+    /* The dictionary maps each word we know about, plus one
+     * more byte, to the code number of the longer word. The
+     * single-byte words are implicit: the code number of a
+     * byte is just the byte itself, so they don't need to be
+     * in the table at all. */
+    /* the code number of the word we're currently in */
+    word dict_cur = next_byte;
+
+    /* We keep track of the compression ratio over each
+     * CHECK_INTERVAL bytes of input (as a fixed-point number,
+     * 256 meaning 1). If we're outright expanding the input,
+     * we stop and let encode_codes store it instead.
+     * A full dictionary can also go stale if the input changes
+     * character, and then it's dead weight. So while it's full,
+     * when the ratio gets noticeably worse than the best we've
+     * seen, we clear the dictionary and start over. (If we
+     * can't store, we also start over when we're expanding the
+     * input: a fresh dictionary can't do much worse, and
+     * otherwise we'd be stuck with a dictionary full of junk,
+     * if, say, we filled it on random data, for as long as it
+     * kept improving on its own bad start.)
+     * position is how far into the input data[0] is, and
+     * window_start is where the current window began. */
+    word position = 0, window_start = 0, window_out = 0, best_ratio = 0;
+
+    /* Work through the input a bufferful at a time. */
+    const byte *data;
+    size_t avail;
+    while ((avail = peek_bytes(in, 1, &data))) {
+        for (size_t i = 0; i < avail; i++) {
+            next_byte = data[i];
+            if (dict_cur < first_preset) {
+                word key = codetable_key(&start->table, dict_cur, next_byte);
+                codetable_slot *preset = codetable_probe(&start->table, key);
+                if (preset->key == key) {
+                    dict_cur = preset->code;
+                    continue;
+                }
+            }
+            word key = codetable_key(dict, dict_cur, next_byte);
+            codetable_slot *next = codetable_probe(dict, key);
+            if (next->key == key) {
+                /* If we're still in a prefix of a data word that's
+                 * already in the dictionary, just continue down. */
+                dict_cur = next->code;
+                continue;
+            }
             /* But if appending the next symbol produces an unknown
              * word, write the code number for the word we had
              * before the append... */
-            write_bits(&bo, bit_count, dict_cur->ix);
-            /* ...make a new node for the unknown word, assigning
-             * it the next index... */
-            max_ix++;
-            if (max_ix >= next_power) {
-                /* (start using more bits per code number if necessary) */
-                next_power <<= 1;
-                bit_count++;
+            window_out += write_code(bo, start, max_ix, bit_count, dict_cur);
+            if (max_ix < max_code) {
+                /* ...add the unknown word to the dictionary,
+                 * assigning it the next index... */
+                max_ix++;
+                if (max_ix >= next_power) {
+                    /* (start using more bits per code number if necessary) */
+                    next_power <<= 1;
+                    bit_count++;
+                }
+                codetable_fill(dict, next, key, max_ix);
+                if (max_ix == max_code) {
+                    /* (and if that filled it, start a fresh window,
+                     * to see how the full dictionary does) */
+                    window_start = position + i;
+                    window_out = 0;
+                }
+            }
+            /* ...see how we're doing, if it's time... */
+            word window_in = position + i - window_start;
+            if (window_in >= CHECK_INTERVAL) {
+                word ratio = (window_in << 11) / window_out;
+                if (ratio < 256 && storing) {
+                    /* (the decoder takes a clear from a fresh
+                     * dictionary to mean a stored segment, so
+                     * this can't be the first code, but it
+                     * isn't: we just wrote one) */
+                    write_code(bo, start, max_ix, bit_count, LZW_CLEAR);
+                    consume_bytes(in, i);
+                    if (stats) stats->dict_resets++;
+                    return 1;
+                }
+                if (max_ix == max_code) {
+                    if (ratio < 256 || ratio + ratio / 16 < best_ratio) {
+                        write_code(bo, start, max_ix, bit_count, LZW_CLEAR);
+                        codetable_clear(dict);
+                        max_ix = fresh_max_ix(start);
+                        bit_count = lzw_code_bits(max_ix);
+                        next_power = (word)1 << bit_count;
+                        best_ratio = 0;
+                        if (stats) stats->dict_resets++;
+                    }
+                    else if (ratio > best_ratio) best_ratio = ratio;
+                }
+                window_start = position + i;
+                window_out = 0;
             }
-            *next = bytetree_new(max_ix);
             /* ...and then treat the symbol as the first symbol of
              * a new word. */
-            dict_cur = dict_root[next_byte];
+            dict_cur = next_byte;
+        }
+        consume_bytes(in, avail);
+        position += avail;
+        if (stats) {
+            stats->dict_entries = max_ix - LZW_CLEAR;
+            stats->code_bits = bit_count;
+        }
+        /* With --flush-ms, if the input's stalled, we get
+         * everything we've been given so far out to the decoder
+         * with a sync point (see lzw.h), and flush. The word
+         * we're in has to end there, so its entry would be it
+         * plus the next byte, which we don't know yet; it gets
+         * the next code number now, and goes in the dictionary
+         * once we've read that byte. (That might make it a
+         * duplicate of one that's there already, if the word
+         * could have gone on; the decoder adds it regardless,
+         * so we have to use up its code number too.) */
+        if (start->sync && bytes_in_stalled(in)) {
+            window_out += write_code(bo, start, max_ix, bit_count, dict_cur);
+            word entry = 0;
+            if (max_ix < max_code) {
+                entry = ++max_ix;
+                if (max_ix >= next_power) {
+                    next_power <<= 1;
+                    bit_count++;
+                }
+                if (max_ix == max_code) {
+                    window_start = position;
+                    window_out = 0;
+                }
+            }
+            write_code(bo, start, max_ix, bit_count, start->sync);
+            flush_bits(bo);
+            flush_bytes(bo->out);
+            if (stats) stats->syncs++;
+            /* (and if that was the end, it's all written) */
+            if (!read_byte(in, &next_byte)) return 0;
+            position++;
+            if (entry) {
+                word key = codetable_key(dict, dict_cur, next_byte);
+                codetable_slot *slot = codetable_probe(dict, key);
+                if (slot->key != key) codetable_fill(dict, slot, key, entry);
+            }
+            dict_cur = next_byte;
         }
     }
     /* We're at EOF, so whatever known word we're in the middle of
      * is in fact the whole word, so write its code number. */
-    write_bits(&bo, bit_count, dict_cur->ix);
-    /* we're done writing now, so flush any buffered bits */
+    write_code(bo, start, max_ix, bit_count, dict_cur);
+    return 0;
+}
+
+/* Whether the next STORED_PROBE bytes of in (or however many
+ * there are) look like they'd compress, going by how well
+ * they do with a fresh dictionary. This uses dict, which it
+ * leaves empty, and scratch, to hold the compressed sample.
+ * (With sync points, we don't wait for that many, and make do
+ * with whatever's come in.)
+ */
+static int worth_compressing(bytes_in *in, codetable *dict,
+        const dict_start *start, bytes_out *scratch) {
+    const byte *data;
+    size_t avail = peek_bytes(in, start->sync ? 1 : STORED_PROBE, &data);
+    if (avail > STORED_PROBE) avail = STORED_PROBE;
+    bytes_in sample;
+    bytes_in_init_mem(&sample, data, avail);
+    scratch->length = 0;
+    bits_out bo = BITS_OUT(scratch);
+    encode_run(&sample, &bo, dict, start, 0, NULL);
     flush_bits(&bo);
+    bytes_in_free(&sample);
+    codetable_clear(dict);
+    return scratch->length * 256 <= avail * STORED_RESUME;
+}
 
-    /* finally, clean up after ourselves */
-    for (int i = 0; i < 256; i++) {
-        bytetree_free(dict_root[i]);
+/* With sync points, if the input's stalled between stored
+ * segments, write one and flush. The dictionary's fresh, so
+ * there's no word to finish, and it's just the sync code.
+ */
+static void sync_between(bytes_in *in, bits_out *bo, const dict_start *start,
+        stage_stats *stats) {
+    if (!start->sync || !bytes_in_stalled(in)) return;
+    word max_ix = fresh_max_ix(start);
+    write_code(bo, start, max_ix, lzw_code_bits(max_ix), start->sync);
+    flush_bits(bo);
+    flush_bytes(bo->out);
+    if (stats) stats->syncs++;
+}
+
+/* Encode everything left in byte stream in, writing it to bo,
+ * as encode_run does, except that whatever isn't compressing
+ * is stored as it is instead: after encode_run stops, we store
+ * the input a segment at a time (see lzw.h) until it looks
+ * like it'll compress again, and then hand it back to
+ * encode_run, and so on. This doesn't write the header or
+ * flush bo; the callers below take care of that.
+ */
+static void encode_codes(bytes_in *in, bits_out *bo, codetable *dict,
+        const dict_start *start, stage_stats *stats) {
+    /* (only allocated once we need it) */
+    bytes_out scratch = {.buffer = NULL};
+    /* With sync points, we can't wait for a whole segment's worth
+     * of input before storing it, so a segment is whatever
+     * there is. */
+    size_t wanted = start->sync ? 1 : STORED_SEGMENT;
+    while (encode_run(in, bo, dict, start, 1, stats)) {
+        codetable_clear(dict);
+        if (!scratch.buffer) bytes_out_init_mem(&scratch, STORED_PROBE);
+        const byte *data;
+        size_t avail;
+        do {
+            sync_between(in, bo, start, stats);
+            avail = peek_bytes(in, wanted, &data);
+            if (!avail) break;
+            if (avail > STORED_SEGMENT) avail = STORED_SEGMENT;
+            /* a clear to a fresh dictionary, then padding out
+             * to a whole byte, the length, and the data */
+            word max_ix = fresh_max_ix(start);
+            write_code(bo, start, max_ix, lzw_code_bits(max_ix), LZW_CLEAR);
+            flush_bits(bo);
+            byte length[4];
+            lzw_put32(length, avail);
+            write_bytes(bo->out, length, 4);
+            write_bytes(bo->out, data, avail);
+            consume_bytes(in, avail);
+            if (stats) stats->stored += avail;
+            sync_between(in, bo, start, stats);
+        } while (!worth_compressing(in, dict, start, &scratch));
+        if (!avail) break;
+    }
+    if (scratch.buffer) bytes_out_free(&scratch);
+}
+
+/* A block of input for a worker to compress, and then (once
+ * it's been compressed) the result. Blocks come from a slab
+ * (see slab.h), with room after them for a copy of the input,
+ * if it isn't in memory; each keeps its output buffer from one
+ * use to the next, too. */
+typedef struct encode_block {
+    pool_task task;
+    /* the slab to put it back in */
+    slab *from;
+    const byte *input;
+    size_t length;
+    bytes_out output;
+    /* a dictionary per worker; setting up a fresh one for every
+     * block (and growing it as it fills) costs more than just
+     * clearing out the last one */
+    codetable *dicts;
+    const dict_start *start;
+    /* with --stats, what became of this block's dictionary */
+    byte count_stats;
+    stage_stats stats;
+} encode_block;
+
+static void run_encode_block(pool_task *t, size_t worker) {
+    encode_block *b = (encode_block *)t;
+    codetable *dict = &b->dicts[worker];
+    codetable_clear(dict);
+    bytes_in bi;
+    bytes_in_init_mem(&bi, b->input, b->length);
+    /* (a block fresh from the slab is all zeroes) */
+    if (!b->output.buffer) {
+        bytes_out_init_mem(&b->output, b->length / 2 + BYTES_BUFFER_SIZE);
+    }
+    b->output.length = 0;
+    bits_out bo = BITS_OUT(&b->output);
+    b->stats = (stage_stats){0};
+    encode_codes(&bi, &bo, dict, b->start, b->count_stats ? &b->stats : NULL);
+    flush_bits(&bo);
+    bytes_in_free(&bi);
+}
+
+static void drop_encode_block(void *block) {
+    free(((encode_block *)block)->output.buffer);
+}
+
+/* What next_encode_block needs to know. */
+typedef struct encode_source {
+    bytes_in *in;
+    codetable *dicts;
+    const dict_start *start;
+    slab blocks;
+    size_t block_size;
+    byte count_stats;
+} encode_source;
+
+/* Read the next block of input, if there's any left. */
+static pool_task *next_encode_block(void *source) {
+    encode_source *src = source;
+    encode_block *b = slab_get(&src->blocks);
+    b->from = &src->blocks;
+    b->dicts = src->dicts;
+    b->start = src->start;
+    b->count_stats = src->count_stats;
+    b->length = take_bytes_into(src->in, src->block_size, &b->input,
+            (byte *)(b + 1));
+    if (!b->length) {
+        slab_put(b->from, b);
+        return NULL;
+    }
+    b->task.run = run_encode_block;
+    return &b->task;
+}
+
+/* Write out length bytes of input, compressed to packed, as a
+ * frame (see lzw.h), checksum and all if check is set. */
+static void write_frame(bytes_out *out, size_t length,
+        const bytes_out *packed, byte check) {
+    byte header[LZW_FRAME_HEADER + LZW_FRAME_CHECK];
+    lzw_put32(header, length);
+    lzw_put32(header + 4, packed->length);
+    size_t size = LZW_FRAME_HEADER;
+    if (check) {
+        uint32_t crc = crc32c(0, header, LZW_FRAME_HEADER);
+        lzw_put32(header + size, crc32c(crc, packed->buffer, packed->length));
+        size += LZW_FRAME_CHECK;
+    }
+    write_bytes(out, header, size);
+    write_bytes(out, packed->buffer, packed->length);
+}
+
+/* And what finish_encode_block needs. */
+typedef struct encode_sink {
+    bytes_out *out;
+    byte check;
+} encode_sink;
+
+/* Write out a compressed block as a frame. */
+static void finish_encode_block(pool_task *t, void *sink_) {
+    encode_block *b = (encode_block *)t;
+    encode_sink *sink = sink_;
+    bytes_out *out = sink->out;
+    if (out->stats) {
+        out->stats->blocks++;
+        out->stats->dict_entries = b->stats.dict_entries;
+        out->stats->code_bits = b->stats.code_bits;
+        out->stats->dict_resets += b->stats.dict_resets;
+        out->stats->stored += b->stats.stored;
+    }
+    write_frame(out, b->length, &b->output, sink->check);
+    slab_put(b->from, b);
+}
+
+/* With o->records: compress each record of the input (see
+ * lzw.h) by itself, as a frame. Records are usually small, so
+ * what matters is the cost per record, not per byte; so
+ * there's no handing them out to workers, and nothing is set
+ * up or torn down per record. The dictionary is cleared in
+ * place (which is nearly free; see codetable.h), a record that
+ * fits in in's buffer is compressed right out of it, and the
+ * compressed record goes in a buffer that we keep reusing.
+ * Input that isn't records after all gets as far as the last
+ * whole record before we give up on it (see stage_fail).
+ */
+static void encode_records(bytes_in *in, bytes_out *out, dict_start *start,
+        const options *o) {
+    codetable dict;
+    codetable_init(&dict);
+    bytes_out packed;
+    bytes_out_init_mem(&packed, BYTES_BUFFER_SIZE);
+    byte header[4];
+    size_t got;
+    while ((got = read_bytes(in, header, 4))) {
+        if (got < 4) {
+            stage_complain(o->error, "lzw_encode: input ends partway "
+                    "through a record's length\n");
+            break;
+        }
+        size_t length = lzw_get32(header);
+        if (length > LZW_MAX_RECORD) {
+            stage_fail(o->error, 3, "lzw_encode: a record of %zu bytes "
+                    "is too long (the most is %ju); is the input records?\n",
+                    length, (uintmax_t)LZW_MAX_RECORD);
+            break;
+        }
+        const byte *data;
+        byte *owned = NULL;
+        byte taken = 0;
+        got = peek_bytes(in, length, &data);
+        /* (too big for the buffer, or cut short) */
+        if (got < length) {
+            got = take_bytes(in, length, &data, &owned);
+            taken = 1;
+        }
+        if (got < length) {
+            stage_complain(o->error, "lzw_encode: input ends partway "
+                    "through a record\n");
+            length = got;
+        }
+
+        bytes_in record;
+        bytes_in_init_mem(&record, data, length);
+        packed.length = 0;
+        bits_out bo = BITS_OUT(&packed);
+        codetable_clear(&dict);
+        encode_codes(&record, &bo, &dict, start, out->stats);
+        flush_bits(&bo);
+        bytes_in_free(&record);
+        if (taken) free(owned);
+        else consume_bytes(in, length);
+
+        write_frame(out, length, &packed, o->check);
+        if (out->stats) out->stats->blocks++;
     }
+    bytes_out_free(&packed);
+    codetable_free(&dict);
 }
 
+/* Perform LZW encoding, reading from byte stream in and
+ * writing to byte stream out, with settings o.
+ * With o->block_size set, the input is cut into blocks of
+ * that size, which are compressed on a pool of worker threads
+ * and written out in order as they finish. A couple of blocks
+ * per worker are allowed in flight, so that the workers always
+ * have the next one ready while we wait on the oldest.
+ * With o->records set, the input is records, and each is
+ * compressed by itself (see encode_records).
+ * With o->dict set, every dictionary starts out with that
+ * preset dictionary's entries.
+ * With o->check set, as well as either of the first two,
+ * every frame gets a checksum.
+ * With o->flush set, and neither of the first two, the
+ * output has sync points (see lzw.h) wherever the input
+ * stalls.
+ * With o->phased set, code numbers are phased in (see
+ * lzw.h).
+ */
+void lzw_encode(bytes_in *in, bytes_out *out, const options *o) {
+    /* empty input gets empty output, not even a header */
+    const byte *data;
+    if (!peek_bytes(in, 1, &data)) return;
+
+    /* (only a single run of code numbers needs sync points; see
+     * lzw.h) */
+    byte syncs = o->flush && !o->block_size && !o->records;
+    dict_start start = {.count = 0, .sync = 0, .max_bits = o->max_bits,
+        .phased = o->phased};
+    lzw_dict preset;
+    if (o->dict) {
+        if (!lzw_dict_open(&preset, o->dict, o->error)) return;
+        /* (leaving room for at least one entry of our own) */
+        if (LZW_CLEAR + preset.count + syncs
+                >= ((word)1 << o->max_bits) - 1) {
+            stage_fail(o->error, 2, "lzw_encode: %s has too many entries "
+                    "for --max-bits %d\n", o->dict, o->max_bits);
+            lzw_dict_close(&preset);
+            return;
+        }
+        codetable_init(&start.table);
+        for (word i = 0; i < preset.count; i++) {
+            word key = codetable_key(&start.table, lzw_dict_prev(&preset, i),
+                    lzw_dict_last(&preset, i));
+            codetable_fill(&start.table, codetable_probe(&start.table, key),
+                    key, LZW_FIRST + i);
+        }
+        start.count = preset.count;
+    }
+    if (syncs) start.sync = LZW_FIRST + start.count;
+
+    /* Before any code numbers, the header (see lzw.h). */
+    write_byte(out, o->max_bits);
+    write_byte(out, LZW_STORED | (syncs ? LZW_SYNCS : 0)
+            | (o->phased ? LZW_PHASED : 0)
+            | (o->block_size ? LZW_BLOCKS : 0)
+            | (o->dict ? LZW_PRESET : 0)
+            | (o->records ? LZW_RECORDS : 0)
+            | (o->check && (o->block_size || o->records)
+                ? LZW_CHECKED : 0));
+    if (o->dict) {
+        byte id[4];
+        lzw_put32(id, preset.id);
+        write_bytes(out, id, 4);
+        lzw_dict_close(&preset);
+    }
+
+    if (o->records) {
+        encode_records(in, out, &start, o);
+        if (o->dict) codetable_free(&start.table);
+        return;
+    }
+
+    if (o->block_size) {
+        encode_source src = {in, malloc(sizeof(codetable) * o->jobs),
+            &start, .block_size = o->block_size, .count_stats = o->stats};
+        encode_sink sink = {out, o->check};
+        for (word i = 0; i < o->jobs; i++) codetable_init(&src.dicts[i]);
+        slab_init(&src.blocks, sizeof(encode_block) + o->block_size
+                + BYTES_SLACK, out->stats);
+        pool p;
+        pool_init(&p, o->jobs);
+        pool_ordered(&p, 2 * o->jobs + 1,
+                next_encode_block, &src, finish_encode_block, &sink);
+        pool_free(&p);
+        slab_free(&src.blocks, drop_encode_block);
+        for (word i = 0; i < o->jobs; i++) codetable_free(&src.dicts[i]);
+        free(src.dicts);
+        if (o->dict) codetable_free(&start.table);
+        return;
+    }
+
+    /* We'll read input a buffer at a time, but since output
+     * is bit-packed, we'll use a bits_out. */
+    bits_out bo = BITS_OUT(out);
+    codetable dict;
+    codetable_init(&dict);
+    encode_codes(in, &bo, &dict, &start, out->stats);
+    /* we're done writing now, so flush any buffered bits */
+    flush_bits(&bo);
+
+    /* finally, clean up after ourselves */
+    codetable_free(&dict);
+    if (o->dict) codetable_free(&start.table);
+}
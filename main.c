@@ -1,39 +1,170 @@
-#include <unistd.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "byte_io.h"
+#include "pool.h"
+#include "options.h"
+#include "pipeline.h"
+#include "lzw.h"
 #include "lzw_encode.h"
 #include "lzw_decode.h"
+#include "huffman.h"
 #include "hamming.h"
+#include "channel.h"
+#include "bench.h"
+#include "train.h"
+#include "verify.h"
 
-/* A "stage" is a given encoding or decoding function:
- * Something that takes two file descriptors and doesn't
- * return anything in particular.
+/* The options that may follow the subcommand, in the form
+ * getopt_long wants them. They're described for humans in
+ * the help message in main(). */
+static const struct option long_options[] = {
+    {"max-bits", required_argument, NULL, 'b'},
+    {"threads", no_argument, NULL, 't'},
+    {"block-size", required_argument, NULL, 'B'},
+    {"dict", required_argument, NULL, 'D'},
+    {"records", no_argument, NULL, 'R'},
+    {"phased", no_argument, NULL, 'P'},
+    {"check", no_argument, NULL, 'C'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"input", required_argument, NULL, 'i'},
+    {"splice", no_argument, NULL, 'Z'},
+    {"flush-ms", required_argument, NULL, 'F'},
+    {"size", required_argument, NULL, 's'},
+    {"error-log2", required_argument, NULL, 'e'},
+    {"burst", required_argument, NULL, 'u'},
+    {"seed", required_argument, NULL, 'S'},
+    {"stats", no_argument, NULL, 'T'},
+    {"wide", no_argument, NULL, 'W'},
+    {NULL, 0, NULL, 0}
+};
+
+/* Parse arg as a number between min and max (inclusive) for
+ * the option called name. Complains and exits if it isn't.
  */
-typedef void (*const stage)(int, int);
+static word number_arg(const char *name, const char *arg,
+        word min, word max) {
+    char *end;
+    word n = strtoumax(arg, &end, 0);
+    if (*arg == '\0' || *end != '\0' || n < min || n > max) {
+        WHINE("--%s wants a number from %ju to %ju, not %s\n",
+                name, (uintmax_t)min, (uintmax_t)max, arg);
+        exit(2);
+    }
+    return n;
+}
 
-/* Given initial input and final output file descriptors
- * and a NULL-terminated array of stages, fork off child
- * processes running stage (except the last one, which
- * runs in the original process), connecting them with
- * pipes.
+/* Fill in opts from the arguments after the subcommand, and
+ * check that they make sense for the stages it runs (NULL for
+ * a tool). Since getopt_long skips the first argument it's
+ * given, we can just hand it everything from the subcommand
+ * onward.
  */
-void pipeline(int in, int out, stage *steps) {
-    for (; *(steps + 1) != NULL; steps++) {
-        int fds[2];
-        pipe(fds);
-        if (!fork()) {
-            close(fds[0]);
-            (*steps)(in, fds[1]);
-            close(in);
-            close(fds[1]);
-            return;
+static void parse_options(int argc, char *argv[], const stage *steps) {
+    int c;
+    while ((c = getopt_long(argc, argv, "b:tB:D:RPCj:i:ZF:s:e:u:S:TW", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'b':
+                opts.max_bits = number_arg("max-bits", optarg,
+                        LZW_MIN_BITS, LZW_MAX_BITS);
+                break;
+            case 't':
+                opts.threads = 1;
+                break;
+            case 'B':
+                opts.block_size = number_arg("block-size", optarg,
+                        LZW_MIN_BLOCK_KIB, LZW_MAX_BLOCK_KIB) << 10;
+                break;
+            case 'D':
+                opts.dict = optarg;
+                break;
+            case 'R':
+                opts.records = 1;
+                break;
+            case 'P':
+                opts.phased = 1;
+                break;
+            case 'C':
+                opts.check = 1;
+                break;
+            case 'j':
+                opts.jobs = number_arg("jobs", optarg, 1, 1024);
+                break;
+            case 'i':
+                opts.input = optarg;
+                break;
+            case 'Z':
+                opts.splice = 1;
+                break;
+            case 'F':
+                opts.flush_ms = number_arg("flush-ms", optarg, 0, 3600000);
+                opts.flush = 1;
+                break;
+            case 's':
+                opts.bench_size = number_arg("size", optarg,
+                        4, (word)1 << 32) << 10;
+                break;
+            case 'e':
+                opts.error_log2 = number_arg("error-log2", optarg, 1, 48);
+                break;
+            case 'u':
+                opts.burst = number_arg("burst", optarg,
+                        1, CHANNEL_MAX_BURST);
+                break;
+            case 'S':
+                opts.seed = number_arg("seed", optarg, 0, UINTMAX_MAX);
+                opts.seeded = 1;
+                break;
+            case 'T':
+                opts.stats = 1;
+                break;
+            case 'W':
+                opts.wide = 1;
+                break;
+            default:
+                /* getopt_long has already complained */
+                exit(2);
         }
-        close(fds[1]);
-        in = fds[0];
     }
-    (*steps)(in, out);
-    close(in);
-    close(out);
+    if (optind < argc) {
+        WHINE("unexpected argument %s\n", argv[optind]);
+        exit(2);
+    }
+    if (opts.records && opts.block_size) {
+        WHINE("--records and --block-size don't go together\n");
+        exit(2);
+    }
+    /* Blocks only go out once they're full, and a wide
+     * codeword only once it has all 8 bytes, so neither can be
+     * flushed early. (Checksums would mean blocks, below.) */
+    if (opts.flush && (opts.block_size || (opts.check && !opts.records))) {
+        WHINE("--flush-ms doesn't go with blocks (--block-size, or "
+                "--check without --records)\n");
+        exit(2);
+    }
+    if (opts.flush && opts.wide) {
+        WHINE("--flush-ms and --wide don't go together\n");
+        exit(2);
+    }
+    /* huff_encode codes whole chunks, so it can't keep sync
+     * points (see huffman.c). It would find that out for itself
+     * when it read the LZW header, but by then the stages before
+     * it are running, and the rest get cut off. */
+    for (; opts.flush && steps && *steps; steps++) {
+        if (*steps == huff_encode) {
+            WHINE("--flush-ms doesn't go with huff_encode (squeeze, pack "
+                    "or huff_id)\n");
+            exit(2);
+        }
+    }
+    /* checksums go on frames, so there have to be some */
+    if (opts.check && !opts.records && !opts.block_size) {
+        opts.block_size = LZW_CHECK_BLOCK_KIB << 10;
+    }
+    if (!opts.jobs) opts.jobs = pool_default_workers();
 }
 
 /* We list the various subcommands in subcommands.h, as calls
@@ -43,22 +174,73 @@ void pipeline(int in, int out, stage *steps) {
  * code that actually runs a pipeline based on the subcommand.
  * To achieve that, we'll just include subcommands.h once in
  * each place, defining SUB differently each time. Here are
- * the two versions of SUB.
+ * the two versions of SUB (and of TOOL, for the subcommands
+ * that aren't pipelines).
  */
 #define SUB_help(c, ...) WHINE(#c ": pipeline of " #__VA_ARGS__ "\n");
 #define SUB_branch(c, ...) else if (!strcmp(argv[1], #c)) {\
     const stage p[] = {__VA_ARGS__, NULL};\
-    pipeline(STDIN_FILENO, STDOUT_FILENO, p);\
+    parse_options(argc - 1, argv + 1, p);\
+    run_pipeline(opts.input ? -1 : STDIN_FILENO, STDOUT_FILENO, p,\
+            #__VA_ARGS__);\
+}
+#define TOOL_help(c, fn, description) WHINE(#c ": " description "\n");
+#define TOOL_branch(c, fn, description) else if (!strcmp(argv[1], #c)) {\
+    parse_options(argc - 1, argv + 1, NULL);\
+    return fn();\
 }
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         WHINE("%s: no subcommand given. Use one of:\n\n", argv[0]);
 #define SUB SUB_help
+#define TOOL TOOL_help
 #include "subcommands.h"
+        WHINE("\nOptions (after the subcommand):\n\n"
+                "-b, --max-bits N: cap LZW code numbers at N bits "
+                "(%d-%d, default %d)\n"
+                "-t, --threads: run the stages on threads in one "
+                "process, instead of one process each\n"
+                "-B, --block-size KIB: compress in independent blocks "
+                "of KIB KiB (%d-%ju), in parallel\n"
+                "-D, --dict PATH: start LZW dictionaries from the preset "
+                "dictionary in PATH (made by train)\n"
+                "-R, --records: compress each of a series of records "
+                "(4-byte little-endian length, then data) by itself\n"
+                "-P, --phased: write LZW code numbers as phased-in codes, "
+                "a bit shorter while the dictionary fills\n"
+                "-C, --check: give each block or record a CRC32C, "
+                "for verify (blocks of %d KiB unless -B)\n"
+                "-W, --wide: error-correct with Hamming(72, 64) "
+                "(12.5%% bigger) instead of Hamming(8, 4) (twice as big)\n"
+                "-j, --jobs N: use N worker threads for blocks and "
+                "for Hamming coding (default: one per CPU)\n"
+                "-i, --input PATH: read PATH (mapped into memory) "
+                "instead of standard input\n"
+                "-Z, --splice: write to pipes with vmsplice, "
+                "which is only safe if the reader reads\n"
+                "-F, --flush-ms MS: flush everything through once "
+                "input has stalled for MS ms (0 for straight away)\n"
+                "-s, --size KIB: have bench (up to %ju) or stress go "
+                "up to KIB KiB of data (4-%ju, default %ju)\n"
+                "-e, --error-log2 N: have channel flip each bit with "
+                "probability 2^-N (1-48, default %d)\n"
+                "-u, --burst BITS: have channel make errors in bursts "
+                "of BITS bits (1-%d, default 1)\n"
+                "-S, --seed N: seed channel's random numbers with N "
+                "(default: a different one each time)\n"
+                "-T, --stats: have each stage report what it's doing "
+                "on standard error, as JSON\n",
+                LZW_MIN_BITS, LZW_MAX_BITS, opts.max_bits,
+                LZW_MIN_BLOCK_KIB, (uintmax_t)LZW_MAX_BLOCK_KIB,
+                LZW_CHECK_BLOCK_KIB,
+                (uintmax_t)1 << 22, (uintmax_t)1 << 32,
+                (uintmax_t)(opts.bench_size >> 10),
+                opts.error_log2, CHANNEL_MAX_BURST);
         return 1;
     }
 #define SUB SUB_branch
+#define TOOL TOOL_branch
 #include "subcommands.h"
     else {
         WHINE("%s: unknown subcommand %s. "
@@ -0,0 +1,13 @@
+#include "options.h"
+
+/* The defaults, for whatever main (or a program using the
+ * library, which gets them as codes_defaults) doesn't change. */
+#define DEFAULTS { \
+    .max_bits = 20, \
+    .error_log2 = 10, \
+    .burst = 1, \
+    .bench_size = (word)16 << 20, \
+}
+
+options opts = DEFAULTS;
+const options codes_defaults = DEFAULTS;
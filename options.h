@@ -0,0 +1,95 @@
+#include "general.h"
+
+/* Settings that can be changed from the command line. main
+ * fills in opts before it starts running any stages, and
+ * hands every stage a pointer to it; a codec (see codec.h)
+ * hands its stage a copy of its own. The stages just read
+ * them.
+ */
+typedef struct options {
+    /* the most bits an LZW code number may take up, which
+     * caps the dictionary at 2^max_bits entries */
+    byte max_bits;
+
+    /* whether to run a pipeline's stages on threads in this
+     * process rather than in processes of their own */
+    byte threads;
+
+    /* if nonzero, lzw_encode compresses the input in blocks of
+     * this many bytes, independently and in parallel */
+    word block_size;
+
+    /* if not NULL, the preset dictionary file (see lzw_dict.h)
+     * for lzw_encode to start from, and for lzw_decode to use
+     * for streams that call for it */
+    const char *dict;
+
+    /* whether lzw_encode should phase in code numbers (see
+     * lzw.h) rather than write them all at the full width */
+    byte phased;
+
+    /* whether lzw_encode's input is length-prefixed records,
+     * to be compressed one by one (see lzw.h) */
+    byte records;
+
+    /* whether lzw_encode should give every frame a checksum
+     * (see lzw.h); without frames (block_size or records),
+     * there's nothing to put them on, so main sees to it that
+     * there are */
+    byte check;
+
+    /* whether hamming_encode should use the wide code,
+     * Hamming(72, 64), instead of Hamming(8, 4) */
+    byte wide;
+
+    /* how many worker threads to compress or decompress
+     * blocks with */
+    word jobs;
+
+    /* if not NULL, the first stage reads this file (mapped into
+     * memory, if possible) instead of standard input */
+    const char *input;
+
+    /* whether to write to pipes with vmsplice */
+    byte splice;
+
+    /* whether stages should flush their output whenever their
+     * input has stalled for flush_ms milliseconds, rather than
+     * only once they have a bufferful (see bytes_in_stalled),
+     * and lzw_encode should put sync points in its output for
+     * lzw_decode to flush at (see lzw.h) */
+    byte flush;
+    word flush_ms;
+
+    /* channel flips each bit with probability 2^-error_log2,
+     * in bursts of burst bits */
+    byte error_log2;
+    byte burst;
+
+    /* the seed for channel's random numbers, if seeded is set
+     * (otherwise it picks one) */
+    word seed;
+    byte seeded;
+
+    /* whether stages should count what they do and report it
+     * (see stats.h) */
+    byte stats;
+
+    /* set to keep stages from reporting what they did on
+     * standard error (the bench tool sets it) */
+    byte quiet;
+
+    /* the biggest amount of data the bench tool generates, in
+     * bytes */
+    word bench_size;
+
+    /* if not NULL, where stages report what's wrong with their
+     * input, instead of complaining on standard error and
+     * exiting (see stage_error in stats.h) */
+    struct stage_error *error;
+} options;
+
+/* (opts is the command line's; the library doesn't export it,
+ * and a program using it starts from codes_defaults instead) */
+extern options opts;
+extern const options codes_defaults;
@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "byte_io.h"
+#include "ring.h"
+#include "options.h"
+#include "stats.h"
+#include "pipeline.h"
+
+/* Split names, the stages' names as subcommands.h lists them
+ * ("lzw_encode, hamming_encode"), into one string per stage,
+ * for --stats to call them by. It all comes in one allocation,
+ * to free when we're done. If names is NULL, they're just
+ * called "stage".
+ */
+static const char **split_names(const char *names, size_t count) {
+    if (!names) names = "";
+    const char **list = malloc(sizeof(char *) * count + strlen(names) + 1);
+    char *copy = strcpy((char *)(list + count), names);
+    for (size_t i = 0; i < count; i++) {
+        list[i] = *copy ? copy : "stage";
+        copy += strcspn(copy, ",");
+        if (*copy) *copy++ = '\0';
+        copy += strspn(copy, " ");
+    }
+    return list;
+}
+
+/* Run step on the streams it's been given, and flush what it
+ * wrote. With --stats, that's where the counting happens.
+ * (With --flush-ms, what it's written is flushed along the way
+ * too.)
+ */
+static void run_step(stage step, const char *name,
+        bytes_in *bi, bytes_out *bo) {
+    if (opts.flush) bytes_in_flush_to(bi, bo, opts.flush_ms);
+    if (!opts.stats) {
+        step(bi, bo, &opts);
+        flush_bytes(bo);
+        return;
+    }
+    stage_stats s;
+    stats_init(&s, name);
+    if (bytes_in_memory(bi)) s.memory_in = bi;
+    bi->stats = bo->stats = &s;
+    step(bi, bo, &opts);
+    flush_bytes(bo);
+    bi->stats = bo->stats = NULL;
+    stats_report(&s, 1);
+}
+
+/* Run a single stage from file descriptor in to file
+ * descriptor out, taking care of the buffering on both
+ * ends, then close both.
+ */
+static void run_stage(stage step, const char *name, int in, int out) {
+    bytes_in bi;
+    bytes_out bo;
+    /* in is -1 for the first stage when there's an --input
+     * file to read instead */
+    if (in < 0) bytes_in_init_file(&bi, opts.input);
+    else bytes_in_init(&bi, in);
+    bytes_out_init(&bo, out);
+    if (opts.splice) bytes_out_splice(&bo);
+    run_step(step, name, &bi, &bo);
+    bytes_in_free(&bi);
+    bytes_out_free(&bo);
+    /* (bi.in rather than in, which might be -1: if the --input
+     * file couldn't be mapped, it's being read from a file
+     * descriptor of its own) */
+    close(bi.in);
+    close(out);
+}
+
+/* Given initial input and final output file descriptors
+ * and a NULL-terminated array of stages, fork off child
+ * processes running stage (except the last one, which
+ * runs in the original process), connecting them with
+ * pipes. Returns once they've all finished.
+ */
+void pipeline(int in, int out, stage *steps, const char *names) {
+    size_t count = 0;
+    while (steps[count]) count++;
+    const char **name = split_names(names, count), **first = name;
+    for (; *(steps + 1) != NULL; steps++, name++) {
+        int fds[2];
+        pipe(fds);
+        enlarge_pipe(fds[1]);
+        if (!fork()) {
+            close(fds[0]);
+            run_stage(*steps, *name, in, fds[1]);
+            exit(0);
+        }
+        close(fds[1]);
+        in = fds[0];
+    }
+    run_stage(*steps, *name, in, out);
+    free(first);
+    /* The other stages are done writing by now, but they might
+     * not have quite finished exiting, and whoever's measuring
+     * us (see bench.c) wants them counted. If one of them gave
+     * up (on input it couldn't make sense of, say), the stages
+     * after it only saw their input stop short, so its exit
+     * status is the pipeline's, as it would be on the thread
+     * version. */
+    int status, failed = 0;
+    while (wait(&status) > 0) {
+        if (!failed && WIFEXITED(status)) failed = WEXITSTATUS(status);
+    }
+    if (failed) exit(failed);
+}
+
+/* What one thread of pipeline_threads needs to know: its
+ * stage, and where its input and output come from and go to
+ * (a ring, or if that's NULL, a file descriptor).
+ */
+typedef struct stage_thread {
+    void (*step)(bytes_in *, bytes_out *, const options *);
+    const char *name;
+    int in, out;
+    ring *from, *to;
+    pthread_t thread;
+} stage_thread;
+
+static void *run_stage_thread(void *arg) {
+    stage_thread *t = arg;
+    bytes_in bi;
+    bytes_out bo;
+    if (t->from) bytes_in_init_ring(&bi, t->from);
+    else if (t->in < 0) bytes_in_init_file(&bi, opts.input);
+    else bytes_in_init(&bi, t->in);
+    if (t->to) bytes_out_init_ring(&bo, t->to);
+    else {
+        bytes_out_init(&bo, t->out);
+        if (opts.splice) bytes_out_splice(&bo);
+    }
+    run_step(t->step, t->name, &bi, &bo);
+    if (t->to) ring_close(t->to);
+    bytes_in_free(&bi);
+    bytes_out_free(&bo);
+    if (!t->from && t->in < 0) close(bi.in);
+    return NULL;
+}
+
+/* The same as pipeline, but with each stage on a thread of
+ * its own (except the last, which runs on this one) and rings
+ * between them instead of pipes. A pipe costs a syscall on
+ * each end and a copy into and out of the kernel for every
+ * bufferful; with a ring, one stage writes its output right
+ * into it and the next reads it from there, so nothing is
+ * copied at all, and the threads only need the kernel when
+ * one of them has to wait for the other.
+ */
+void pipeline_threads(int in, int out, stage *steps, const char *names) {
+    size_t count = 0;
+    while (steps[count]) count++;
+    const char **name = split_names(names, count);
+    stage_thread *threads = malloc(sizeof(stage_thread) * count);
+    /* (one more ring than we need, so that this is never 0
+     * bytes; rings want to be cache-line aligned) */
+    ring *rings = aligned_alloc(64, sizeof(ring) * count);
+    for (size_t i = 0; i < count; i++) {
+        threads[i] = (stage_thread){steps[i], name[i], in, out,
+            i ? &rings[i - 1] : NULL, i + 1 < count ? &rings[i] : NULL};
+        if (i + 1 < count && !ring_init(&rings[i])) {
+            WHINE("couldn't map a ring between stages\n");
+            exit(4);
+        }
+    }
+    for (size_t i = 0; i + 1 < count; i++) {
+        pthread_create(&threads[i].thread, NULL, run_stage_thread, &threads[i]);
+    }
+    run_stage_thread(&threads[count - 1]);
+    for (size_t i = 0; i + 1 < count; i++) {
+        pthread_join(threads[i].thread, NULL);
+        ring_free(&rings[i]);
+    }
+    free(threads);
+    free(rings);
+    free(name);
+}
+
+/* Run steps with whichever of the above opts asks for.
+ */
+void run_pipeline(int in, int out, stage *steps, const char *names) {
+    (opts.threads ? pipeline_threads : pipeline)(in, out, steps, names);
+}
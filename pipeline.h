@@ -0,0 +1,18 @@
+#include "general.h"
+
+/* Running stages (the functions in the subcommand list) from
+ * one file descriptor to another; include byte_io.h first. */
+
+/* A "stage" is a given encoding or decoding function:
+ * Something that takes an input and an output byte stream,
+ * and the settings to go by (see options.h), and doesn't
+ * return anything in particular.
+ */
+struct options;
+typedef void (*const stage)(bytes_in *, bytes_out *, const struct options *);
+
+/* Each of these takes the stages' names too, as a string like
+ * "lzw_encode, hamming_encode" (or NULL), for --stats. */
+void pipeline(int in, int out, stage *steps, const char *names);
+void pipeline_threads(int in, int out, stage *steps, const char *names);
+void run_pipeline(int in, int out, stage *steps, const char *names);
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/* Take a task for worker self to run, or return NULL if there
+ * aren't any. Worker self's own queue comes first, from the
+ * front; after that we steal from the back of everyone else's.
+ */
+static pool_task *take_task(pool *p, size_t self) {
+    for (size_t k = 0; k < p->workers; k++) {
+        pool_queue *q = &p->queues[(self + k) % p->workers];
+        pool_task *t = NULL;
+        pthread_mutex_lock(&q->lock);
+        if (q->length) {
+            if (!k) {
+                t = q->tasks[q->front];
+                q->front = (q->front + 1) % q->capacity;
+            }
+            else t = q->tasks[(q->front + q->length - 1) % q->capacity];
+            q->length--;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (t) {
+            pthread_mutex_lock(&p->lock);
+            p->pending--;
+            pthread_mutex_unlock(&p->lock);
+            return t;
+        }
+    }
+    return NULL;
+}
+
+typedef struct worker_arg {
+    pool *p;
+    size_t self;
+} worker_arg;
+
+static void *worker(void *arg_) {
+    worker_arg *arg = arg_;
+    pool *p = arg->p;
+    size_t self = arg->self;
+    free(arg);
+    for (;;) {
+        pool_task *t = take_task(p, self);
+        if (t) {
+            t->run(t, self);
+            pthread_mutex_lock(&p->lock);
+            atomic_store(&t->done, 1);
+            pthread_cond_broadcast(&p->finished);
+            pthread_mutex_unlock(&p->lock);
+            continue;
+        }
+        /* nothing to do, so sleep until there is (pending can
+         * be nonzero with nothing left for us if another
+         * worker is about to take it, which just means we go
+         * round again) */
+        pthread_mutex_lock(&p->lock);
+        while (!p->pending && !p->stop) {
+            pthread_cond_wait(&p->work, &p->lock);
+        }
+        byte stop = p->stop && !p->pending;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) return NULL;
+    }
+}
+
+/* Start a pool of that many worker threads.
+ */
+void pool_init(pool *p, size_t workers) {
+    p->workers = workers;
+    p->threads = malloc(sizeof(pthread_t) * workers);
+    p->queues = malloc(sizeof(pool_queue) * workers);
+    p->deal = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->finished, NULL);
+    p->pending = 0;
+    p->stop = 0;
+    for (size_t i = 0; i < workers; i++) {
+        pool_queue *q = &p->queues[i];
+        pthread_mutex_init(&q->lock, NULL);
+        q->capacity = 16;
+        q->tasks = malloc(sizeof(pool_task *) * q->capacity);
+        q->front = q->length = 0;
+    }
+    for (size_t i = 0; i < workers; i++) {
+        worker_arg *arg = malloc(sizeof(worker_arg));
+        *arg = (worker_arg){p, i};
+        pthread_create(&p->threads[i], NULL, worker, arg);
+    }
+}
+
+/* Let the workers finish whatever's been submitted, then
+ * stop them and clean up.
+ */
+void pool_free(pool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (size_t i = 0; i < p->workers; i++) {
+        pthread_join(p->threads[i], NULL);
+        pthread_mutex_destroy(&p->queues[i].lock);
+        free(p->queues[i].tasks);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->finished);
+    free(p->threads);
+    free(p->queues);
+}
+
+/* Queue t to be run by one of the workers.
+ */
+void pool_submit(pool *p, pool_task *t) {
+    atomic_init(&t->done, 0);
+    pthread_mutex_lock(&p->lock);
+    pool_queue *q = &p->queues[p->deal++ % p->workers];
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_mutex_lock(&q->lock);
+    if (q->length == q->capacity) {
+        /* unwrap into a bigger array */
+        pool_task **tasks = malloc(sizeof(pool_task *) * q->capacity * 2);
+        for (size_t i = 0; i < q->length; i++) {
+            tasks[i] = q->tasks[(q->front + i) % q->capacity];
+        }
+        free(q->tasks);
+        q->tasks = tasks;
+        q->front = 0;
+        q->capacity *= 2;
+    }
+    q->tasks[(q->front + q->length++) % q->capacity] = t;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&p->lock);
+    p->pending++;
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Block until t (which must have been submitted) is done.
+ */
+void pool_wait(pool *p, pool_task *t) {
+    if (atomic_load(&t->done)) return;
+    pthread_mutex_lock(&p->lock);
+    while (!atomic_load(&t->done)) {
+        pthread_cond_wait(&p->finished, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Run a stream of tasks through the pool, but finish them in
+ * order. next makes the next task (or returns NULL when there
+ * aren't any more), and finish is called on each task once
+ * it's done, in the same order next made them—which is where
+ * to write out results and free the task. At most window
+ * tasks are in flight at once, so if each one holds a bounded
+ * amount of memory, so does the whole stream, however long it
+ * is. source and sink are passed along to next and finish
+ * respectively.
+ */
+void pool_ordered(pool *p, size_t window,
+        pool_task *(*next)(void *source), void *source,
+        void (*finish)(pool_task *t, void *sink), void *sink) {
+    pool_task **flight = malloc(sizeof(pool_task *) * window);
+    size_t oldest = 0, count = 0;
+    byte more = 1;
+    for (;;) {
+        while (more && count < window) {
+            pool_task *t = next(source);
+            if (!t) {
+                more = 0;
+                break;
+            }
+            pool_submit(p, t);
+            flight[(oldest + count++) % window] = t;
+        }
+        if (!count) break;
+        pool_wait(p, flight[oldest]);
+        finish(flight[oldest], sink);
+        oldest = (oldest + 1) % window;
+        count--;
+    }
+    free(flight);
+}
+
+/* One worker per online CPU.
+ */
+size_t pool_default_workers(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
@@ -0,0 +1,61 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "general.h"
+
+/* One unit of work for a pool. Embed this as the first member
+ * of a struct holding whatever the work needs, fill in run,
+ * and hand it to pool_submit; run gets called (on some thread)
+ * with a pointer to it, which it can cast back to the bigger
+ * struct, and the number of the worker running it (from 0 up
+ * to the pool's workers), for tasks that want some scratch
+ * space to reuse from one task to the next.
+ */
+typedef struct pool_task {
+    void (*run)(struct pool_task *, size_t worker);
+    atomic_bool done;
+} pool_task;
+
+/* Each worker has a queue of its own, a growable circular
+ * array of tasks. The owner takes tasks from the front and
+ * thieves take them from the back, so the owner works through
+ * its tasks roughly in the order they were submitted while
+ * thieves take the ones it would get to last.
+ */
+typedef struct pool_queue {
+    pthread_mutex_t lock;
+    pool_task **tasks;
+    size_t front, length, capacity;
+} pool_queue;
+
+/* A fixed set of worker threads sharing out tasks by work
+ * stealing: pool_submit deals tasks out to the workers' queues
+ * in turn, and a worker whose queue is empty takes from the
+ * others' before it goes to sleep.
+ */
+typedef struct pool {
+    size_t workers;
+    pthread_t *threads;
+    pool_queue *queues;
+    /* which queue pool_submit deals to next */
+    size_t deal;
+
+    /* lock protects pending and stop, and goes with both
+     * condition variables: work is signaled when a task is
+     * submitted (or the pool is stopping), and finished when
+     * a task is done */
+    pthread_mutex_t lock;
+    pthread_cond_t work, finished;
+    /* how many tasks are queued but not yet taken */
+    size_t pending;
+    byte stop;
+} pool;
+
+void pool_init(pool *p, size_t workers);
+void pool_free(pool *p);
+void pool_submit(pool *p, pool_task *t);
+void pool_wait(pool *p, pool_task *t);
+void pool_ordered(pool *p, size_t window,
+        pool_task *(*next)(void *source), void *source,
+        void (*finish)(pool_task *t, void *sink), void *sink);
+size_t pool_default_workers(void);
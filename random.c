@@ -0,0 +1,33 @@
+#include "random.h"
+
+/* Fill in the state from a single number. xoshiro's state
+ * mustn't be all zeros, and similar seeds shouldn't give
+ * similar streams, so we spread the seed out with splitmix64
+ * (as the authors recommend) rather than using it directly.
+ */
+void rng_seed(rng *r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15);
+        z = (z ^ z >> 30) * 0xBF58476D1CE4E5B9;
+        z = (z ^ z >> 27) * 0x94D049BB133111EB;
+        r->s[i] = z ^ z >> 31;
+    }
+}
+
+/* A uniformly distributed number in [0, 1). (The top 53 bits
+ * are as many as a double can hold.) */
+double rng_double(rng *r) {
+    return (rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+/* A uniformly distributed number in [0, n), for n > 0. Just
+ * taking the remainder would make the low numbers slightly
+ * more likely whenever n doesn't divide 2^64, so we throw away
+ * the (few) draws below 2^64 mod n, which leaves a whole
+ * number of copies of [0, n) to take the remainder of.
+ */
+uint64_t rng_below(rng *r, uint64_t n) {
+    uint64_t threshold = -n % n, x;
+    while ((x = rng_next(r)) < threshold);
+    return x % n;
+}
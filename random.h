@@ -0,0 +1,34 @@
+#include "general.h"
+
+/* A small, fast pseudorandom number generator (xoshiro256**,
+ * by David Blackman and Sebastiano Vigna), for making up test
+ * data and noise. It's nowhere near good enough for anything to
+ * do with security, but it's statistically sound and takes a
+ * couple of nanoseconds per 64 bits, and the same seed always
+ * gives the same numbers, on any machine.
+ */
+typedef struct rng {
+    uint64_t s[4];
+} rng;
+
+void rng_seed(rng *r, uint64_t seed);
+double rng_double(rng *r);
+uint64_t rng_below(rng *r, uint64_t n);
+
+static inline uint64_t rng_rotl(uint64_t x, int k) {
+    return x << k | x >> (64 - k);
+}
+
+/* The next 64 random bits. */
+static inline uint64_t rng_next(rng *r) {
+    uint64_t *s = r->s,
+             result = rng_rotl(s[1] * 5, 7) * 9,
+             t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+/* Set up an empty ring. Returns 1, or 0 if we couldn't get the
+ * memory for it (in which case there's nothing to free).
+ * The buffer is a memory-only file, so that we can map it
+ * twice (see ring.h): we set aside room for both copies first,
+ * then map the file over each half of it.
+ */
+int ring_init(ring *r) {
+    r->capacity = RING_SIZE;
+    int fd = memfd_create("ring", 0);
+    if (fd < 0) return 0;
+    byte *map = mmap(NULL, 2 * r->capacity, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int mapped = map != MAP_FAILED && !ftruncate(fd, r->capacity)
+        && mmap(map, r->capacity, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED
+        && mmap(map + r->capacity, r->capacity, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+    /* (the mappings keep the file alive) */
+    close(fd);
+    if (!mapped) {
+        if (map != MAP_FAILED) munmap(map, 2 * r->capacity);
+        return 0;
+    }
+    r->buffer = map;
+    atomic_init(&r->sleepers, 0);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    r->waits = r;
+    ring_reset(r);
+    return 1;
+}
+
+/* Empty r out and make it good as new, for another producer
+ * and consumer. Nobody may be using either end. */
+void ring_reset(ring *r) {
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->closed, 0);
+    atomic_init(&r->abandoned, 0);
+}
+
+void ring_free(ring *r) {
+    munmap(r->buffer, 2 * r->capacity);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+}
+
+/* Block until the other end has moved head or tail away from
+ * the values we last saw, or has closed or abandoned the ring.
+ * We announce that we're asleep before checking one last time,
+ * and the other end moves first and checks for sleepers
+ * second (both sequentially consistent, so neither can be
+ * reordered past the other), which means that either we see
+ * its move or it sees us and wakes us up.
+ */
+static void ring_sleep(ring *r, size_t head, size_t tail) {
+    ring *w = r->waits;
+    pthread_mutex_lock(&w->lock);
+    atomic_fetch_add(&w->sleepers, 1);
+    while (atomic_load(&r->head) == head && atomic_load(&r->tail) == tail
+            && !atomic_load(&r->closed) && !atomic_load(&r->abandoned)) {
+        pthread_cond_wait(&w->wake, &w->lock);
+    }
+    atomic_fetch_sub(&w->sleepers, 1);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Wake the other end if it's asleep. In the common case, it
+ * isn't, and this is just a load.
+ */
+static void ring_wake(ring *r) {
+    ring *w = r->waits;
+    if (atomic_load(&w->sleepers)) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_broadcast(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/* For the producer: wait until there's room for count more
+ * bytes (which should be no more than the capacity), and
+ * return where they go. Once they're written, ring_commit
+ * hands them over. If the consumer's abandoned the ring, this
+ * doesn't wait: the room it hands out is somewhere to write
+ * what will only be thrown away.
+ */
+byte *ring_reserve(ring *r, size_t count) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    while (!atomic_load_explicit(&r->abandoned, memory_order_relaxed)) {
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (r->capacity - (head - tail) >= count) break;
+        ring_sleep(r, head, tail);
+    }
+    return r->buffer + (head & (r->capacity - 1));
+}
+
+/* Hand over count bytes written into reserved room. The
+ * consumer sees everything committed at once, so the fewer and
+ * bigger the commits, the less the two threads have to talk.
+ */
+void ring_commit(ring *r, size_t count) {
+    if (!count || atomic_load_explicit(&r->abandoned, memory_order_relaxed)) {
+        return;
+    }
+    atomic_store(&r->head,
+            atomic_load_explicit(&r->head, memory_order_relaxed) + count);
+    ring_wake(r);
+}
+
+/* For the consumer, which has looked at (but not consumed) have
+ * bytes so far: wait until there are more than that, and
+ * return how many there are, setting *data to point at them.
+ * That's only have or fewer once the producer has closed the
+ * ring and there's nothing more to come. The bytes stay put
+ * until they're consumed.
+ */
+size_t ring_peek(ring *r, size_t have, const byte **data) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed),
+           head;
+    for (;;) {
+        head = atomic_load(&r->head);
+        if (head - tail > have) break;
+        if (atomic_load(&r->closed)) {
+            /* the producer sets closed after its last commit,
+             * so if there was one, head shows it now */
+            head = atomic_load(&r->head);
+            break;
+        }
+        ring_sleep(r, head, tail);
+    }
+    *data = r->buffer + (tail & (r->capacity - 1));
+    return head - tail;
+}
+
+/* Give back the room of the first count peeked bytes. */
+void ring_consume(ring *r, size_t count) {
+    if (!count) return;
+    atomic_store(&r->tail,
+            atomic_load_explicit(&r->tail, memory_order_relaxed) + count);
+    ring_wake(r);
+}
+
+/* ring_reserve and ring_peek, but without waiting: these
+ * return how much room (or how many bytes) there is right now,
+ * which may be none, and set *data to point at it. ring_room
+ * claims the whole capacity once the consumer's abandoned the
+ * ring, since anything written is thrown away anyway.
+ */
+size_t ring_room(ring *r, byte **data) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    *data = r->buffer + (head & (r->capacity - 1));
+    if (atomic_load_explicit(&r->abandoned, memory_order_relaxed)) {
+        return r->capacity;
+    }
+    return r->capacity
+        - (head - atomic_load_explicit(&r->tail, memory_order_acquire));
+}
+
+size_t ring_avail(ring *r, const byte **data) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    *data = r->buffer + (tail & (r->capacity - 1));
+    return atomic_load(&r->head) - tail;
+}
+
+/* For the consumer, which has peeked at have bytes so far:
+ * wait up to ns nanoseconds for there to be more (or for the
+ * producer to close the ring), and return whether there are.
+ * This works just like ring_sleep, except that it gives up at
+ * the deadline.
+ */
+int ring_wait_read(ring *r, size_t have, word ns) {
+    ring *w = r->waits;
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    /* (condition variables time out by the wall clock) */
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    ns += until.tv_nsec;
+    until.tv_sec += ns / 1000000000;
+    until.tv_nsec = ns % 1000000000;
+    pthread_mutex_lock(&w->lock);
+    atomic_fetch_add(&w->sleepers, 1);
+    int ready, timed_out = 0;
+    for (;;) {
+        ready = atomic_load(&r->head) - tail > have
+            || atomic_load(&r->closed);
+        if (ready || timed_out) break;
+        timed_out = pthread_cond_timedwait(&w->wake, &w->lock, &until)
+            == ETIMEDOUT;
+    }
+    atomic_fetch_sub(&w->sleepers, 1);
+    pthread_mutex_unlock(&w->lock);
+    return ready;
+}
+
+/* Copy as much of the count bytes at data into the ring as
+ * there's room for right now (which may be none), or as much
+ * out of it into data as there is, and return how much that
+ * was. ring_write_some always claims to have written
+ * everything once the consumer's abandoned the ring.
+ */
+size_t ring_write_some(ring *r, const byte *data, size_t count) {
+    if (atomic_load_explicit(&r->abandoned, memory_order_relaxed)) return count;
+    byte *room;
+    size_t size = ring_room(r, &room);
+    if (size > count) size = count;
+    memcpy(room, data, size);
+    ring_commit(r, size);
+    return size;
+}
+
+size_t ring_read_some(ring *r, byte *data, size_t count) {
+    const byte *avail;
+    size_t size = ring_avail(r, &avail);
+    if (size > count) size = count;
+    memcpy(data, avail, size);
+    ring_consume(r, size);
+    return size;
+}
+
+/* Whether the producer has closed the ring and the consumer
+ * has read everything in it. Only the consumer may ask. */
+int ring_finished(ring *r) {
+    /* (closed first: see ring_peek) */
+    return atomic_load(&r->closed)
+        && atomic_load(&r->head) == atomic_load_explicit(&r->tail,
+                memory_order_relaxed);
+}
+
+/* Called by the producer once it's written everything. */
+void ring_close(ring *r) {
+    atomic_store(&r->closed, 1);
+    ring_wake(r);
+}
+
+/* Called by the consumer if it's going to stop reading. */
+void ring_abandon(ring *r) {
+    atomic_store(&r->abandoned, 1);
+    ring_wake(r);
+}
+
+/* Have r sleep and wake with with's lock and condition
+ * variable, so that ring_wait_pair can wait on both. Only
+ * before anybody's using either of them. */
+void ring_share_waits(ring *r, ring *with) {
+    r->waits = with->waits;
+}
+
+/* For a thread that's the producer of to and the consumer of
+ * from, which share their waits: block until there's room to
+ * write to to or something to read from from (or either has
+ * been abandoned or closed, as the case may be). to may be
+ * NULL, to only wait for from. This works just like
+ * ring_sleep, except that both rings' moves wake us, since
+ * they wake the same sleepers.
+ */
+void ring_wait_pair(ring *to, ring *from) {
+    ring *w = from->waits;
+    pthread_mutex_lock(&w->lock);
+    atomic_fetch_add(&w->sleepers, 1);
+    while (atomic_load(&from->head) == atomic_load(&from->tail)
+            && !atomic_load(&from->closed)
+            && (!to || (atomic_load(&to->head) - atomic_load(&to->tail)
+                    == to->capacity && !atomic_load(&to->abandoned)))) {
+        pthread_cond_wait(&w->wake, &w->lock);
+    }
+    atomic_fetch_sub(&w->sleepers, 1);
+    pthread_mutex_unlock(&w->lock);
+}
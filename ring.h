@@ -0,0 +1,74 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "general.h"
+
+/* How many bytes a ring holds. A few bytes_out buffers' worth,
+ * so that the producer can hand over a whole buffer and get on
+ * with filling the next one while the consumer catches up. */
+#define RING_SIZE ((size_t)1 << 19)
+
+/* A single-producer, single-consumer queue of bytes, for
+ * connecting two stages running on different threads in place
+ * of a pipe.
+ *
+ * The buffer is mapped twice, one copy straight after the
+ * other, so the same bytes turn up again at buffer + capacity.
+ * That way, anything in the ring (or any room in it) is all in
+ * one piece, however it wraps around the end, and the two ends
+ * can work on it where it is: the producer reserves room and
+ * writes right into it, and the consumer peeks at what's there
+ * and reads it without copying it out.
+ *
+ * head and tail count the bytes ever written and read; what's
+ * buffered is everything between them (modulo the capacity).
+ * Only the producer moves head and only the consumer moves
+ * tail, so neither needs a lock to do so, and they're kept on
+ * separate cache lines so that the two threads aren't fighting
+ * over one. The lock is only for going to sleep when there's
+ * nothing to do (the ring is empty or full) and being woken up
+ * again.
+ */
+typedef struct ring {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+
+    _Alignas(64) byte *buffer;
+    /* a power of 2, and a whole number of pages */
+    size_t capacity;
+
+    /* set by the producer when it's done writing */
+    atomic_bool closed;
+    /* set by the consumer when it won't read any more; after
+     * that, writes are just thrown away */
+    atomic_bool abandoned;
+
+    /* how many threads are (about to be) asleep on wake */
+    atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+
+    /* the ring whose sleepers, lock and wake to use: normally
+     * this one, but two rings can share one set (see
+     * ring_share_waits), so that a thread at one end of each
+     * can wait for either of them at once */
+    struct ring *waits;
+} ring;
+
+int ring_init(ring *r);
+void ring_free(ring *r);
+void ring_reset(ring *r);
+byte *ring_reserve(ring *r, size_t count);
+void ring_commit(ring *r, size_t count);
+size_t ring_peek(ring *r, size_t have, const byte **data);
+void ring_consume(ring *r, size_t count);
+size_t ring_room(ring *r, byte **data);
+size_t ring_avail(ring *r, const byte **data);
+size_t ring_write_some(ring *r, const byte *data, size_t count);
+size_t ring_read_some(ring *r, byte *data, size_t count);
+int ring_wait_read(ring *r, size_t have, word ns);
+int ring_finished(ring *r);
+void ring_close(ring *r);
+void ring_abandon(ring *r);
+void ring_share_waits(ring *r, ring *with);
+void ring_wait_pair(ring *to, ring *from);
@@ -0,0 +1,397 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "byte_io.h"
+#include "pool.h"
+#include "slab.h"
+#include "options.h"
+#include "stats.h"
+#include "hamming.h"
+#include "secded.h"
+
+/* Each codeword is 8 bytes of data, as is, followed by a check
+ * byte. (Keeping the data bits together like this, rather than
+ * interleaving them with the check bits as in the textbook
+ * layout, means that encoding and decoding clean data is just
+ * copying it and working out one byte.)
+ *
+ * The low 7 bits of the check byte are an ordinary Hamming
+ * code: give each data bit a distinct 7-bit "position" that
+ * isn't a power of 2 (there are just enough from 3 to 71),
+ * and make the check bits the XOR of the positions of the data
+ * bits that are set. If one data bit flips, the check bits
+ * worked out from the received data differ from the received
+ * check bits by exactly that bit's position; if a check bit
+ * flips, by a power of 2. That difference is the syndrome.
+ * The top bit of the check byte makes the parity of the whole
+ * codeword even, which is what tells one error (odd parity,
+ * so the syndrome says which bit) from two (even parity, but
+ * a nonzero syndrome).
+ *
+ * All of that is linear, so the whole check byte (top bit
+ * included) is the XOR of what each data byte contributes to
+ * it, and we can look those up in a table indexed by the
+ * byte's value and where it is in the word.
+ */
+
+/* what each data byte contributes to the check byte */
+static byte check_table[SECDED_DATA][1 << 8];
+
+/* What to do about each syndrome (here, the computed check
+ * byte XOR the received one): flip data bit n, for n < 64,
+ * or one of these. */
+#define FIX_NOTHING 64
+/* (the error was in the check byte, so the data is fine) */
+#define FIX_CHECK 65
+#define FIX_DOUBLE 66
+static byte fix_table[1 << 8];
+
+static byte parity(word x) {
+    byte p = 0;
+    for (; x; x &= x - 1) p ^= 1;
+    return p;
+}
+
+static void build_tables(void) {
+    byte position[64];
+    for (int p = 3, i = 0; i < 64; p++) {
+        if (p & (p - 1)) position[i++] = p;
+    }
+    for (int k = 0; k < SECDED_DATA; k++) {
+        for (int x = 0; x < 1 << 8; x++) {
+            byte check = 0;
+            for (int b = 0; b < 8; b++) {
+                if (!(x & 1 << b)) continue;
+                byte p = position[8 * k + b];
+                /* the data bit and its check bits, to the
+                 * overall parity */
+                check ^= p | (1 ^ parity(p)) << 7;
+            }
+            check_table[k][x] = check;
+        }
+    }
+    for (int s = 0; s < 1 << 8; s++) {
+        /* the parity of the received codeword (see above for
+         * why this is the same as the top bit of the syndrome
+         * corrected for the parity of the rest) */
+        byte low = s & 0x7F, odd = (s >> 7) ^ parity(low);
+        if (!s) fix_table[s] = FIX_NOTHING;
+        else if (!odd) fix_table[s] = FIX_DOUBLE;
+        else if (!(low & (low - 1))) fix_table[s] = FIX_CHECK;
+        else {
+            /* (a position we never gave out means at least
+             * three errors) */
+            fix_table[s] = FIX_DOUBLE;
+            for (int i = 0; i < 64; i++) {
+                if (position[i] == low) fix_table[s] = i;
+            }
+        }
+    }
+}
+
+/* (The same as hamming_init.) */
+static void secded_init(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, build_tables);
+}
+
+static inline byte check_byte(const byte *data) {
+    return check_table[0][data[0]] ^ check_table[1][data[1]]
+         ^ check_table[2][data[2]] ^ check_table[3][data[3]]
+         ^ check_table[4][data[4]] ^ check_table[5][data[5]]
+         ^ check_table[6][data[6]] ^ check_table[7][data[7]];
+}
+
+/* Encode count codewords' worth of data (8 * count bytes) from
+ * in, writing 9 * count bytes to out.
+ */
+void secded_encode_block(const byte *in, byte *out, size_t count) {
+    secded_init();
+    for (size_t i = 0; i < count; i++) {
+        memcpy(out, in, SECDED_DATA);
+        out[SECDED_DATA] = check_byte(in);
+        in += SECDED_DATA;
+        out += SECDED_CODE;
+    }
+}
+
+/* Decode count codewords (9 * count bytes) from in, writing
+ * 8 * count bytes to out. Like hamming_decode_block, returns
+ * the HAMMING_* flags raised (only the _LO ones, since there's
+ * only one codeword per symbol).
+ */
+byte secded_decode_block(const byte *in, byte *out, size_t count) {
+    secded_init();
+    byte flags = 0;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(out, in, SECDED_DATA);
+        byte syndrome = check_byte(in) ^ in[SECDED_DATA];
+        if (syndrome) {
+            byte fix = fix_table[syndrome];
+            if (fix < 64) out[fix >> 3] ^= 1 << (fix & 7);
+            flags |= fix == FIX_DOUBLE ? HAMMING_DOUBLE_LO
+                                       : HAMMING_CORRECTED_LO;
+        }
+        in += SECDED_CODE;
+        out += SECDED_DATA;
+    }
+    return flags;
+}
+
+/* Follow up on the flags secded_decode_block returned for
+ * count codewords from in: count what happened, with --stats,
+ * and complain about double errors (as hamming.c does for
+ * Hamming(8, 4)).
+ */
+static void look_closer(const byte *in, size_t count, byte flags,
+        word *corrected, word *uncorrectable, whine_limit *limit) {
+    if (!flags || (!corrected && !(flags & HAMMING_DOUBLE))) return;
+    for (size_t i = 0; i < count; i++, in += SECDED_CODE) {
+        byte syndrome = check_byte(in) ^ in[SECDED_DATA];
+        if (!syndrome) continue;
+        byte twice = fix_table[syndrome] == FIX_DOUBLE;
+        if (corrected) {
+            *corrected += !twice;
+            *uncorrectable += twice;
+        }
+        if (twice && limit) {
+            whine(limit, "hamming_decode: double error in word "
+                    "%02x%02x%02x%02x%02x%02x%02x%02x %02x\n",
+                    in[0], in[1], in[2], in[3],
+                    in[4], in[5], in[6], in[7], in[8]);
+        }
+    }
+}
+
+/* The input doesn't have to be a whole number of codewords'
+ * worth, so the last codeword is always padded: the last byte
+ * of its data says how many bytes of padding (itself
+ * included) there are, from 1 to 8. (If the input comes out
+ * even, that's a codeword of nothing but padding.) Whatever's
+ * writing or reading the data keeps hold of the last
+ * incomplete or decoded word here until it knows it's the
+ * last.
+ */
+typedef struct secded_sink {
+    bytes_out *out;
+    whine_limit limit;
+    byte held[SECDED_DATA];
+    size_t held_length;
+} secded_sink;
+
+/* Write the last codeword, from held_length leftover bytes. */
+static void encode_last(secded_sink *s) {
+    byte data[SECDED_DATA] = {0};
+    memcpy(data, s->held, s->held_length);
+    data[SECDED_DATA - 1] = SECDED_DATA - s->held_length;
+    secded_encode_block(data, reserve_bytes(s->out, SECDED_CODE), 1);
+    commit_bytes(s->out, SECDED_CODE);
+}
+
+/* Write the last word, now that we know it is, without its
+ * padding. */
+static void decode_last(secded_sink *s) {
+    if (!s->held_length) return;
+    byte padding = s->held[SECDED_DATA - 1];
+    if (padding < 1 || padding > SECDED_DATA) {
+        stage_complain(s->limit.error, "hamming_decode: bad padding "
+                "at the end; input is probably corrupt\n");
+        padding = 0;
+    }
+    write_bytes(s->out, s->held, SECDED_DATA - padding);
+}
+
+/* Write count decoded words from data, except for the last,
+ * which we hold on to instead, writing the one we held before.
+ */
+static void write_decoded(secded_sink *s, const byte *data, size_t count) {
+    if (!count) return;
+    write_bytes(s->out, s->held, s->held_length);
+    size_t length = count * SECDED_DATA - SECDED_DATA;
+    write_bytes(s->out, data, length);
+    memcpy(s->held, data + length, SECDED_DATA);
+    s->held_length = SECDED_DATA;
+}
+
+/* With more than one job, coding is done on a pool of threads,
+ * as hamming.c does for Hamming(8, 4): each chunk is this many
+ * codewords, about 1 MiB. */
+#define SECDED_CHUNK ((size_t)1 << 17)
+
+/* Chunks come from a slab, as in hamming.c, with room for the
+ * output and a copy of the input after them. */
+typedef struct secded_chunk {
+    pool_task task;
+    /* the slab to put it back in */
+    slab *from;
+    const byte *input;
+    byte *output;
+    /* of the input */
+    size_t length;
+    /* from secded_decode_block */
+    byte flags;
+    /* from look_closer, with --stats (if count_stats is set) */
+    byte count_stats;
+    word corrected, uncorrectable;
+} secded_chunk;
+
+static void run_encode_chunk(pool_task *t, size_t worker) {
+    secded_chunk *c = (secded_chunk *)t;
+    secded_encode_block(c->input, c->output, c->length / SECDED_DATA);
+}
+
+static void run_decode_chunk(pool_task *t, size_t worker) {
+    secded_chunk *c = (secded_chunk *)t;
+    size_t count = c->length / SECDED_CODE;
+    c->flags = secded_decode_block(c->input, c->output, count);
+    c->corrected = c->uncorrectable = 0;
+    if (c->count_stats) {
+        look_closer(c->input, count, c->flags,
+                &c->corrected, &c->uncorrectable, NULL);
+    }
+}
+
+/* What next_chunk needs to know. */
+typedef struct chunk_source {
+    bytes_in *in;
+    byte decoding, count_stats;
+    slab chunks;
+} chunk_source;
+
+/* the most input and output a chunk can have */
+#define CHUNK_INPUT(decoding) \
+    (SECDED_CHUNK * ((decoding) ? SECDED_CODE : SECDED_DATA))
+#define CHUNK_OUTPUT(decoding) \
+    (SECDED_CHUNK * ((decoding) ? SECDED_DATA : SECDED_CODE))
+
+/* Take the next chunk of input, if there's any left. */
+static pool_task *next_chunk(void *source) {
+    chunk_source *src = source;
+    secded_chunk *c = slab_get(&src->chunks);
+    c->from = &src->chunks;
+    c->count_stats = src->count_stats;
+    c->output = (byte *)(c + 1);
+    c->length = take_bytes_into(src->in, CHUNK_INPUT(src->decoding),
+            &c->input, c->output + CHUNK_OUTPUT(src->decoding));
+    if (!c->length) {
+        slab_put(c->from, c);
+        return NULL;
+    }
+    c->task.run = src->decoding ? run_decode_chunk : run_encode_chunk;
+    return &c->task;
+}
+
+/* (Only the last chunk can have any bytes left over.) */
+static void finish_encode_chunk(pool_task *t, void *sink) {
+    secded_chunk *c = (secded_chunk *)t;
+    secded_sink *s = sink;
+    size_t count = c->length / SECDED_DATA;
+    write_bytes(s->out, c->output, count * SECDED_CODE);
+    s->held_length = c->length - count * SECDED_DATA;
+    memcpy(s->held, c->input + count * SECDED_DATA, s->held_length);
+    slab_put(c->from, c);
+}
+
+static void finish_decode_chunk(pool_task *t, void *sink) {
+    secded_chunk *c = (secded_chunk *)t;
+    secded_sink *s = sink;
+    size_t count = c->length / SECDED_CODE;
+    if (c->flags & HAMMING_DOUBLE) {
+        look_closer(c->input, count, c->flags, NULL, NULL, &s->limit);
+    }
+    if (s->out->stats) {
+        s->out->stats->corrected += c->corrected;
+        s->out->stats->uncorrectable += c->uncorrectable;
+    }
+    write_decoded(s, c->output, count);
+    if (c->length % SECDED_CODE) {
+        stage_complain(s->limit.error, "hamming_decode: %zu stray bytes "
+                "at the end\n", c->length % SECDED_CODE);
+    }
+    slab_put(c->from, c);
+}
+
+static void secded_parallel(bytes_in *in, byte decoding, const options *o,
+        void (*finish)(pool_task *t, void *sink), secded_sink *sink) {
+    chunk_source src = {in, decoding, o->stats};
+    slab_init(&src.chunks, sizeof(secded_chunk) + CHUNK_OUTPUT(decoding)
+            + CHUNK_INPUT(decoding) + BYTES_SLACK, in->stats);
+    pool p;
+    pool_init(&p, o->jobs);
+    pool_ordered(&p, 2 * o->jobs + 1, next_chunk, &src, finish, sink);
+    pool_free(&p);
+    slab_free(&src.chunks, NULL);
+}
+
+/* Encode the rest of in with Hamming(72, 64), writing to out,
+ * with settings o. (hamming_encode has already written the
+ * header.)
+ */
+void secded_encode(bytes_in *in, bytes_out *out, const options *o) {
+    secded_sink s = {out, WHINE_LIMIT(NULL, NULL), {0}, 0};
+    if (o->jobs > 1) {
+        secded_parallel(in, 0, o, finish_encode_chunk, &s);
+        encode_last(&s);
+        return;
+    }
+    const byte *data;
+    size_t avail;
+    while ((avail = peek_bytes(in, SECDED_DATA, &data)) >= SECDED_DATA) {
+        size_t count = avail / SECDED_DATA;
+        if (count > BYTES_BUFFER_SIZE / SECDED_CODE) {
+            count = BYTES_BUFFER_SIZE / SECDED_CODE;
+        }
+        secded_encode_block(data,
+                reserve_bytes(out, count * SECDED_CODE), count);
+        commit_bytes(out, count * SECDED_CODE);
+        consume_bytes(in, count * SECDED_DATA);
+    }
+    memcpy(s.held, data, avail);
+    s.held_length = avail;
+    consume_bytes(in, avail);
+    encode_last(&s);
+}
+
+/* Decode the rest of in with Hamming(72, 64), writing to out,
+ * with settings o. (hamming_decode has already read the
+ * header.)
+ */
+void secded_decode(bytes_in *in, bytes_out *out, const options *o) {
+    secded_sink s = {out, WHINE_LIMIT("hamming_decode", o->error), {0}, 0};
+    if (o->jobs > 1) {
+        secded_parallel(in, 1, o, finish_decode_chunk, &s);
+        decode_last(&s);
+        whine_done(&s.limit);
+        return;
+    }
+    const byte *data;
+    size_t avail;
+    while ((avail = peek_bytes(in, SECDED_CODE, &data)) >= SECDED_CODE) {
+        size_t count = avail / SECDED_CODE;
+        if (count > BYTES_BUFFER_SIZE / SECDED_DATA - 1) {
+            count = BYTES_BUFFER_SIZE / SECDED_DATA - 1;
+        }
+        /* this is write_decoded, but decoding straight into
+         * out's buffer, after the word we were holding */
+        size_t held = s.held_length;
+        byte *decoded = reserve_bytes(out, held + count * SECDED_DATA);
+        memcpy(decoded, s.held, held);
+        byte flags = secded_decode_block(data, decoded + held, count);
+        stage_stats *stats = out->stats;
+        look_closer(data, count, flags, stats ? &stats->corrected : NULL,
+                stats ? &stats->uncorrectable : NULL, &s.limit);
+        size_t length = held + count * SECDED_DATA - SECDED_DATA;
+        commit_bytes(out, length);
+        memcpy(s.held, decoded + length, SECDED_DATA);
+        s.held_length = SECDED_DATA;
+        consume_bytes(in, count * SECDED_CODE);
+    }
+    if (avail) {
+        stage_complain(s.limit.error, "hamming_decode: %zu stray bytes "
+                "at the end\n", avail);
+        consume_bytes(in, avail);
+    }
+    decode_last(&s);
+    whine_done(&s.limit);
+}
@@ -0,0 +1,23 @@
+#include "general.h"
+
+/* The wide code: extended Hamming(72, 64), which protects each
+ * 8 bytes of data with 1 check byte, so it only costs 12.5%
+ * where Hamming(8, 4) costs 100%. Like Hamming(8, 4), it
+ * corrects any single bit error in a codeword and detects any
+ * two (SECDED: single error correcting, double error
+ * detecting); the price is that a codeword is 72 bits long
+ * instead of 8, so there's less room for errors per bit. For
+ * the error rates we see, that's plenty.
+ * These use the HAMMING_* flags from hamming.h, so include
+ * that first (and byte_io.h before it).
+ */
+
+/* bytes of data and of code per codeword */
+#define SECDED_DATA 8
+#define SECDED_CODE 9
+
+void secded_encode_block(const byte *in, byte *out, size_t count);
+byte secded_decode_block(const byte *in, byte *out, size_t count);
+
+void secded_encode(bytes_in *in, bytes_out *out, const struct options *o);
+void secded_decode(bytes_in *in, bytes_out *out, const struct options *o);
@@ -0,0 +1,70 @@
+#include <stdlib.h>
+
+#include "stats.h"
+#include "slab.h"
+
+/* Each region starts with a cache line of its own, to point
+ * to the region before it (and keep the blocks aligned), then
+ * its count, then the blocks. */
+#define SLAB_LINE 64
+
+void slab_init(slab *s, size_t size, struct stage_stats *stats) {
+    s->size = (size + SLAB_LINE - 1) & ~(size_t)(SLAB_LINE - 1);
+    s->next_count = 1;
+    s->free = NULL;
+    s->regions = NULL;
+    s->stats = stats;
+}
+
+/* Add a region of s->next_count blocks to the free list. It's
+ * calloc'd, which for anything big means fresh pages straight
+ * from the kernel, so untouched blocks cost nothing but
+ * address space. */
+static void slab_grow(slab *s) {
+    size_t count = s->next_count;
+    byte *region = calloc(1, SLAB_LINE + count * s->size);
+    *(void **)region = s->regions;
+    *(size_t *)(region + sizeof(void *)) = count;
+    s->regions = region;
+    for (size_t i = count; i-- > 0;) {
+        void *block = region + SLAB_LINE + i * s->size;
+        *(void **)block = s->free;
+        s->free = block;
+    }
+    s->next_count = 2 * count;
+    if (s->stats) s->stats->slab_bytes += SLAB_LINE + count * s->size;
+}
+
+void *slab_get(slab *s) {
+    if (!s->free) slab_grow(s);
+    else if (s->stats) s->stats->slab_reuses++;
+    void *block = s->free;
+    s->free = *(void **)block;
+    *(void **)block = NULL;
+    return block;
+}
+
+void slab_put(slab *s, void *block) {
+    *(void **)block = s->free;
+    s->free = block;
+}
+
+/* Free everything, with one free() per region. Any blocks
+ * still out are freed along with the rest. If drop isn't
+ * NULL, it's called first on every block that's ever been
+ * handed out (or might have been), for blocks that hold on to
+ * memory of their own from one use to the next.
+ */
+void slab_free(slab *s, void (*drop)(void *block)) {
+    for (byte *region = s->regions; region;) {
+        byte *before = *(void **)region;
+        if (drop) {
+            size_t count = *(size_t *)(region + sizeof(void *));
+            for (size_t i = 0; i < count; i++) {
+                drop(region + SLAB_LINE + i * s->size);
+            }
+        }
+        free(region);
+        region = before;
+    }
+}
@@ -0,0 +1,36 @@
+#include "general.h"
+
+/* A slab: a stash of blocks of memory all the same size, for
+ * stages that go through lots of them a few at a time (a pool's
+ * worth of chunks in flight; see pool_ordered). Rather than
+ * asking malloc for a fresh block for every chunk (and, for
+ * ones as big as ours, having the kernel fault in fresh pages
+ * for it), they take blocks from the slab and put them back,
+ * and keep reusing the same few.
+ * Blocks come out of regions of several at a time, each twice
+ * as many as the last, so there are only ever a handful of
+ * regions to free at the end, however many times the blocks
+ * went round. A block comes zeroed the first time it's handed
+ * out, and is otherwise left as it was put back, except for
+ * its first pointer's worth, which the slab uses to keep track
+ * of free blocks. Only one thread may use a slab.
+ */
+typedef struct slab {
+    /* of each block (rounded up to a whole number of cache
+     * lines) */
+    size_t size;
+    /* how many blocks the next region gets */
+    size_t next_count;
+    /* the free blocks, each pointing to the next */
+    void *free;
+    /* the regions, each pointing to the one before */
+    void *regions;
+    /* if this isn't NULL, where to count bytes reserved and
+     * blocks reused (slab_bytes and slab_reuses) */
+    struct stage_stats *stats;
+} slab;
+
+void slab_init(slab *s, size_t size, struct stage_stats *stats);
+void *slab_get(slab *s);
+void slab_put(slab *s, void *block);
+void slab_free(slab *s, void (*drop)(void *block));
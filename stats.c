@@ -0,0 +1,183 @@
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "byte_io.h"
+#include "stats.h"
+
+void stats_init(stage_stats *s, const char *stage) {
+    *s = (stage_stats){0};
+    s->stage = stage;
+    s->start_ns = s->reported_ns = stats_now();
+}
+
+/* Nanoseconds since some fixed point. (clock_gettime doesn't
+ * even need to enter the kernel for this on Linux, so it's
+ * cheap enough to call once per bufferful.) */
+word stats_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (word)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Count the time since since as spent waiting, and report if
+ * it's been long enough since the last time. (This is called
+ * after every blocking read or write, which is as good a time
+ * as any to check the clock, since we just have.)
+ */
+void stats_waited(stage_stats *s, word since) {
+    word now = stats_now();
+    s->wait_ns += now - since;
+    if (now - s->reported_ns >= STATS_INTERVAL_NS) stats_report(s, 0);
+}
+
+/* Write a line of JSON about s to standard error:
+ *
+ *     {"stage": "hamming_decode", "pid": 1234, "final": true,
+ *      "seconds": 1.52, "bytes_in": 33554432, ...}
+ *
+ * (all on one line). Each stage reports for itself, and there
+ * might be several in different processes writing to the same
+ * place, so the line goes out in a single write(), which the
+ * kernel won't interleave with anyone else's (for a pipe, as
+ * long as it's under PIPE_BUF bytes, which it is).
+ */
+void stats_report(stage_stats *s, byte final) {
+    if (s->memory_in) s->bytes_in = s->memory_in->start;
+    word now = stats_now(),
+         elapsed = now - s->start_ns,
+         compute = elapsed > s->wait_ns ? elapsed - s->wait_ns : 0;
+    char line[640];
+    int length = snprintf(line, sizeof(line),
+            "{\"stage\": \"%s\", \"pid\": %ld, \"final\": %s, "
+            "\"seconds\": %.6f, \"bytes_in\": %ju, \"bytes_out\": %ju, "
+            "\"mb_per_s\": %.2f, \"compute_ns\": %ju, \"wait_ns\": %ju, "
+            "\"corrected\": %ju, \"uncorrectable\": %ju, "
+            "\"dict_entries\": %ju, \"code_bits\": %d, "
+            "\"dict_resets\": %ju, \"blocks\": %ju, \"stored\": %ju, "
+            "\"syncs\": %ju, \"flips\": %ju, \"slab_bytes\": %ju, "
+            "\"slab_reuses\": %ju}\n",
+            s->stage, (long)getpid(), final ? "true" : "false",
+            elapsed * 1e-9, (uintmax_t)s->bytes_in, (uintmax_t)s->bytes_out,
+            elapsed ? s->bytes_in * 1e3 / elapsed : 0.0,
+            (uintmax_t)compute, (uintmax_t)s->wait_ns,
+            (uintmax_t)s->corrected, (uintmax_t)s->uncorrectable,
+            (uintmax_t)s->dict_entries, s->code_bits,
+            (uintmax_t)s->dict_resets, (uintmax_t)s->blocks,
+            (uintmax_t)s->stored, (uintmax_t)s->syncs, (uintmax_t)s->flips,
+            (uintmax_t)s->slab_bytes, (uintmax_t)s->slab_reuses);
+    if (length > (int)sizeof(line) - 1) length = sizeof(line) - 1;
+    write(STDERR_FILENO, line, length);
+    s->reported_ns = now;
+}
+
+void stage_error_init(stage_error *e) {
+    pthread_mutex_init(&e->lock, NULL);
+    stage_error_clear(e);
+}
+
+/* Forget about anything that went wrong, for a fresh start.
+ * Nobody may be using it. */
+void stage_error_clear(stage_error *e) {
+    e->status = 0;
+    e->complaints = 0;
+    e->message[0] = '\0';
+}
+
+void stage_error_free(stage_error *e) {
+    pthread_mutex_destroy(&e->lock);
+}
+
+static void vcomplain(stage_error *e, const char *format, va_list args) {
+    if (!e) {
+        vfprintf(stderr, format, args);
+        return;
+    }
+    pthread_mutex_lock(&e->lock);
+    e->complaints++;
+    if (!e->message[0]) vsnprintf(e->message, sizeof e->message, format, args);
+    pthread_mutex_unlock(&e->lock);
+}
+
+/* Say what's wrong with the input, and carry on. With e NULL,
+ * that's just WHINE. */
+void stage_complain(stage_error *e, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vcomplain(e, format, args);
+    va_end(args);
+}
+
+/* Say why we're giving up, and give up: with e NULL, that
+ * means exiting with status; otherwise, it's recorded in e (if
+ * nothing else has given up first) and we return, and it's up
+ * to the caller to stop what it's doing, and to anything else
+ * that might still be running to notice stage_failed.
+ */
+void stage_fail(stage_error *e, int status, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (!e) {
+        vfprintf(stderr, format, args);
+        exit(status);
+    }
+    pthread_mutex_lock(&e->lock);
+    if (!e->status) {
+        e->status = status;
+        vsnprintf(e->message, sizeof e->message, format, args);
+    }
+    pthread_mutex_unlock(&e->lock);
+    va_end(args);
+}
+
+/* Whether something's called stage_fail on e: 0 if not, and
+ * the status it gave if so. (Never, for NULL, since it would
+ * have exited.) */
+int stage_failed(stage_error *e) {
+    if (!e) return 0;
+    pthread_mutex_lock(&e->lock);
+    int status = e->status;
+    pthread_mutex_unlock(&e->lock);
+    return status;
+}
+
+/* Whether the next complaint should go out. Complaints are
+ * counted in one-second windows; once a window is over, we say
+ * how many of its complaints we kept quiet about, if any.
+ */
+static int whine_ok(whine_limit *l) {
+    word now = stats_now();
+    if (now - l->window_ns >= 1000000000) {
+        whine_done(l);
+        l->window_ns = now;
+        l->count = 0;
+    }
+    if (l->count < WHINE_BURST) {
+        l->count++;
+        return 1;
+    }
+    l->suppressed++;
+    return 0;
+}
+
+/* Complain, if we haven't been doing too much of that lately
+ * (see whine_ok). An error to report to gets every one. */
+void whine(whine_limit *l, const char *format, ...) {
+    if (!l->error && !whine_ok(l)) return;
+    va_list args;
+    va_start(args, format);
+    vcomplain(l->error, format, args);
+    va_end(args);
+}
+
+/* Own up to any complaints we've kept quiet about. Call this
+ * once there won't be any more. */
+void whine_done(whine_limit *l) {
+    if (l->suppressed) {
+        WHINE("%s: ...and %ju more like that\n",
+                l->who, (uintmax_t)l->suppressed);
+        l->suppressed = 0;
+    }
+}
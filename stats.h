@@ -0,0 +1,106 @@
+#include <pthread.h>
+
+#include "general.h"
+
+/* How often (in nanoseconds) a stage running with --stats
+ * reports how it's getting on, besides once at the end. */
+#define STATS_INTERVAL_NS ((word)1000000000)
+
+/* Counters for one stage, with --stats. The stage's byte
+ * streams both point at these (see byte_io.h), which count
+ * bytes and time spent waiting on I/O as they go; the stages
+ * themselves fill in whichever of the rest apply to them. Only
+ * the stage's own thread touches them, so there's nothing to
+ * synchronize, and when --stats is off, all it costs is a NULL
+ * check per bufferful.
+ */
+typedef struct stage_stats {
+    const char *stage;
+    /* when the stage started and last reported */
+    word start_ns, reported_ns;
+
+    /* bytes read in and written out */
+    word bytes_in, bytes_out;
+    /* if the stage's input is in memory, where there's no
+     * reading to count, then this is it, and bytes_in is
+     * however far into it the stage has got */
+    const struct bytes_in *memory_in;
+    /* time spent blocked reading or writing */
+    word wait_ns;
+
+    /* Hamming symbols (one per byte of code) that had an error
+     * we corrected, and that had more than we could */
+    word corrected, uncorrectable;
+
+    /* the LZW dictionary as of the last check: how many codes
+     * are assigned, how wide they are, and how many times it's
+     * been cleared */
+    word dict_entries, dict_resets;
+    byte code_bits;
+    /* how many LZW blocks (or records) have gone by, how many
+     * bytes went in stored segments, and how many sync points
+     * there have been (with --flush-ms) */
+    word blocks, stored, syncs;
+
+    /* how many bits channel has flipped */
+    word flips;
+
+    /* how many bytes the stage's slabs (see slab.h) have
+     * allocated, and how many times they've handed out a block
+     * again instead of allocating one */
+    word slab_bytes, slab_reuses;
+} stage_stats;
+
+void stats_init(stage_stats *s, const char *stage);
+word stats_now(void);
+void stats_waited(stage_stats *s, word since);
+void stats_report(stage_stats *s, byte final);
+
+/* What went wrong in a stage, for when it's running inside
+ * some other program (see codec.h), which won't want us
+ * writing on its standard error, let alone exiting it. A
+ * stage's options point at one of these (options.error); when
+ * they don't, as on the command line, complaints go to
+ * standard error, and giving up means exiting with status
+ * (2 for settings that don't make sense, 3 for input that
+ * doesn't). A stage's workers can go wrong at the same time,
+ * hence the lock.
+ */
+typedef struct stage_error {
+    pthread_mutex_t lock;
+    /* 0 until the stage has given up, then the status it would
+     * have exited with */
+    int status;
+    /* how many complaints it's carried on after (a block that
+     * didn't match its checksum, say) */
+    word complaints;
+    /* why it gave up, or failing that, its first complaint */
+    char message[256];
+} stage_error;
+
+void stage_error_init(stage_error *e);
+void stage_error_clear(stage_error *e);
+void stage_error_free(stage_error *e);
+void stage_complain(stage_error *e, const char *format, ...);
+void stage_fail(stage_error *e, int status, const char *format, ...);
+int stage_failed(stage_error *e);
+
+/* For complaints that might come thick and fast, like one per
+ * corrupt symbol on a noisy channel. Writing every one of them
+ * to the terminal can end up slower than the work itself, and
+ * nobody reads past the first screenful anyway, so we let
+ * through WHINE_BURST a second and count the rest. (With an
+ * error to report to instead, they all just count.)
+ */
+#define WHINE_BURST 10
+
+typedef struct whine_limit {
+    /* what to call the complainer when summing up */
+    const char *who;
+    struct stage_error *error;
+    word window_ns, count, suppressed;
+} whine_limit;
+#define WHINE_LIMIT(who, error) ((whine_limit) {(who), (error), 0, 0, 0})
+
+void whine(whine_limit *l, const char *format, ...);
+void whine_done(whine_limit *l);
@@ -1,11 +1,26 @@
 SUB(compress,   lzw_encode)
 SUB(decompress, lzw_decode)
 SUB(lzw_id,     lzw_encode, lzw_decode)
+SUB(squeeze,    lzw_encode, huff_encode)
+SUB(unsqueeze,  huff_decode, lzw_decode)
+SUB(huff_id,    lzw_encode, huff_encode, huff_decode, lzw_decode)
 SUB(augment,    hamming_encode)
 SUB(correct,    hamming_decode)
 SUB(hamming_id, hamming_encode, hamming_decode)
 SUB(encode,     lzw_encode, hamming_encode)
 SUB(decode,     hamming_decode, lzw_decode)
+SUB(pack,       lzw_encode, huff_encode, hamming_encode)
+SUB(unpack,     hamming_decode, huff_decode, lzw_decode)
 SUB(full_id,    lzw_encode, hamming_encode, hamming_decode, lzw_decode)
+SUB(channel,    channel)
 #undef SUB
 
+
+/* Tools are subcommands that aren't pipelines: TOOL takes the
+ * name, the function to call (which returns main's exit
+ * status), and a description for the help message. */
+TOOL(bench,     bench, "time every subcommand above over generated data (-s)")
+TOOL(stress,    stress, "check that -s KiB of generated data round-trips through lzw_id")
+TOOL(verify,    verify, "check the checksums of a stream compressed with -C, without decompressing it")
+TOOL(train,     train, "write a preset dictionary (for -D) trained on the input")
+#undef TOOL
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "byte_io.h"
+#include "codetable.h"
+#include "options.h"
+#include "lzw.h"
+#include "lzw_dict.h"
+#include "train.h"
+
+/* Training a preset dictionary (see lzw_dict.h) on sample
+ * messages. We run the samples through LZW, much as
+ * lzw_encode would but without ever clearing the dictionary,
+ * and count how often each entry's word turned up, whether
+ * written as it is or as the start of a longer entry; the
+ * dictionary gets the entries that turned up most.
+ * (Picking the entries that saved the most, counting long ones
+ * for more, sounds better, but a long entry needs every entry
+ * it extends along with it; on a set of small JSON records,
+ * that did much worse for the same number of entries.)
+ * Entries that only turned up once are left out: they might
+ * just be a coincidence of the samples, and every entry costs
+ * something, since the more there are, the wider the code
+ * numbers.
+ */
+
+/* The most entries we learn from the samples before we stop
+ * adding more (the rest of the samples still count towards
+ * the scores of the ones we have). */
+#define TRAIN_MAX_ENTRIES ((word)1 << 20)
+
+/* What we know about each entry we've learned. */
+typedef struct train_entry {
+    /* the word it extends and the byte it extends it by, as
+     * in the dictionary file */
+    uint32_t prev;
+    byte last;
+    /* how often it was written (and later, how often it
+     * turned up at all) */
+    word uses;
+    /* once we've picked which to keep, its index in the
+     * dictionary, or 0 if it's not in it */
+    uint32_t kept;
+} train_entry;
+
+static train_entry *entries;
+
+/* Most used first, and oldest first among equals. */
+static int by_uses(const void *a_, const void *b_) {
+    uint32_t a = *(const uint32_t *)a_, b = *(const uint32_t *)b_;
+    if (entries[a].uses != entries[b].uses) {
+        return entries[a].uses < entries[b].uses ? 1 : -1;
+    }
+    return a < b ? -1 : a > b;
+}
+
+/* Note a use of code number code, if it's an entry. */
+static inline void count_use(word code) {
+    if (code >= LZW_FIRST) entries[code - LZW_FIRST].uses++;
+}
+
+/* The train tool: read samples from standard input (or
+ * --input), and write a dictionary trained on them to
+ * standard output. The dictionary gets at most enough entries
+ * to fill up the code numbers of --max-bits - 1 bits, which
+ * leaves the other half for lzw_encode to learn what's new
+ * about each message; so it's best to train with the same
+ * --max-bits as will be used for compressing.
+ */
+int train(void) {
+    bytes_in in;
+    if (opts.input) bytes_in_init_file(&in, opts.input);
+    else bytes_in_init(&in, STDIN_FILENO);
+
+    codetable dict;
+    codetable_init(&dict);
+    word count = 0, capacity = 1 << 16, total = 0;
+    entries = malloc(sizeof(train_entry) * capacity);
+    /* (as in lzw_encode, we start partway through a word) */
+    byte next_byte;
+    word dict_cur = 0;
+    int any = read_byte(&in, &next_byte);
+    if (any) dict_cur = next_byte;
+    const byte *data;
+    size_t avail;
+    while (any && (avail = peek_bytes(&in, 1, &data))) {
+        for (size_t i = 0; i < avail; i++) {
+            next_byte = data[i];
+            word key = codetable_key(&dict, dict_cur, next_byte);
+            codetable_slot *next = codetable_probe(&dict, key);
+            if (next->key == key) {
+                dict_cur = next->code;
+                continue;
+            }
+            count_use(dict_cur);
+            if (count < TRAIN_MAX_ENTRIES) {
+                if (count == capacity) {
+                    capacity *= 2;
+                    entries = realloc(entries, sizeof(train_entry) * capacity);
+                }
+                entries[count] = (train_entry){dict_cur, next_byte, 0, 0};
+                codetable_fill(&dict, next, key, LZW_FIRST + count++);
+            }
+            dict_cur = next_byte;
+        }
+        consume_bytes(&in, avail);
+        total += avail;
+    }
+    if (any) {
+        count_use(dict_cur);
+        total++;
+    }
+    codetable_free(&dict);
+    bytes_in_free(&in);
+
+    /* Every time an entry was written, so were the words it
+     * extends, in effect, so they count as used as well. Each
+     * entry comes before everything extending it, so going
+     * backwards, an entry's count is complete by the time we
+     * get to it, and it can pass it on. */
+    for (word i = count; i-- > 0;) {
+        if (entries[i].prev >= LZW_FIRST) {
+            entries[entries[i].prev - LZW_FIRST].uses += entries[i].uses;
+        }
+    }
+    /* Then we keep the most used entries. An entry is never
+     * used more than one it extends, and sorting breaks ties
+     * in favor of the older entry, so whatever we keep comes
+     * with what it extends. */
+    word limit = ((word)1 << (opts.max_bits - 1)) - LZW_FIRST, kept = 0;
+    uint32_t *order = malloc(sizeof(uint32_t) * (count ? count : 1));
+    for (word i = 0; i < count; i++) order[i] = i;
+    qsort(order, count, sizeof(uint32_t), by_uses);
+    for (; kept < count && kept < limit; kept++) {
+        if (entries[order[kept]].uses < 2) break;
+        /* (the numbers are only placeholders for now; any
+         * nonzero value will do) */
+        entries[order[kept]].kept = 1;
+    }
+    free(order);
+
+    /* An entry always comes after the one it extends, so if we
+     * keep them in the order we learned them, that's still
+     * true with the new numbering. */
+    byte *file = malloc(LZW_DICT_HEADER + 4 * kept);
+    byte *p = file + LZW_DICT_HEADER;
+    word next_code = LZW_FIRST;
+    for (word i = 0; i < count; i++) {
+        train_entry *e = &entries[i];
+        if (!e->kept) continue;
+        e->kept = next_code++;
+        word prev = e->prev < 256 ? e->prev : entries[e->prev - LZW_FIRST].kept;
+        lzw_put32(p, prev << 8 | e->last);
+        p += 4;
+    }
+    free(entries);
+    uint32_t id = lzw_dict_hash(file + LZW_DICT_HEADER, kept);
+    file[0] = 'L', file[1] = 'Z', file[2] = 'W', file[3] = 'd';
+    lzw_put32(file + 4, kept);
+    lzw_put32(file + 8, id);
+
+    bytes_out out;
+    bytes_out_init(&out, STDOUT_FILENO);
+    write_bytes(&out, file, LZW_DICT_HEADER + 4 * kept);
+    flush_bytes(&out);
+    bytes_out_free(&out);
+    free(file);
+    if (!opts.quiet) {
+        WHINE("train: dictionary %08jx: %ju entries from %ju bytes "
+                "of samples\n", (uintmax_t)id, (uintmax_t)kept,
+                (uintmax_t)total);
+    }
+    return 0;
+}
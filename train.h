@@ -0,0 +1,4 @@
+#include "general.h"
+
+/* Training a preset LZW dictionary on samples; see train.c. */
+int train(void);
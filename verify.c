@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "byte_io.h"
+#include "crc32c.h"
+#include "options.h"
+#include "lzw.h"
+#include "verify.h"
+
+/* Checking a stream compressed with --check (see lzw.h) for
+ * damage, without decompressing it: we just walk from frame
+ * to frame, working out each one's CRC and comparing it with
+ * the one in its header. That goes about as fast as the data
+ * can be read, so it's cheap enough to run over everything
+ * now and then. Each damaged frame gets a line of JSON on
+ * standard output, saying which frame it is (counting from 0)
+ * and where it starts in the stream:
+ *
+ *     {"frame": 3, "offset": 1572874, "problem": "checksum"}
+ *
+ * If a frame's header makes no sense, or the stream stops
+ * partway through a frame, there's no telling where the next
+ * frame would be, so that's as far as we can check (and the
+ * problem is "header" or "truncated"). Then comes a line
+ * summing up:
+ *
+ *     {"frames": 1024, "damaged": 1, "bytes": 402653312,
+ *      "seconds": 0.061, "mb_per_s": 6600.87, "ok": false}
+ *
+ * The exit status is 0 if nothing was damaged, and 1 if
+ * anything was.
+ */
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void report(word frame, word offset, const char *problem) {
+    printf("{\"frame\": %ju, \"offset\": %ju, \"problem\": \"%s\"}\n",
+            (uintmax_t)frame, (uintmax_t)offset, problem);
+}
+
+/* Check every frame from in, which has the flags given,
+ * adding up the bytes they take in *offset and the ones that
+ * are damaged in *damaged. Returns how many frames there
+ * were (up to the last one we could find). */
+static word check_frames(bytes_in *in, byte flags, word *offset,
+        word *damaged) {
+    /* (if the input isn't in memory, frames get read into
+     * this, which is grown as needed) */
+    byte *spare = NULL;
+    size_t spare_size = 0, got;
+    word frames = 0;
+    byte header[LZW_FRAME_HEADER + LZW_FRAME_CHECK];
+    const size_t size = LZW_FRAME_HEADER + LZW_FRAME_CHECK;
+    while ((got = read_bytes(in, header, size))) {
+        if (got < size) {
+            report(frames, *offset, "truncated");
+            ++*damaged;
+            break;
+        }
+        size_t length = lzw_get32(header + 4);
+        if (!lzw_frame_ok(lzw_get32(header), length, flags & LZW_RECORDS)) {
+            report(frames, *offset, "header");
+            ++*damaged;
+            break;
+        }
+        if (!bytes_in_memory(in) && spare_size < length) {
+            spare_size = length;
+            spare = realloc(spare, length + BYTES_SLACK);
+        }
+        const byte *data;
+        if (take_bytes_into(in, length, &data, spare) < length) {
+            report(frames, *offset, "truncated");
+            ++*damaged;
+            break;
+        }
+        uint32_t crc = crc32c(0, header, LZW_FRAME_HEADER);
+        if (crc32c(crc, data, length)
+                != lzw_get32(header + LZW_FRAME_HEADER)) {
+            report(frames, *offset, "checksum");
+            ++*damaged;
+        }
+        frames++;
+        *offset += size + length;
+    }
+    free(spare);
+    return frames;
+}
+
+/* The verify tool: check the stream on standard input (or
+ * --input); see above. */
+int verify(void) {
+    bytes_in in;
+    if (opts.input) bytes_in_init_file(&in, opts.input);
+    else bytes_in_init(&in, STDIN_FILENO);
+    double start = now();
+
+    /* First, the header (see lzw.h). Empty input is an empty
+     * stream, which lzw_decode takes happily, so we do too. */
+    byte header[6];
+    size_t got = read_bytes(&in, header, 2);
+    word frames = 0, damaged = 0, offset = got;
+    if (got) {
+        byte flags = header[1];
+        if (got < 2 || header[0] < LZW_MIN_BITS
+                || header[0] > LZW_MAX_BITS) {
+            WHINE("verify: bad header; input probably isn't from "
+                    "lzw_encode\n");
+            exit(3);
+        }
+        if (!(flags & LZW_CHECKED)) {
+            WHINE("verify: input has no checksums to verify "
+                    "(compress with --check)\n");
+            exit(2);
+        }
+        /* (which lzw_decode makes sure of, too) */
+        if (!(flags & (LZW_BLOCKS | LZW_RECORDS))) {
+            WHINE("verify: bad header; input is probably corrupt\n");
+            exit(3);
+        }
+        if (flags & LZW_PRESET) {
+            if (read_bytes(&in, header + 2, 4) < 4) {
+                WHINE("verify: input ends partway through its header\n");
+                exit(3);
+            }
+            offset += 4;
+        }
+        frames = check_frames(&in, flags, &offset, &damaged);
+    }
+    bytes_in_free(&in);
+
+    double seconds = now() - start;
+    printf("{\"frames\": %ju, \"damaged\": %ju, \"bytes\": %ju, "
+            "\"seconds\": %.3f, \"mb_per_s\": %.2f, \"ok\": %s}\n",
+            (uintmax_t)frames, (uintmax_t)damaged, (uintmax_t)offset,
+            seconds, seconds > 0 ? offset / seconds / 1e6 : 0.0,
+            damaged ? "false" : "true");
+    return damaged > 0;
+}
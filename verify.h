@@ -0,0 +1,4 @@
+#include "general.h"
+
+/* Checking a compressed stream's checksums; see verify.c. */
+int verify(void);